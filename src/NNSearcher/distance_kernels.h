@@ -0,0 +1,70 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+// Vectorized distance kernels for points stored as contiguous arrays of
+// float or double values. The kernels are compiled for several instruction
+// sets (SSE2, AVX2 + FMA, AVX-512) without requiring special compiler flags
+// for the whole package. The best variant supported by the CPU is chosen once
+// at runtime, so the same binary runs on all x86-64 machines. On other
+// architectures only the plain C++ kernels are available.
+//
+// Setting the environment variable ATRIAR_SIMD to "scalar", "sse2", "avx2"
+// or "avx512" before the first distance computation restricts the selection
+// to that instruction set (or a lower one, if it is not supported).
+//
+// All kernels compute in double precision. The euclidian kernels return the
+// squared distance, so that callers can choose whether to take the square
+// root. The thresholded kernels compare the partial distance with thresh
+// once per block of vector registers and return DBL_MAX as soon as it is
+// exceeded, just like the partial distance functors in metric.h.
+
+#include <type_traits>
+
+namespace distance_kernels {
+
+template <class T1, class T2> struct metric_kernels {
+  double (*euclidian)(const T1 *, const T2 *, const long);
+  double (*euclidian_thresh)(const T1 *, const T2 *, const long, const double);
+  double (*manhattan)(const T1 *, const T2 *, const long);
+  double (*manhattan_thresh)(const T1 *, const T2 *, const long, const double);
+  double (*maximum)(const T1 *, const T2 *, const long);
+  double (*maximum_thresh)(const T1 *, const T2 *, const long, const double);
+};
+
+struct kernel_table {
+  const char *name;
+  metric_kernels<float, double> float_double;
+  metric_kernels<float, float> float_float;
+  metric_kernels<double, double> double_double;
+};
+
+// The kernels selected for this CPU.
+const kernel_table &active_kernels();
+
+// Select the kernels for the combination of argument types.
+template <class T1, class T2> struct select;
+template <> struct select<float, double> {
+  static const metric_kernels<float, double> &
+  get(const kernel_table &t) { return t.float_double; }
+};
+template <> struct select<float, float> {
+  static const metric_kernels<float, float> &
+  get(const kernel_table &t) { return t.float_float; }
+};
+template <> struct select<double, double> {
+  static const metric_kernels<double, double> &
+  get(const kernel_table &t) { return t.double_double; }
+};
+
+// Kernels for (possibly const qualified) element types T1 and T2.
+template <class T1, class T2>
+inline const metric_kernels<typename std::remove_const<T1>::type,
+                            typename std::remove_const<T2>::type> &
+kernels_for(const kernel_table &t) {
+  return select<typename std::remove_const<T1>::type,
+                typename std::remove_const<T2>::type>::get(t);
+}
+
+} // namespace distance_kernels
+
+#endif
@@ -0,0 +1,155 @@
+// Kernel bodies shared by all instruction sets. This file has no include
+// guard, distance_kernels.cpp includes it once per instruction set, each time
+// inside a separate namespace that defines the vector type vec, the number of
+// doubles per vector LANES, the function attribute KERNEL_TARGET and the
+// vector operations vzero, vload, vsub, vadd, vfmadd, vabs, vmax, vhsum and
+// vhmax.
+
+template <class T1, class T2>
+KERNEL_TARGET double euclidian(const T1 *a, const T2 *b, const long n) {
+  vec s0 = vzero();
+  vec s1 = vzero();
+  long i = 0;
+  for (; i + 2 * LANES <= n; i += 2 * LANES) {
+    const vec d0 = vsub(vload(a + i), vload(b + i));
+    const vec d1 = vsub(vload(a + i + LANES), vload(b + i + LANES));
+    s0 = vfmadd(d0, d0, s0);
+    s1 = vfmadd(d1, d1, s1);
+  }
+  double sum = vhsum(vadd(s0, s1));
+  for (; i < n; i++) {
+    const double d = (double)a[i] - (double)b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+// t is the threshold for the squared distance.
+template <class T1, class T2>
+KERNEL_TARGET double euclidian_thresh(const T1 *a, const T2 *b, const long n,
+                                      const double t) {
+  vec s0 = vzero();
+  vec s1 = vzero();
+  long i = 0;
+  while (i + 4 * LANES <= n) {
+    for (const long end = i + 4 * LANES; i < end; i += 2 * LANES) {
+      const vec d0 = vsub(vload(a + i), vload(b + i));
+      const vec d1 = vsub(vload(a + i + LANES), vload(b + i + LANES));
+      s0 = vfmadd(d0, d0, s0);
+      s1 = vfmadd(d1, d1, s1);
+    }
+    if (vhsum(vadd(s0, s1)) > t)
+      return DBL_MAX;
+  }
+  for (; i + LANES <= n; i += LANES) {
+    const vec d0 = vsub(vload(a + i), vload(b + i));
+    s0 = vfmadd(d0, d0, s0);
+  }
+  double sum = vhsum(vadd(s0, s1));
+  for (; i < n; i++) {
+    const double d = (double)a[i] - (double)b[i];
+    sum += d * d;
+  }
+  return (sum > t) ? DBL_MAX : sum;
+}
+
+template <class T1, class T2>
+KERNEL_TARGET double manhattan(const T1 *a, const T2 *b, const long n) {
+  vec s0 = vzero();
+  vec s1 = vzero();
+  long i = 0;
+  for (; i + 2 * LANES <= n; i += 2 * LANES) {
+    s0 = vadd(vabs(vsub(vload(a + i), vload(b + i))), s0);
+    s1 = vadd(vabs(vsub(vload(a + i + LANES), vload(b + i + LANES))), s1);
+  }
+  double sum = vhsum(vadd(s0, s1));
+  for (; i < n; i++)
+    sum += fabs((double)a[i] - (double)b[i]);
+  return sum;
+}
+
+template <class T1, class T2>
+KERNEL_TARGET double manhattan_thresh(const T1 *a, const T2 *b, const long n,
+                                      const double t) {
+  vec s0 = vzero();
+  vec s1 = vzero();
+  long i = 0;
+  while (i + 4 * LANES <= n) {
+    for (const long end = i + 4 * LANES; i < end; i += 2 * LANES) {
+      s0 = vadd(vabs(vsub(vload(a + i), vload(b + i))), s0);
+      s1 = vadd(vabs(vsub(vload(a + i + LANES), vload(b + i + LANES))), s1);
+    }
+    if (vhsum(vadd(s0, s1)) > t)
+      return DBL_MAX;
+  }
+  for (; i + LANES <= n; i += LANES)
+    s0 = vadd(vabs(vsub(vload(a + i), vload(b + i))), s0);
+  double sum = vhsum(vadd(s0, s1));
+  for (; i < n; i++)
+    sum += fabs((double)a[i] - (double)b[i]);
+  return (sum > t) ? DBL_MAX : sum;
+}
+
+template <class T1, class T2>
+KERNEL_TARGET double maximum(const T1 *a, const T2 *b, const long n) {
+  vec m0 = vzero();
+  vec m1 = vzero();
+  long i = 0;
+  for (; i + 2 * LANES <= n; i += 2 * LANES) {
+    m0 = vmax(vabs(vsub(vload(a + i), vload(b + i))), m0);
+    m1 = vmax(vabs(vsub(vload(a + i + LANES), vload(b + i + LANES))), m1);
+  }
+  double dist = vhmax(vmax(m0, m1));
+  for (; i < n; i++) {
+    const double x = fabs((double)a[i] - (double)b[i]);
+    if (x > dist)
+      dist = x;
+  }
+  return dist;
+}
+
+template <class T1, class T2>
+KERNEL_TARGET double maximum_thresh(const T1 *a, const T2 *b, const long n,
+                                    const double t) {
+  vec m0 = vzero();
+  vec m1 = vzero();
+  long i = 0;
+  while (i + 4 * LANES <= n) {
+    for (const long end = i + 4 * LANES; i < end; i += 2 * LANES) {
+      m0 = vmax(vabs(vsub(vload(a + i), vload(b + i))), m0);
+      m1 = vmax(vabs(vsub(vload(a + i + LANES), vload(b + i + LANES))), m1);
+    }
+    if (vhmax(vmax(m0, m1)) > t)
+      return DBL_MAX;
+  }
+  for (; i + LANES <= n; i += LANES)
+    m0 = vmax(vabs(vsub(vload(a + i), vload(b + i))), m0);
+  double dist = vhmax(vmax(m0, m1));
+  for (; i < n; i++) {
+    const double x = fabs((double)a[i] - (double)b[i]);
+    if (x > dist)
+      dist = x;
+  }
+  return (dist > t) ? DBL_MAX : dist;
+}
+
+template <class T1, class T2>
+distance_kernels::metric_kernels<T1, T2> make_kernels() {
+  distance_kernels::metric_kernels<T1, T2> k;
+  k.euclidian = &euclidian<T1, T2>;
+  k.euclidian_thresh = &euclidian_thresh<T1, T2>;
+  k.manhattan = &manhattan<T1, T2>;
+  k.manhattan_thresh = &manhattan_thresh<T1, T2>;
+  k.maximum = &maximum<T1, T2>;
+  k.maximum_thresh = &maximum_thresh<T1, T2>;
+  return k;
+}
+
+distance_kernels::kernel_table make_table(const char *name) {
+  distance_kernels::kernel_table t;
+  t.name = name;
+  t.float_double = make_kernels<float, double>();
+  t.float_float = make_kernels<float, float>();
+  t.double_double = make_kernels<double, double>();
+  return t;
+}
@@ -0,0 +1,186 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary file format of a saved ATRIA searcher. The file starts with an
+// index_header, followed by three sections, each aligned to
+// INDEX_FILE_ALIGNMENT bytes: the points (row-major, in the element type of
+// the storage), the permutation table and the tree nodes. The sections are
+// written as they are laid out in memory, so a file can only be opened on
+// machines with the same byte order and the same sizes of the neighbor and
+// tree_node classes, which is checked when the file is opened. Files of
+// other format versions are rejected. Version 2 stores the median radius of
+// the tree nodes.
+#define INDEX_FILE_MAGIC "ATRIAIDX"
+#define INDEX_FILE_VERSION 2
+#define INDEX_FILE_ALIGNMENT 64
+
+struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // 0x01020304 as written by the creating machine
+  uint32_t neighbor_size;
+  uint32_t node_size;
+  char metric[16];
+  char storage[16];     // "float" or "double", the element type of points
+  uint64_t points;      // number of points in the point set
+  uint64_t points_used; // number of points in the search tree
+  uint64_t dimension;
+  uint64_t nodes; // number of entries of the node array
+  uint64_t total_clusters;
+  uint64_t terminal_nodes;
+  uint64_t points_in_terminal_nodes;
+  uint64_t minpoints;
+  uint64_t reordered;
+  uint64_t points_offset;
+  uint64_t permutation_offset;
+  uint64_t nodes_offset;
+  uint64_t file_size;
+};
+
+// Offset of the next section behind 'offset' bytes of data.
+inline uint64_t index_file_align(const uint64_t offset) {
+  return (offset + INDEX_FILE_ALIGNMENT - 1) / INDEX_FILE_ALIGNMENT *
+         INDEX_FILE_ALIGNMENT;
+}
+
+// Read-only view of a whole file. On POSIX systems the file is memory
+// mapped, so opening is fast even for very large files, pages are only read
+// when they are accessed and are shared by all processes that map the same
+// file. Elsewhere the file is read into memory.
+class mapped_file {
+private:
+  void *memory;
+  uint64_t length;
+#ifndef _WIN32
+  bool mapped;
+#endif
+
+public:
+  mapped_file() : memory(nullptr), length(0) {
+#ifndef _WIN32
+    mapped = false;
+#endif
+  };
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file() { close(); };
+
+  // Returns false if the file can not be opened or read.
+  bool open(const std::string &path) {
+    close();
+#ifndef _WIN32
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+      ::close(fd);
+      return false;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    memory = p;
+    length = st.st_size;
+    mapped = true;
+    return true;
+#else
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in)
+      return false;
+    const std::streamoff size = in.tellg();
+    if (size <= 0)
+      return false;
+    memory = malloc(size);
+    if (memory == nullptr)
+      return false;
+    in.seekg(0);
+    if (!in.read((char *)memory, size)) {
+      close();
+      return false;
+    }
+    length = size;
+    return true;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mapped)
+      munmap(memory, length);
+    else
+      free(memory);
+    mapped = false;
+#else
+    free(memory);
+#endif
+    memory = nullptr;
+    length = 0;
+  }
+
+  inline const char *data() const { return (const char *)memory; };
+  inline uint64_t size() const { return length; };
+};
+
+// The header of an index file, which must be at least sizeof(index_header)
+// bytes long.
+inline const index_header &index_file_header(const mapped_file &f) {
+  return *(const index_header *)f.data();
+}
+
+// Check the header of an index file written on a machine with the given
+// sizes of the neighbor and tree_node classes. Returns nullptr if the file
+// can be used, else the reason why not.
+inline const char *index_file_error(const mapped_file &f,
+                                    const uint64_t neighbor_size,
+                                    const uint64_t node_size) {
+  if (f.size() < sizeof(index_header))
+    return "File is too short.";
+  const index_header &h = index_file_header(f);
+  if (memcmp(h.magic, INDEX_FILE_MAGIC, sizeof(h.magic)) != 0)
+    return "Not an index file.";
+  if (h.version != INDEX_FILE_VERSION)
+    return "Unsupported version of the index file format.";
+  if ((h.byte_order != 0x01020304) || (h.neighbor_size != neighbor_size) ||
+      (h.node_size != node_size))
+    return "Index file was written on an incompatible machine.";
+  uint64_t element_size = 0;
+  if (strncmp(h.storage, "float", sizeof(h.storage)) == 0)
+    element_size = sizeof(float);
+  else if (strncmp(h.storage, "double", sizeof(h.storage)) == 0)
+    element_size = sizeof(double);
+  else
+    return "Unknown storage in index file.";
+  if ((h.metric[sizeof(h.metric) - 1] != 0) || (h.points_used < 1) ||
+      (h.points_used > h.points) || (h.dimension < 1) || (h.nodes < 1) ||
+      (h.points > f.size()) || (h.dimension > f.size() / h.points) ||
+      (h.nodes > f.size()))
+    return "Corrupt index file header.";
+  if ((h.points_offset % INDEX_FILE_ALIGNMENT != 0) ||
+      (h.permutation_offset % INDEX_FILE_ALIGNMENT != 0) ||
+      (h.nodes_offset % INDEX_FILE_ALIGNMENT != 0) ||
+      (h.points_offset < sizeof(index_header)) ||
+      (h.permutation_offset <
+       h.points_offset + h.points * h.dimension * element_size) ||
+      (h.nodes_offset < h.permutation_offset + h.points_used * neighbor_size) ||
+      (h.file_size < h.nodes_offset + h.nodes * node_size) ||
+      (h.file_size != f.size()))
+    return "Index file is truncated or corrupt.";
+  return nullptr;
+}
+
+#endif
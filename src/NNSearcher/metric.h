@@ -3,7 +3,11 @@
 
 #include <algorithm>
 #include <climits>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
+#include "distance_kernels.h"
 #include "nn_aux.h"
 
 // This header file defines templated function objects (functors) for distance
@@ -20,11 +24,19 @@
 // implementation can speed up the search considerably. When threshold is
 // exceeded, DBL_MAX is returned to prevent the search functions to consider
 // this value as valid distance.
+//
+// For points stored as contiguous arrays of float or double (plain pointers
+// as iterators), euclidian_distance, maximum_distance and manhattan_distance
+// use the vectorized kernels from distance_kernels.h, picked at runtime for
+// the instruction sets supported by the CPU.
 
 
 class euclidian_distance {
+protected:
+  const distance_kernels::kernel_table *kernels;
+
 public:
-  euclidian_distance(){};
+  euclidian_distance() : kernels(&distance_kernels::active_kernels()){};
   template <class ForwardIterator1, class ForwardIterator2>
   double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
                   ForwardIterator2 first2) const {
@@ -57,11 +69,77 @@ public:
     }
     return sqrt(dist);
   }
+
+  template <class T1, class T2>
+  double operator()(T1 *first1, T1 *last1, T2 *first2) const {
+    return sqrt(distance_kernels::kernels_for<T1, T2>(*kernels).euclidian(
+        first1, first2, last1 - first1));
+  }
+
+  template <class T1, class T2>
+  double operator()(T1 *first1, T1 *last1, T2 *first2,
+                    const double thresh) const {
+    const double t = thresh * thresh;
+    const double dist =
+        distance_kernels::kernels_for<T1, T2>(*kernels).euclidian_thresh(
+            first1, first2, last1 - first1, t);
+    return (dist > t) ? DBL_MAX : sqrt(dist);
+  }
+
+  // Squared distances, which save the square root. The threshold thresh2 of
+  // the partial calculation is a squared distance as well.
+  template <class ForwardIterator1, class ForwardIterator2>
+  double squared(ForwardIterator1 first1, ForwardIterator1 last1,
+                 ForwardIterator2 first2) const {
+    double dist = 0;
+    for (; first1 != last1; ++first1, ++first2) {
+      const double x = (*first1 - *first2);
+      dist += x * x;
+    }
+    return dist;
+  }
+
+  template <class ForwardIterator1, class ForwardIterator2>
+  double squared(ForwardIterator1 first1, ForwardIterator1 last1,
+                 ForwardIterator2 first2, const double thresh2) const {
+    double dist = 0;
+    for (; first1 != last1; ++first1, ++first2) {
+      const double x = (*first1 - *first2);
+      dist += x * x;
+      if (dist > thresh2)
+        return DBL_MAX;
+    }
+    return dist;
+  }
+
+  template <class T1, class T2>
+  double squared(T1 *first1, T1 *last1, T2 *first2) const {
+    return distance_kernels::kernels_for<T1, T2>(*kernels).euclidian(
+        first1, first2, last1 - first1);
+  }
+
+  template <class T1, class T2>
+  double squared(T1 *first1, T1 *last1, T2 *first2,
+                 const double thresh2) const {
+    const double dist =
+        distance_kernels::kernels_for<T1, T2>(*kernels).euclidian_thresh(
+            first1, first2, last1 - first1, thresh2);
+    return (dist > thresh2) ? DBL_MAX : dist;
+  }
 };
 
+// True for metrics that also compute squared distances by a member function
+// squared(), with the same arguments as operator(). The nearest neighbor
+// search then compares squared distances of the candidate points.
+template <class METRIC> struct has_squared_distance : std::false_type {};
+template <> struct has_squared_distance<euclidian_distance> : std::true_type {};
+
 class maximum_distance {
+protected:
+  const distance_kernels::kernel_table *kernels;
+
 public:
-  maximum_distance(){};
+  maximum_distance() : kernels(&distance_kernels::active_kernels()){};
   template <class ForwardIterator1, class ForwardIterator2>
   double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
                     ForwardIterator2 first2) const {
@@ -92,11 +170,29 @@ public:
     }
     return dist;
   }
+
+  template <class T1, class T2>
+  double operator()(T1 *first1, T1 *last1, T2 *first2) const {
+    return distance_kernels::kernels_for<T1, T2>(*kernels).maximum(
+        first1, first2, last1 - first1);
+  }
+
+  template <class T1, class T2>
+  double operator()(T1 *first1, T1 *last1, T2 *first2,
+                    const double thresh) const {
+    const double dist =
+        distance_kernels::kernels_for<T1, T2>(*kernels).maximum_thresh(
+            first1, first2, last1 - first1, thresh);
+    return (dist > thresh) ? DBL_MAX : dist;
+  }
 };
 
 class manhattan_distance {
+protected:
+  const distance_kernels::kernel_table *kernels;
+
 public:
-  manhattan_distance(){};
+  manhattan_distance() : kernels(&distance_kernels::active_kernels()){};
   template <class ForwardIterator1, class ForwardIterator2>
   double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
                     ForwardIterator2 first2) const {
@@ -124,6 +220,21 @@ public:
     }
     return dist;
   }
+
+  template <class T1, class T2>
+  double operator()(T1 *first1, T1 *last1, T2 *first2) const {
+    return distance_kernels::kernels_for<T1, T2>(*kernels).manhattan(
+        first1, first2, last1 - first1);
+  }
+
+  template <class T1, class T2>
+  double operator()(T1 *first1, T1 *last1, T2 *first2,
+                    const double thresh) const {
+    const double dist =
+        distance_kernels::kernels_for<T1, T2>(*kernels).manhattan_thresh(
+            first1, first2, last1 - first1, thresh);
+    return (dist > thresh) ? DBL_MAX : dist;
+  }
 };
 
 class hamming_distance {
@@ -157,6 +268,138 @@ public:
   }
 };
 
+// Minkowski distance of finite order p >= 1, (sum |x_i - y_i|^p)^(1/p). Use
+// manhattan_distance (p = 1), euclidian_distance (p = 2) or maximum_distance
+// (p = infinity) for these orders, they are much faster. The differences are
+// divided by the largest one seen so far, so that their p-th powers neither
+// overflow nor underflow for large p.
+class minkowski_distance {
+protected:
+  double p;
+
+public:
+  explicit minkowski_distance(const double P) : p(P){};
+  inline double order() const { return p; }
+  template <class ForwardIterator1, class ForwardIterator2>
+  double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
+                    ForwardIterator2 first2) const {
+    double scale = 0;
+    double sum = 0; // sum of (|x_i - y_i| / scale)^p
+    for (; first1 != last1; ++first1, ++first2) {
+      const double a = fabs(*first1 - *first2);
+      if (a > scale) {
+        sum = sum * pow(scale / a, p) + 1;
+        scale = a;
+      } else if (a > 0) {
+        sum += pow(a / scale, p);
+      }
+    }
+    return (scale > 0) ? scale * pow(sum, 1 / p) : 0;
+  }
+  // support partial search
+  template <class ForwardIterator1, class ForwardIterator2>
+  double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
+                    ForwardIterator2 first2, const double thresh) const {
+    double scale = 0;
+    double sum = 0;
+    double t = DBL_MAX; // (thresh / scale)^p
+    for (; first1 != last1; ++first1, ++first2) {
+      const double a = fabs(*first1 - *first2);
+      if (a > scale) {
+        if (a > thresh)
+          return DBL_MAX;
+        sum = sum * pow(scale / a, p) + 1;
+        scale = a;
+        t = pow(thresh / scale, p);
+      } else if (a > 0) {
+        sum += pow(a / scale, p);
+      }
+      if (sum > t)
+        return DBL_MAX;
+    }
+    return (scale > 0) ? scale * pow(sum, 1 / p) : 0;
+  }
+};
+
+// Euclidian distance with a non-negative weight per dimension,
+// sqrt(sum w_i (x_i - y_i)^2). The weights are shared by all copies of the
+// function object.
+class weighted_euclidian_distance {
+protected:
+  std::shared_ptr<const std::vector<double>> weights;
+  const double *w;
+
+public:
+  explicit weighted_euclidian_distance(const std::vector<double> &W)
+      : weights(new std::vector<double>(W)), w(weights->data()){};
+  template <class ForwardIterator1, class ForwardIterator2>
+  double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
+                    ForwardIterator2 first2) const {
+    double dist = 0;
+    for (const double *wi = w; first1 != last1; ++first1, ++first2, ++wi) {
+      const double x = (*first1 - *first2);
+      dist += *wi * x * x;
+    }
+    return sqrt(dist);
+  }
+  // support partial search
+  template <class ForwardIterator1, class ForwardIterator2>
+  double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
+                    ForwardIterator2 first2, const double thresh) const {
+    const double t = thresh * thresh;
+    double dist = 0;
+    for (const double *wi = w; first1 != last1; ++first1, ++first2, ++wi) {
+      const double x = (*first1 - *first2);
+      dist += *wi * x * x;
+      if (dist > t)
+        return DBL_MAX;
+    }
+    return sqrt(dist);
+  }
+};
+
+// Angle between two vectors in radians, from 0 to pi. Neighbors by angle are
+// the neighbors by cosine similarity, the cosine distance of two vectors is
+// 1 - cos(angle). Unlike the cosine distance, the angle satisfies the
+// triangle inequality, so searches stay exact. The zero vector has angle
+// pi / 2 to all other vectors. The angle is computed from the normalized
+// vectors u and v as 2 atan2(|u - v|, |u + v|), which is accurate also for
+// small angles. As the norms of both vectors are needed first, the
+// thresholded distance can not stop early.
+class angular_distance {
+public:
+  angular_distance(){};
+  template <class ForwardIterator1, class ForwardIterator2>
+  double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
+                    ForwardIterator2 first2) const {
+    double n1 = 0, n2 = 0;
+    ForwardIterator2 i2 = first2;
+    for (ForwardIterator1 i1 = first1; i1 != last1; ++i1, ++i2) {
+      n1 += (double)*i1 * *i1;
+      n2 += (double)*i2 * *i2;
+    }
+    if ((n1 == 0) || (n2 == 0))
+      return (n1 == n2) ? 0 : 2 * atan(1.0);
+    const double s1 = 1 / sqrt(n1);
+    const double s2 = 1 / sqrt(n2);
+    double diff = 0, sum = 0;
+    for (; first1 != last1; ++first1, ++first2) {
+      const double u = s1 * *first1;
+      const double v = s2 * *first2;
+      diff += (u - v) * (u - v);
+      sum += (u + v) * (u + v);
+    }
+    return 2 * atan2(sqrt(diff), sqrt(sum));
+  }
+  // support partial search
+  template <class ForwardIterator1, class ForwardIterator2>
+  double operator()(ForwardIterator1 first1, ForwardIterator1 last1,
+                    ForwardIterator2 first2, const double thresh) const {
+    const double dist = (*this)(first1, last1, first2);
+    return (dist > thresh) ? DBL_MAX : dist;
+  }
+};
+
 class euclidian_distance_unrolled {
 public:
   euclidian_distance_unrolled(){};
@@ -22,15 +22,71 @@
 
 #define ATRIAMINPOINTS 64
 
+// Parameters for parallel tree construction. Subtrees with less than
+// ATRIA_TASK_MINPOINTS points are built by the thread that created their
+// root, larger ones are handed to the scheduler as separate tasks. Clusters
+// with at least ATRIA_PARALLEL_SCAN_MINPOINTS points (the top levels of the
+// tree) compute their distance scans in parallel blocks of ATRIA_BLOCK_SIZE.
+#define ATRIA_TASK_MINPOINTS 4096
+#define ATRIA_PARALLEL_SCAN_MINPOINTS 65536
+#define ATRIA_BLOCK_SIZE 4096
+
+// Pairs of subtrees with at least ATRIA_TASK_MINPAIRS pairs of points are
+// handed to the scheduler as separate tasks when counting pairs in parallel.
+#define ATRIA_TASK_MINPAIRS 1048576
+
+// Number of points sampled per cluster by split_sampled.
+#define ATRIA_SPLIT_SAMPLE 16
+
+// Brute force searches compute the distances of blocks of
+// ATRIA_BRUTE_FORCE_QUERIES query points to tiles of points of about
+// ATRIA_BRUTE_FORCE_TILE_BYTES, so a tile is read from memory once per block
+// and stays in the cache for the other query points of the block.
+#define ATRIA_BRUTE_FORCE_QUERIES 16
+#define ATRIA_BRUTE_FORCE_TILE_BYTES 131072
+
+// When the permutation table is laid out after insertions, each terminal
+// node with n points is followed by n / ATRIA_LEAF_SLACK + 1 free entries,
+// which take further points without moving the rest of the table. Free
+// entries hold the index ATRIA_FREE_ENTRY.
+#define ATRIA_LEAF_SLACK 4
+#define ATRIA_FREE_ENTRY -1
+
+// How a cluster is divided into two child clusters during tree construction.
+enum split_strategy {
+  split_farthest, // the point farthest from the cluster's center and the
+                  // point farthest from that one become the child centers,
+                  // points go to the nearer center
+  split_sampled,  // the farthest pair of points among ATRIA_SPLIT_SAMPLE
+                  // random points of the cluster, so outliers are rarely
+                  // picked as centers
+  split_medoid,   // like split_farthest, then each center is moved to the
+                  // point nearest to the centroid of its child, which
+                  // shrinks Rmax at the cost of two more distance scans
+  split_balanced  // the centers of split_farthest, but the points are
+                  // divided at the median of their distance differences to
+                  // the centers, so both children get the same size
+};
+
+#include "index_file.h"
 #include "nn_aux.h"
+#include "parallel.h"
+#include "phase_timer.h"
 #include "utilities.h"
 
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <random>
+#include <thread>
+#include <type_traits>
+
 // Base class for nearest neighbor searchers.
 template <class POINT_SET>
 class nearneigh_searcher : protected My_Utilities {
 protected:
   int err; // error state, == 0 means OK, every other value is a failure
-  const POINT_SET points;
+  POINT_SET points; // not const, as ATRIA may reorder the points in memory
 
   long Nused; // Number of points of the data set actually used
 public:
@@ -50,70 +106,382 @@ public:
   inline int geterr() const { return err; }
 };
 
+// Shape of a search tree: the number of nodes, the depth of the deepest node
+// (the root has depth 0), the average depth of the terminal nodes, the
+// average Rmax of all nodes and of the terminal nodes. The averages over
+// terminal nodes are weighted by their number of points, i.e. they are
+// averages over the points.
+struct tree_shape {
+  long nodes;
+  long depth;
+  double mean_leaf_depth;
+  double mean_radius;
+  double mean_leaf_radius;
+};
+
 // Advanced triangle inequaltity algorithm
 template <class POINT_SET> class ATRIA : public nearneigh_searcher<POINT_SET> {
 protected:
   const long MINPOINTS;
-  cluster* root;
-
-  neighbor* const permutation_table;
+  const split_strategy SPLIT;
+  node_array nodes; // the search tree, nodes[0] is the root
+
+  // Indices of all points in depth first order of the tree, the points of a
+  // terminal node are stored at positions first .. first + length - 1. The
+  // table has table_size entries, Nused and the free entries behind the
+  // terminal nodes, see leaf_capacity.
+  neighbor *permutation_table;
+  long table_size;
   typedef typename POINT_SET::Metric METRIC;
   typedef searchitem SearchItem;
 
-  priority_queue<SearchItem, vector<SearchItem>, searchitemCompare>
-      search_queue;
-  stack<SearchItem, vector<SearchItem> > SearchStack; // used for range searches/counts
-  SortedNeighborTable table;
+  // Context used by the single-threaded search interface, it also collects
+  // the statistics of all searches done on this object.
+  search_context context;
 
   long total_clusters;
   long terminal_nodes;
   long total_points_in_terminal_node;
-  unsigned long terminal_cluster_searched;
-  unsigned long points_searched;
-  unsigned long number_of_queries;
 
-  void create_tree();
-  void destroy_tree();
+  // If true, the points were reordered in memory, so that the points of
+  // every terminal node are stored contiguously, see reorder_points().
+  bool reordered;
+
+  // The index file of a loaded searcher. The permutation table and the
+  // nodes are then read directly from the file and not owned by this object.
+  std::shared_ptr<const mapped_file> mapping;
+
+  // Statistics collected by each thread during tree construction.
+  struct tree_counters {
+    long clusters;
+    long terminal_nodes;
+    long points_in_terminal_nodes;
+    long singular_clusters;
+    tree_counters()
+        : clusters(0), terminal_nodes(0), points_in_terminal_nodes(0),
+          singular_clusters(0){};
+  };
+
+  // State of dynamic updates, see insert_points() and delete_points().
+  // deleted[i] != 0 marks deleted points, deleted is empty as long as no point
+  // was deleted. Deleted points are moved behind the points of their terminal
+  // node, deleted centers of tree nodes stay in the tree as tombstones until
+  // it is rebuilt. Terminal node n owns the entries first .. first +
+  // leaf_capacity[n] - 1 of the permutation table: its points, then its
+  // deleted points, then free entries. leaf_of[i] is the terminal node of
+  // point i, or 1 (the unused node position) for centers and deleted points.
+  // Both are empty until the first update, see index_leaves().
+  vector<char> deleted;
+  long deleted_points;
+  vector<node_index> leaf_capacity;
+  vector<node_index> leaf_of;
+
+  // Points at the end of the point set that are not in the tree. They keep
+  // their rows, so no points can be inserted behind them.
+  long excluded_points;
+
+  // Quality of the tree, see tree_drift(): the number of points in the tree
+  // when it was built, the number of points inserted or deleted since then
+  // and the average radius of the terminal nodes after building.
+  long build_points;
+  long changed_points;
+  double build_leaf_radius;
+
+  // Sum of the radii of the terminal nodes weighted by their number of
+  // points, kept up to date by insertions and deletions, see count_tree().
+  double leaf_radius_sum;
+
+  // Rows of the points by index, used while the points are reordered and a
+  // tree is built or modified. Empty if rows and indices are the same.
+  vector<node_index> build_rows;
+
+  // The spill tree, see build_spill_tree(), empty if none was built. Its
+  // nodes are laid out like the nodes of the search tree, the points of its
+  // terminal nodes are stored in spill_table, with their distances to the
+  // node's center. Points near the boundary between two children are stored
+  // in both, so spill_table can hold a point several times. The points of
+  // internal node n with dl - dr < spill_split[n], dl and dr being their
+  // distances to the left and the right center, belong to the left child.
+  // If the points were reordered, spill_rows[i] is the row of the point
+  // spill_table[i].
+  vector<tree_node> spill_nodes;
+  vector<double> spill_split;
+  vector<neighbor> spill_table;
+  vector<node_index> spill_rows;
+
+  // A tree that is built on a background thread, see start_rebuild().
+  struct tree_build {
+    vector<neighbor> table;
+    node_array nodes;
+    tree_counters counters;
+    long points; // points in the tree, the deleted points follow in table
+    bool ok;
+  };
+  std::unique_ptr<tree_build> rebuild;
+  std::thread rebuild_thread;
+  std::atomic<bool> rebuild_finished;
+
+  void create_tree(const int threads);
+  bool build_tree(neighbor *const table, const long n, node_array &target,
+                  const int threads, tree_counters &totals) const;
+  void create_subtree(cluster *const c, neighbor *const table, const long n,
+                      const int thread, task_scheduler<cluster *> &scheduler,
+                      tree_counters &counters) const;
+  bool flatten_tree(const cluster *const root, node_array &target,
+                    const long clusters) const;
+  void store_subtree(const cluster *const subtree_root, const node_index pos,
+                     node_index next_free, node_array &target) const;
+  static void destroy_tree(cluster *const root);
+  void reorder_points();
+
+  // Row of the point with index i while a tree is built, see build_rows.
+  inline long index_row(const long i) const {
+    return build_rows.empty() ? i : build_rows[i];
+  }
+  inline double index_distance(const long i, const long j) const {
+    return nearneigh_searcher<POINT_SET>::points.distance(index_row(i),
+                                                          index_row(j));
+  }
+  void set_build_rows();
+  static tree_shape shape(const tree_node *const root);
+
+  void index_leaves();
+  void update_layout(vector<pair<node_index, neighbor> > &added);
+  void add_slack(const long tree_points);
+  bool split_leaf(const node_index n);
+  void count_tree();
+  double mean_leaf_radius() const {
+    return (total_points_in_terminal_node > 0)
+               ? leaf_radius_sum / total_points_in_terminal_node
+               : 0;
+  }
+  void reset_quality();
+
+  // Row in the point set of point number i of terminal node c, whose index is
+  // j. After reordering, this is the point's position in the permutation table.
+  inline long point_row(const tree_node *const c, const long i,
+                        const long j) const {
+    return reordered ? c->first + i : j;
+  }
 
   pair<long, long> find_child_cluster_centers(const cluster* const c,
                                               neighbor* const Section,
-                                              const long c_length);
+                                              const long c_length,
+                                              const int threads) const;
   long assign_points_to_centers(neighbor* const Section, const long c_length,
-                                pair<cluster*, cluster*> childs);
+                                pair<cluster*, cluster*> childs,
+                                const int threads) const;
+  pair<long, long> sample_child_cluster_centers(const cluster *const c,
+                                                neighbor *const Section,
+                                                const long c_length) const;
+  pair<long, long> move_centers_to_medoids(neighbor *const Section,
+                                           const long c_length,
+                                           const pair<long, long> centers,
+                                           const int threads) const;
+  void set_right_center(neighbor *const Section, const long c_length,
+                        const long index, const int threads) const;
+  long divide_points_at_median(neighbor *const Section, const long c_length,
+                               pair<cluster *, cluster *> childs,
+                               const int threads) const;
 
   template <class ForwardIterator>
-  void search(ForwardIterator query_point, const long first, const long last,
-              const double epsilon);
-
-  // Test point number #index of points.
+  void search(search_context &ctx, ForwardIterator query_point,
+              const long first, const long last,
+              const search_limits &limits) const;
+  template <class ForwardIterator>
+  void defeatist_search(search_context &ctx, ForwardIterator query_point,
+                        const long first, const long last) const;
+
+  // A reference node during the dual-tree traversal of all_k_neighbors, d is
+  // the distance between the centers of the query and the reference node and
+  // lb a lower bound for all distances between points of the two nodes.
+  struct dual_item {
+    const tree_node *node;
+    double d;
+    double lb;
+    dual_item(const tree_node *n, const double D, const double LB)
+        : node(n), d(D), lb(LB){};
+    inline bool operator<(const dual_item &x) const { return lb > x.lb; };
+  };
+  typedef priority_queue<dual_item, vector<dual_item> > dual_queue;
+
+  void leaf_k_neighbors(search_context &ctx, dual_queue &queue,
+                        vector<SortedNeighborTable> &tables,
+                        const tree_node *const q, const long k,
+                        const long theiler_window) const;
+
+  // Shared, read-only state of count_pairs(). sizes[n] is the number of
+  // sampled points in the subtree of node n (its center and all points
+  // below), sampled is null if all points are used.
+  struct pair_count_args {
+    const radius_bins &bins;
+    const char *const sampled;
+    vector<uint64_t> sizes;
+    pair_count_args(const radius_bins &b, const char *const s)
+        : bins(b), sampled(s){};
+    inline bool in_sample(const long index) const {
+      return (sampled == nullptr) || sampled[index];
+    }
+  };
+
+  // Per thread state of count_pairs(). hist[b] is the number of pairs with
+  // distance in bin b of the radii, hist[bins.size()] counts pairs beyond
+  // the largest radius and is discarded.
+  typedef pair<node_index, node_index> node_pair; // first == second : pairs
+                                                  // within a single subtree
+  struct pair_counter {
+    vector<int64_t> hist;
+    vector<node_pair> pairs;
+    vector<pair<const tree_node *, double> > nodes;
+  };
+
+  void count_node_pairs(const pair_count_args &args, const node_pair &task,
+                        pair_counter &counter, const int thread,
+                        task_scheduler<node_pair> &scheduler) const;
+  void count_point_pairs(const pair_count_args &args, const long row,
+                         const tree_node *const c, const double d,
+                         pair_counter &counter) const;
+  void count_leaf_pairs(const pair_count_args &args,
+                        const tree_node *const c, pair_counter &counter) const;
+
+  // Test point number #index of points, which is stored at row 'row' of the
+  // point set.
   template <class ForwardIterator>
-  void test(const long index, ForwardIterator qp, const double thresh) {
+  void test(search_context &ctx, const long index, const long row,
+            ForwardIterator qp, const double thresh) const {
 #ifdef PARTIAL_SEARCH
-    const double d = nearneigh_searcher<POINT_SET>::points.distance(index, qp, thresh);
+    const double d = nearneigh_searcher<POINT_SET>::points.distance(row, qp, thresh);
 #else
-    const double d = nearneigh_searcher<POINT_SET>::points.distance(index, qp);
+    const double d = nearneigh_searcher<POINT_SET>::points.distance(row, qp);
 #endif
     if (d < thresh)
-      table.insert(neighbor(index, d));
-    points_searched++;
+      ctx.table.insert(neighbor(index, d));
+    ctx.points_searched++;
+  }
+
+  // Distance of the point at row 'row' to the query point as kept in the
+  // neighbor table, see table_distance below. thresh is in the same units.
+  template <class ForwardIterator>
+  inline double row_distance(const long row, ForwardIterator qp,
+                             const double thresh, std::false_type) const {
+#ifdef PARTIAL_SEARCH
+    return nearneigh_searcher<POINT_SET>::points.distance(row, qp, thresh);
+#else
+    return nearneigh_searcher<POINT_SET>::points.distance(row, qp);
+#endif
+  }
+  template <class ForwardIterator>
+  inline double row_distance(const long row, ForwardIterator qp,
+                             const double thresh2, std::true_type) const {
+#ifdef PARTIAL_SEARCH
+    return nearneigh_searcher<POINT_SET>::points.distance_squared(row, qp,
+                                                                  thresh2);
+#else
+    return nearneigh_searcher<POINT_SET>::points.distance_squared(row, qp);
+#endif
+  }
+
+  // Number of rows of the point set that hold points of the tree. Reordered
+  // points have a row for each entry of the permutation table, the rows of
+  // its free entries hold no point.
+  inline long tree_rows() const {
+    return reordered ? table_size : nearneigh_searcher<POINT_SET>::Nused;
+  }
+
+  // Indices of the points at rows r0 .. r1 - 1 that are not deleted, with
+  // their rows, for brute force searches.
+  void live_rows(const long r0, const long r1,
+                 vector<pair<long, long> > &rows) const {
+    rows.clear();
+    for (long r = r0; r < r1; r++) {
+      const long j = reordered ? permutation_table[r].index() : r;
+      if ((j != ATRIA_FREE_ENTRY) && !is_deleted(j))
+        rows.push_back(pair<long, long>(j, r));
+    }
+  }
+
+  // Distances as they are kept in the neighbor table of search(). For point
+  // sets with squared_distances, the table holds squared distances, so the
+  // points of terminal nodes are tested without taking square roots. The
+  // triangle inequality bounds of the clusters use true distances.
+  typedef std::integral_constant<bool, POINT_SET::squared_distances>
+      squared_table;
+  static inline double table_distance(const double d, std::false_type) {
+    return d;
+  }
+  static inline double table_distance(const double d, std::true_type) {
+    return d * d;
+  }
+  static inline double true_distance(const double t, std::false_type) {
+    return t;
+  }
+  static inline double true_distance(const double t, std::true_type) {
+    return (t == DBL_MAX) ? DBL_MAX : sqrt(t);
+  }
+  template <class ForwardIterator>
+  void test(search_context &ctx, const long index, const long row,
+            ForwardIterator qp, const double thresh, std::false_type) const {
+    test(ctx, index, row, qp, thresh);
+  }
+  template <class ForwardIterator>
+  void test(search_context &ctx, const long index, const long row,
+            ForwardIterator qp, const double thresh2, std::true_type) const {
+#ifdef PARTIAL_SEARCH
+    const double d2 = nearneigh_searcher<POINT_SET>::points.distance_squared(
+        row, qp, thresh2);
+#else
+    const double d2 =
+        nearneigh_searcher<POINT_SET>::points.distance_squared(row, qp);
+#endif
+    if (d2 < thresh2)
+      ctx.table.insert(neighbor(index, d2));
+    ctx.points_searched++;
   }
 public:
-  ATRIA(POINT_SET &&p, const long excl = 0, const long minpts = ATRIAMINPOINTS, const uint32 seed=615460891);
+  // If reorder is true, the rows of the point set are permuted after
+  // construction of the tree, such that the points of each terminal node are
+  // contiguous in memory. Searches then read the points of a terminal node
+  // sequentially instead of jumping through the whole data set. Indices
+  // passed to and returned from the searcher still refer to the original order.
+  // split selects how clusters are divided, see split_strategy.
+  ATRIA(POINT_SET &&p, const long excl = 0, const long minpts = ATRIAMINPOINTS,
+        const uint32 seed = 615460891, const int threads = 1,
+        const bool reorder = false,
+        const split_strategy split = split_farthest);
+
+  // Open a searcher saved by save(). The points p must already refer to the
+  // points stored in the index file, the tree is used as it is in the file.
+  ATRIA(POINT_SET &&p, const std::shared_ptr<const mapped_file> &file);
   ~ATRIA();
 
+  // Write the points and the search tree to an index file, which can be
+  // opened with the constructor above. The name of the metric is recorded in
+  // the file. Deleted points are not recorded in index files, so searchers
+  // with deleted points can not be saved. Returns false if the searcher has
+  // deleted points or the file could not be written.
+  bool save(const std::string &path, const std::string &metric) const;
+
   // Search for k nearest neighbors of the point query_point, excluding
   // points with indices between first and last from the search. Returns a
-  // sorted vector of neighbors (by reference).
+  // sorted vector of neighbors (by reference). The limits of approximate
+  // searches may also be given by epsilon alone, see class search_limits.
+  // Defeatist searches without a spill tree search the search tree.
   template <class ForwardIterator>
   long search_k_neighbors(vector<neighbor> &v, const long k,
                           ForwardIterator query_point, const long first = -1,
-                          const long last = -1, const double epsilon = 0);
+                          const long last = -1,
+                          const search_limits &limits = search_limits()) {
+    return search_k_neighbors(context, v, k, query_point, first, last,
+                              limits);
+  }
 
   // Count the number of points within distance 'radius' from the query point,
   // excluding points with indices between first and last from the search.
   template <class ForwardIterator>
   long count_range(const double radius, ForwardIterator query_point,
-                   const long first = -1, const long last = -1);
+                   const long first = -1, const long last = -1) {
+    return count_range(context, radius, query_point, first, last);
+  }
 
   // Search points within distance 'radius' from the query point,  excluding points
   // with indices between first and last  Returns an unsorted vector v of neigbors by
@@ -121,17 +489,206 @@ public:
   template <class ForwardIterator>
   long search_range(vector<neighbor> &v, const double radius,
                     ForwardIterator query_point, const long first = -1,
-                    const long last = -1);
+                    const long last = -1) {
+    return search_range(context, v, radius, query_point, first, last);
+  }
+
+  // Reentrant versions of the search functions above. The tree is only read,
+  // all state of the search is kept in ctx, so these functions may be called
+  // concurrently from several threads as long as each uses its own context.
+  template <class ForwardIterator>
+  long search_k_neighbors(search_context &ctx, vector<neighbor> &v,
+                          const long k, ForwardIterator query_point,
+                          const long first = -1, const long last = -1,
+                          const search_limits &limits = search_limits()) const;
+
+  template <class ForwardIterator>
+  long count_range(search_context &ctx, const double radius,
+                   ForwardIterator query_point, const long first = -1,
+                   const long last = -1) const;
+
+  template <class ForwardIterator>
+  long search_range(search_context &ctx, vector<neighbor> &v,
+                    const double radius, ForwardIterator query_point,
+                    const long first = -1, const long last = -1) const;
+
+  // Brute force searches, which compute the distances of the query points to
+  // all points of the data set instead of traversing the tree. They find the
+  // same neighbors as exact searches of the tree, and are faster when the
+  // tree can hardly prune anything, e.g. for data of high intrinsic
+  // dimension, see search_efficiency(). brute_force_k_neighbors searches the
+  // k nearest neighbors of the nq query points query_points[q], excluding
+  // points with indices between first[q] and last[q]. The points are
+  // scanned in tiles of consecutive rows, and the distances of each tile to
+  // all nq query points are computed before the next tile is read (pass
+  // blocks of ATRIA_BRUTE_FORCE_QUERIES query points). The sorted neighbors
+  // of query point q are appended to v[q]. If stats is not null, stats[q]
+  // gets the statistics of query point q, like ctx.last_query of
+  // search_k_neighbors.
+  template <class ForwardIterator>
+  void brute_force_k_neighbors(search_context &ctx, vector<neighbor> *v,
+                               const long k,
+                               const ForwardIterator *query_points,
+                               const long nq, const long *first,
+                               const long *last,
+                               query_statistics *stats = nullptr) const;
+
+  // Search the points within distance 'radius' from the query point by brute
+  // force, like search_range.
+  template <class ForwardIterator>
+  long brute_force_range(search_context &ctx, vector<neighbor> &v,
+                         const double radius, ForwardIterator query_point,
+                         const long first = -1, const long last = -1) const;
+
+  // Count the number of points within each of several radii from the query
+  // point in a single traversal of the tree, excluding points with indices
+  // between first and last. The radii of bins must be ascending, afterwards
+  // counts[b] is the number of points within distance bins.radii[b].
+  template <class ForwardIterator>
+  void count_range_multi(search_context &ctx, const radius_bins &bins,
+                         ForwardIterator query_point, const long first,
+                         const long last, long *const counts) const;
+
+  // Search the k nearest neighbors of every point of the data set (the first
+  // number_of_points() points of the point set), excluding points whose
+  // indices differ by at most theiler_window from the query's index (so the
+  // query point itself is always excluded). The points in a terminal node
+  // are searched together: the tree is traversed once per terminal node, and
+  // reference nodes are pruned by bounds valid for all its points. Centers of
+  // tree nodes are searched individually. For every point, store(thread,
+  // index, v) is called with the sorted vector v of its neighbors, possibly
+  // concurrently from up to 'threads' threads.
+  template <class Function>
+  void all_k_neighbors(const long k, const long theiler_window,
+                       const int threads, Function store);
+
+  // Count the pairs of points of the data set within each of several radii,
+  // e.g. for correlation sums. Pairs of points whose indices differ by at
+  // most theiler_window are not counted. If sampled is not null, only pairs
+  // of points with sampled[index] != 0 are considered. Pairs of tree nodes
+  // are handled at once whenever the distance of their centers and their
+  // radii R_max() show that all pairs of points of the two subtrees fall into
+  // the same bin of the radii (or beyond the largest radius), so most pair
+  // distances are never computed. The radii must be ascending, afterwards
+  // counts[b] is the number of pairs within distance bins.radii[b]. Returns
+  // the number of pairs considered, i.e. the number of pairs of (sampled)
+  // points outside the Theiler window.
+  uint64_t count_pairs(const radius_bins &bins, const long theiler_window,
+                       const char *const sampled, const int threads,
+                       uint64_t *const counts) const;
+
+  // Add the n rows of the column-major n by D matrix x to the point set,
+  // with indices number_of_points() .. number_of_points() + n - 1. Each point
+  // descends the tree to the child with the closer center, the same rule
+  // that assigns points to children during construction, and the radii of
+  // all nodes on its way are enlarged to include it. Terminal nodes that
+  // reach MINPOINTS points are divided like clusters during construction.
+  // Returns the index of the first new point, or -1 if points can not be
+  // added (point sets in external memory, excluded samples).
+  long insert_points(const double *x, const long n);
+
+  // Delete the points with the given indices, they are no longer found by
+  // any search. Points in terminal nodes are removed from the tree, deleted
+  // centers of tree nodes stay in the tree as tombstones (they are needed to
+  // guide the searches) until the tree is rebuilt. Indices of other points
+  // do not change. Returns the number of deleted points, not counting points
+  // that were deleted before, or -1 if an index is out of range or the
+  // searcher can not be modified.
+  long delete_points(const long *indices, const long n);
+
+  // Copy the coordinates of the points with the given indices to the
+  // column-major n by D matrix x, e.g. to use data points as query points.
+  void copy_points(const long *indices, const long n, double *x) const;
+
+  inline bool is_deleted(const long index) const {
+    return !deleted.empty() && deleted[index];
+  }
+  inline long number_of_deleted_points() const { return deleted_points; }
+
+  // How far the tree has drifted from a freshly built one by insertions and
+  // deletions: the larger of the number of points inserted or deleted since
+  // the tree was built, relative to its size then, and the relative growth
+  // of the average radius of the terminal nodes (weighted by their number of
+  // points). Both are 0 for a new tree.
+  double tree_drift() const;
+
+  // Shape of the search tree, see tree_shape.
+  tree_shape statistics() const { return shape(nodes.data()); }
+
+  // Build a spill tree for approximate k nearest neighbor searches with
+  // defeatist search, see search_limits. Clusters get the centers of
+  // split_farthest and are divided at the median like with split_balanced,
+  // and the fraction 'overlap' of their points nearest to the boundary is
+  // stored in both children, so each child gets (1 + overlap) / 2 of the
+  // points. Defeatist searches descend from the root to the child on the
+  // query point's side of the boundary down to a single terminal node,
+  // without backtracking. The more overlap (0 <= overlap < 1), the more
+  // often the true neighbors are in that terminal node, at the cost of
+  // memory. Nodes with less than max_points points are terminal nodes, they
+  // are usually larger than the ones of the search tree, since a defeatist
+  // search only finds neighbors in a single one. Each level multiplies the
+  // stored points by up to 1 + overlap, so without a bound the spill tree
+  // would hold about N (1 + overlap)^depth points. It holds at most
+  // max_duplication times the points of the searcher: each node passes the
+  // part of this budget it does not use for its own overlap on to its
+  // children in proportion to their points, and nodes whose share does not
+  // suffice for the overlap on all levels below them use a smaller one. The spill tree is discarded
+  // when points are inserted or deleted or the search tree is rebuilt.
+  // Returns false if the spill tree could not be built.
+  bool build_spill_tree(const double overlap, const long max_points,
+                        const int threads = 1,
+                        const double max_duplication = 4);
+  inline bool has_spill_tree() const { return !spill_nodes.empty(); }
+  void drop_spill_tree() {
+    spill_nodes = vector<tree_node>();
+    spill_split = vector<double>();
+    spill_table = vector<neighbor>();
+    spill_rows = vector<node_index>();
+  }
+
+  // Shape of the spill tree, see tree_shape, and the number of points it
+  // stores, counting duplicates and the centers of its nodes, relative to
+  // the number of points in the search tree.
+  tree_shape spill_statistics() const { return shape(spill_nodes.data()); }
+  double spill_duplication() const {
+    return (double)(spill_table.size() + spill_nodes.size()) /
+           (nearneigh_searcher<POINT_SET>::Nused - deleted_points);
+  }
+
+  // Start building a new tree of all points that are not deleted on a
+  // background thread, using up to 'threads' threads, while the current
+  // tree keeps answering searches. The new tree replaces the current one in
+  // finish_rebuild(). Returns false if a rebuild is running already or the
+  // searcher can not be rebuilt.
+  bool start_rebuild(const int threads);
+
+  // Replace the tree by the one built in the background if it is finished
+  // or, if wait is true, as soon as it is finished. Insertions and deletions
+  // wait for a running rebuild. Returns true if the tree was replaced.
+  bool finish_rebuild(const bool wait);
+
+  // Add the statistics counters of a context used for reentrant searches to
+  // the statistics of this searcher.
+  void merge_statistics(const search_context &ctx) {
+    context.merge_statistics(ctx);
+  }
 
   // Returns an approximation of the data set radius such that any pairwise
   // distance in the data set is smaller than twice this radius. This bound is
   // not necessarily tight.
-  inline double data_set_radius() const { return root->Rmax; };
+  inline double data_set_radius() const { return nodes[0].R_max(); };
   inline long total_tree_nodes() const { return total_clusters; };
   double search_efficiency() const {
-    return (((double)points_searched) /
-      ((double)nearneigh_searcher<POINT_SET>::number_of_points() * number_of_queries));
+    return (((double)context.points_searched) /
+      ((double)nearneigh_searcher<POINT_SET>::number_of_points() * context.number_of_queries));
   }
+
+  // The statistics counters of all searches of this searcher, including
+  // merged contexts of reentrant searches.
+  inline const search_counters &statistics_counters() const {
+    return context;
+  };
+  void reset_statistics() { context.reset_statistics(); };
 };
 
 template <class POINT_SET>
@@ -150,11 +707,17 @@ template <class POINT_SET>
 nearneigh_searcher<POINT_SET>::~nearneigh_searcher() {}
 
 template <class POINT_SET>
-ATRIA<POINT_SET>::ATRIA(POINT_SET &&p, const long excl, const long minpts, const uint32 seed)
-    : nearneigh_searcher<POINT_SET>(std::move(p), excl), MINPOINTS(minpts), root(nullptr),
+ATRIA<POINT_SET>::ATRIA(POINT_SET &&p, const long excl, const long minpts,
+                        const uint32 seed, const int threads,
+                        const bool reorder, const split_strategy split)
+    : nearneigh_searcher<POINT_SET>(std::move(p), excl), MINPOINTS(minpts),
+      SPLIT(split),
       permutation_table(new neighbor[nearneigh_searcher<POINT_SET>::Nused]),
-      total_clusters(1), terminal_nodes(0), total_points_in_terminal_node(0),
-      terminal_cluster_searched(0), points_searched(0), number_of_queries(0) {
+      table_size(nearneigh_searcher<POINT_SET>::Nused), total_clusters(1),
+      terminal_nodes(0), total_points_in_terminal_node(0), reordered(false),
+      deleted_points(0), excluded_points(excl), build_points(0),
+      changed_points(0), build_leaf_radius(0), leaf_radius_sum(0),
+      rebuild_finished(false) {
 
   RNG::Seed(seed);
 #ifdef VERBOSE
@@ -163,7 +726,6 @@ ATRIA<POINT_SET>::ATRIA(POINT_SET &&p, const long excl, const long minpts, const
   Rcpp::Rcout << "Number of points used : " << nearneigh_searcher<POINT_SET>::number_of_points() <<std::endl;
   Rcpp::Rcout << "MINPOINTS : " << MINPOINTS <<std::endl;
 #endif
-  terminal_cluster_searched = 0;
   if (nearneigh_searcher<POINT_SET>::err) {
     Rcpp::Rcerr << "Error initializing parent object" <<std::endl;
     return;
@@ -174,112 +736,466 @@ ATRIA<POINT_SET>::ATRIA(POINT_SET &&p, const long excl, const long minpts, const
     nearneigh_searcher<POINT_SET>::err = 1;
     return;
   }
-  create_tree();
+
+  if (nearneigh_searcher<POINT_SET>::Nused >= (long)UINT32_MAX) {
+    Rcpp::Rcerr << "Too many points, tree nodes use 32 bit indices" <<std::endl;
+    nearneigh_searcher<POINT_SET>::err = 1;
+    return;
+  }
+  create_tree(threads);
 
 #ifdef VERBOSE
   Rcpp::Rcout << "Created tree structure for ATRIA searcher" <<std::endl;
 #endif
+
+  if (reorder && !nearneigh_searcher<POINT_SET>::err) {
+    reorder_points();
+#ifdef VERBOSE
+    if (reordered)
+      Rcpp::Rcout << "Reordered points by terminal nodes" <<std::endl;
+#endif
+  }
 }
 
 template <class POINT_SET> ATRIA<POINT_SET>::~ATRIA() {
+  if (rebuild)
+    rebuild_thread.join();
+  if (!mapping)
+    delete[] permutation_table;
+}
+
+template <class POINT_SET>
+ATRIA<POINT_SET>::ATRIA(POINT_SET &&p,
+                        const std::shared_ptr<const mapped_file> &file)
+    : nearneigh_searcher<POINT_SET>(
+          std::move(p), p.size() - index_file_header(*file).points_used),
+      MINPOINTS(index_file_header(*file).minpoints), SPLIT(split_farthest),
+      // The table is read-only, searches never modify it.
+      permutation_table(
+          (neighbor *)(file->data() +
+                       index_file_header(*file).permutation_offset)),
+      table_size(index_file_header(*file).points_used),
+      total_clusters(index_file_header(*file).total_clusters),
+      terminal_nodes(index_file_header(*file).terminal_nodes),
+      total_points_in_terminal_node(
+          index_file_header(*file).points_in_terminal_nodes),
+      reordered(index_file_header(*file).reordered != 0), mapping(file),
+      deleted_points(0),
+      excluded_points(index_file_header(*file).points -
+                      index_file_header(*file).points_used),
+      build_points(0), changed_points(0), build_leaf_radius(0),
+      leaf_radius_sum(0), rebuild_finished(false) {
+  const index_header &h = index_file_header(*file);
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+  nodes.attach((const tree_node *)(file->data() + h.nodes_offset), h.nodes);
+
+  // Check the tree structure, so that a corrupt file can not make searches
+  // access memory outside of the file.
+  for (node_index n = 0; n < nodes.size(); n++) {
+    if (n == 1) // position 1 is unused
+      continue;
+    const tree_node &c = nodes[n];
+    bool ok = ((long)c.center < N) &&
+              ((long)c.center_row < nearneigh_searcher<POINT_SET>::points.size());
+    if (c.is_terminal())
+      ok = ok && ((long)c.first + (long)c.length <= N);
+    else
+      ok = ok && (c.first > n) && (c.first + 1 < nodes.size());
+    if (!ok) {
+      Rcpp::Rcerr << "Corrupt search tree in index file" << std::endl;
+      nearneigh_searcher<POINT_SET>::err = 1;
+      return;
+    }
+  }
+  // The permutation table must hold each point exactly once, its indices
+  // address points and, for reordered searchers, rows.
+  vector<char> seen(N, 0);
+  for (long pos = 0; pos < N; pos++) {
+    const long i = permutation_table[pos].index();
+    if ((i < 0) || (i >= N) || seen[i]) {
+      Rcpp::Rcerr << "Corrupt permutation table in index file" << std::endl;
+      nearneigh_searcher<POINT_SET>::err = 1;
+      return;
+    }
+    seen[i] = 1;
+  }
+  reset_quality();
 #ifdef VERBOSE
-  Rcpp::Rcout << "ATRIA Destructor" <<std::endl;
-  Rcpp::Rcout << "Total_clusters : " << total_clusters <<std::endl;
-  Rcpp::Rcout << "Total number of points in terminal nodes : "
-        << total_points_in_terminal_node <<std::endl;
-  Rcpp::Rcout << "Average number of points in a terminal node : "
-       << ((double)total_points_in_terminal_node) / terminal_nodes <<std::endl;
-  if (number_of_queries == 0)
-    Rcpp::Rcout << "No queries were done" <<std::endl;
-  else
-    Rcpp::Rcout << "Average percentage of points searched "
-         << (100.0 * (double)points_searched) /
-    ((double)nearneigh_searcher<POINT_SET>::Nused *
-    number_of_queries)
-    << "% (" << ceil(((double)points_searched) / number_of_queries)
-    << ")" <<std::endl;
-    Rcpp::Rcout << "Average number of terminal nodes visited : "
-         << ((double)terminal_cluster_searched) / number_of_queries <<std::endl;
+  Rcpp::Rcout << "ATRIA loaded from index file" << std::endl;
+  Rcpp::Rcout << "Number of points used : " << N << std::endl;
 #endif
+}
 
-  destroy_tree();
-
-  delete[] permutation_table;
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::save(const std::string &path,
+                            const std::string &metric) const {
+  typedef typename POINT_SET::value_type T;
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const long D = points.dimension();
+  if (deleted_points > 0)
+    return false;
+
+  // The free entries of the permutation table are left out, and the rows of
+  // reordered points that belong to them. Entry r of the table is saved at
+  // position saved[r].
+  const long free_entries = table_size - nearneigh_searcher<POINT_SET>::Nused;
+  const long N = points.size() - (reordered ? free_entries : 0);
+  vector<neighbor> table;
+  vector<tree_node> saved_nodes;
+  if (free_entries > 0) {
+    vector<node_index> saved(table_size);
+    table.reserve(nearneigh_searcher<POINT_SET>::Nused);
+    for (long r = 0; r < table_size; r++) {
+      saved[r] = table.size();
+      if (permutation_table[r].index() != ATRIA_FREE_ENTRY)
+        table.push_back(permutation_table[r]);
+    }
+    saved_nodes.assign(nodes.data(), nodes.data() + nodes.size());
+    for (node_index n = 0; n < nodes.size(); n++) {
+      tree_node &c = saved_nodes[n];
+      if (n == 1) // position 1 is unused
+        continue;
+      if (c.is_terminal())
+        c.first = saved[c.first];
+      if (reordered)
+        c.center_row = saved[c.center_row];
+    }
+  }
+  const neighbor *const saved_table =
+      (free_entries > 0) ? table.data() : permutation_table;
+  const tree_node *const saved_tree =
+      (free_entries > 0) ? saved_nodes.data() : nodes.data();
+
+  index_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_FILE_MAGIC, sizeof(h.magic));
+  h.version = INDEX_FILE_VERSION;
+  h.byte_order = 0x01020304;
+  h.neighbor_size = sizeof(neighbor);
+  h.node_size = sizeof(tree_node);
+  strncpy(h.metric, metric.c_str(), sizeof(h.metric) - 1);
+  strncpy(h.storage, std::is_same<T, float>::value ? "float" : "double",
+          sizeof(h.storage) - 1);
+  h.points = N;
+  h.points_used = nearneigh_searcher<POINT_SET>::Nused;
+  h.dimension = D;
+  h.nodes = nodes.size();
+  h.total_clusters = total_clusters;
+  h.terminal_nodes = terminal_nodes;
+  h.points_in_terminal_nodes = total_points_in_terminal_node;
+  h.minpoints = MINPOINTS;
+  h.reordered = reordered;
+  h.points_offset = index_file_align(sizeof(h));
+  h.permutation_offset =
+      index_file_align(h.points_offset + N * D * sizeof(T));
+  h.nodes_offset =
+      index_file_align(h.permutation_offset + h.points_used * sizeof(neighbor));
+  h.file_size = h.nodes_offset + h.nodes * sizeof(tree_node);
+
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  const char zeros[INDEX_FILE_ALIGNMENT] = {0};
+  auto pad_to = [&](const uint64_t offset) {
+    out.write(zeros, offset - (uint64_t)out.tellp());
+  };
+
+  out.write((const char *)&h, sizeof(h));
+  pad_to(h.points_offset);
+  // The points are converted to rows of T in blocks, as the point set may
+  // not store them contiguously.
+  std::vector<T> block;
+  long row = 0;
+  for (long first = 0; out && (first < N); first += ATRIA_BLOCK_SIZE) {
+    const long last = min(N, first + (long)ATRIA_BLOCK_SIZE);
+    block.resize((last - first) * D);
+    T *dest = block.data();
+    for (long r = first; r < last; r++, row++) {
+      while (reordered && (row < table_size) &&
+             (permutation_table[row].index() == ATRIA_FREE_ENTRY))
+        row++;
+      for (auto i = points.point_begin(row); i != points.point_end(row); ++i)
+        *dest++ = *i;
+    }
+    out.write((const char *)block.data(), block.size() * sizeof(T));
+  }
+  pad_to(h.permutation_offset);
+  out.write((const char *)saved_table, h.points_used * sizeof(neighbor));
+  pad_to(h.nodes_offset);
+  out.write((const char *)saved_tree, h.nodes * sizeof(tree_node));
+  out.close();
+  return !out.fail();
 }
 
 template <class POINT_SET>
 pair<long, long> ATRIA<POINT_SET>::find_child_cluster_centers(
-    const cluster* const c, neighbor* const Section, const long length) {
+    const cluster* const c, neighbor* const Section, const long length,
+    const int threads) const {
   pair<long, long> centers(-1, -1);
 
   if (c->Rmax == 0) { // if all data nearneigh_searcher<POINT_SET>::points seem
                       // to be identical
-#ifdef VERBOSE
-    Rcpp::Rcout << "ATRIA : Data seem to be singular, search may be very inefficient"
-          <<std::endl;
-#endif
-    terminal_nodes++;
-    total_points_in_terminal_node += length;
-
     return centers; // indicate that there's no need to further divide this data
                     // set
   }
 
-  // Compute right center, the point that is farthest away from the c->center.
-  // We assume that distances in Section are with respect to the c->center.
-  long index = 0;
-  long center_right = Section[index].index();
-  double dist = Section[index].dist();
-  // nearneigh_searcher<POINT_SET>::points.distance(c->center,// Section[index].index());
-  for (long i = 1; i < length; i++) {
-    const double d = Section[i].dist();
-    //cout << d <<std::endl;
-    if (d > dist) {
-      dist = d;
-      center_right = Section[i].index();
-      index = i;
+  // Positions of the centers in Section if they are chosen from a sample.
+  pair<long, long> sampled(-1, -1);
+  if (SPLIT == split_sampled)
+    sampled = sample_child_cluster_centers(c, Section, length);
+
+  long index = sampled.second;
+  if (index < 0) {
+    // Compute right center, the point that is farthest away from the
+    // c->center. We assume that distances in Section are with respect to the
+    // c->center.
+    index = 0;
+    double dist = Section[index].dist();
+    // nearneigh_searcher<POINT_SET>::points.distance(c->center,// Section[index].index());
+    for (long i = 1; i < length; i++) {
+      const double d = Section[i].dist();
+      //cout << d <<std::endl;
+      if (d > dist) {
+        dist = d;
+        index = i;
+      }
     }
   }
-  centers.second = center_right;
-  // move this center the the last (rightmost) element of this Section
-  swap(Section, index, length - 1);
-  // Compute left center, the point that is farthest away from the center_right.
-  // We also overwrite distances in Section to distances wrt the right center.
-  index = 0;
-  long center_left = Section[index].index();
-  dist = nearneigh_searcher<POINT_SET>::points.distance(center_right,
-                                                        Section[index].index());
-  //cout << dist <<std::endl;
-  Section[index].dist() = dist;
-  for (long i = 1; i < length - 1; i++) {
-    const double d = nearneigh_searcher<POINT_SET>::points.distance(
-        center_right, Section[i].index());
-    Section[i].dist() = d;
-    //cout << center_right << " " << i << " " <<  Section[i].index() << "  " << d << " " << Section[i].dist() <<std::endl;
-    if (d > dist) {
-      dist = d;
-      center_left = Section[i].index();
-      index = i;
+  const long sampled_left = (sampled.first < 0) ? -1 : Section[sampled.first].index();
+  centers.second = Section[index].index();
+  set_right_center(Section, length, index, threads);
+
+  if (sampled_left >= 0) {
+    // The left center is the other point of the sampled pair.
+    index = 0;
+    while (Section[index].index() != sampled_left)
+      index++;
+  } else {
+    // Compute left center, the point that is farthest away from the
+    // center_right.
+    index = 0;
+    double dist = Section[index].dist();
+    for (long i = 1; i < length - 1; i++) {
+      const double d = Section[i].dist();
+      //cout << center_right << " " << i << " " <<  Section[i].index() << "  " << d << " " << Section[i].dist() <<std::endl;
+      if (d > dist) {
+        dist = d;
+        index = i;
+      }
     }
   }
   // move this center the the first (leftmost) element of this Section
+  centers.first = Section[index].index();
   swap(Section, index, 0);
-  centers.first = center_left;
 
   //cout << "Centers: " << center_left << " " << center_right <<std::endl;
   return centers;
 }
 
+// Move the point at position index of Section, the right center, to the
+// last (rightmost) element of Section, and overwrite the distances of all
+// other points in Section with their distances to the right center. For
+// large clusters, the distances are computed in parallel blocks.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::set_right_center(neighbor *const Section,
+                                        const long length, const long index,
+                                        const int threads) const {
+  swap(Section, index, length - 1);
+  const long center_right = Section[length - 1].index();
+  parallel_for((length - 1 + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE, threads,
+               [&](const int, const long block) {
+                 const long end = min(length - 1, (block + 1) * ATRIA_BLOCK_SIZE);
+                 for (long i = block * ATRIA_BLOCK_SIZE; i < end; i++) {
+                   Section[i].dist() =
+                       index_distance(center_right, Section[i].index());
+                 }
+               }, 1);
+}
+
+// Positions in Section of the farthest pair of points among
+// ATRIA_SPLIT_SAMPLE points of cluster c drawn at random (the right center
+// second). The random generator is seeded by the cluster, so the tree does
+// not depend on the order in which the clusters are divided. Returns
+// (-1, -1) for small clusters or if all sampled points coincide.
+template <class POINT_SET>
+pair<long, long> ATRIA<POINT_SET>::sample_child_cluster_centers(
+    const cluster *const c, neighbor *const Section,
+    const long length) const {
+  pair<long, long> best(-1, -1);
+  if (length < 2 * ATRIA_SPLIT_SAMPLE)
+    return best;
+
+  std::minstd_rand rng((uint32)(c->center * 2654435761UL + length));
+  long sample[ATRIA_SPLIT_SAMPLE];
+  for (long s = 0; s < ATRIA_SPLIT_SAMPLE; s++)
+    sample[s] = rng() % length;
+
+  double dist = 0;
+  for (long s = 0; s < ATRIA_SPLIT_SAMPLE; s++) {
+    for (long t = s + 1; t < ATRIA_SPLIT_SAMPLE; t++) {
+      const double d = index_distance(Section[sample[s]].index(),
+                                      Section[sample[t]].index());
+      if (d > dist) {
+        dist = d;
+        best = make_pair(sample[s], sample[t]);
+      }
+    }
+  }
+  return best;
+}
+
+// Move the child centers found by find_child_cluster_centers() to the points
+// nearest to the centroids (the averages of the coordinates) of the points
+// that are nearer to them. Section is laid out for assign_points_to_centers()
+// again afterwards. The sums of the coordinates are added up per block in
+// block order, so the result does not depend on the number of threads.
+template <class POINT_SET>
+pair<long, long> ATRIA<POINT_SET>::move_centers_to_medoids(
+    neighbor *const Section, const long length,
+    const pair<long, long> centers, const int threads) const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const long D = points.dimension();
+  const long blocks = (length + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE;
+
+  // side[i] is 0 for points nearer to the left center, 1 for the right one,
+  // ties go to the left like in assign_points_to_centers().
+  vector<char> side(length);
+  vector<double> sums(blocks * 2 * D, 0.0);
+  vector<long> counts(blocks * 2, 0);
+  parallel_for(blocks, threads, [&](const int, const long block) {
+    const long end = min(length, (block + 1) * ATRIA_BLOCK_SIZE);
+    for (long i = block * ATRIA_BLOCK_SIZE; i < end; i++) {
+      const long j = Section[i].index();
+      if (i == 0)
+        side[i] = 0;
+      else if (i == length - 1)
+        side[i] = 1;
+      else
+        side[i] = (index_distance(centers.first, j) > Section[i].dist());
+      double *const sum = &sums[(block * 2 + side[i]) * D];
+      long d = 0;
+      for (auto x = points.point_begin(index_row(j));
+           x != points.point_end(index_row(j)); ++x)
+        sum[d++] += *x;
+      counts[block * 2 + side[i]]++;
+    }
+  }, 1);
+
+  vector<double> centroids(2 * D, 0.0);
+  for (long k = 0; k < 2; k++) {
+    long count = 0;
+    for (long block = 0; block < blocks; block++) {
+      for (long d = 0; d < D; d++)
+        centroids[k * D + d] += sums[(block * 2 + k) * D + d];
+      count += counts[block * 2 + k];
+    }
+    for (long d = 0; d < D; d++)
+      centroids[k * D + d] /= count;
+  }
+
+  // The point of each side nearest to its centroid, the first one if
+  // several are equally near.
+  vector<pair<double, long> > nearest(blocks * 2, make_pair(DBL_MAX, -1L));
+  parallel_for(blocks, threads, [&](const int, const long block) {
+    const long end = min(length, (block + 1) * ATRIA_BLOCK_SIZE);
+    for (long i = block * ATRIA_BLOCK_SIZE; i < end; i++) {
+      const double d =
+          points.distance(index_row(Section[i].index()),
+                          (const double *)&centroids[side[i] * D]);
+      pair<double, long> &n = nearest[block * 2 + side[i]];
+      if (d < n.first)
+        n = make_pair(d, i);
+    }
+  }, 1);
+  pair<double, long> left = nearest[0];
+  pair<double, long> right = nearest[1];
+  for (long block = 1; block < blocks; block++) {
+    if (nearest[block * 2].first < left.first)
+      left = nearest[block * 2];
+    if (nearest[block * 2 + 1].first < right.first)
+      right = nearest[block * 2 + 1];
+  }
+  if ((left.second < 0) || (right.second < 0)) // centroids out of range
+    return centers;
+
+  // The left center is never at the last position, so the swap of the right
+  // center does not move it.
+  set_right_center(Section, length, right.second, threads);
+  swap(Section, left.second, 0);
+  return make_pair(Section[0].index(), Section[length - 1].index());
+}
+
+// Divide the points of a cluster like assign_points_to_centers(), but at the
+// median of the differences of their distances to the left and the right
+// center. Both children get the same number of points (up to one), also if
+// the cluster is very unbalanced, e.g. on heavy-tailed data. Returns the
+// position of the first point of the right child.
+template <class POINT_SET>
+long ATRIA<POINT_SET>::divide_points_at_median(
+    neighbor *const Section, const long c_length,
+    pair<cluster *, cluster *> childs, const int threads) const {
+  const long center_left = childs.first->center;
+  const long n = c_length - 2; // the points between the two centers
+  const long half = n / 2;
+
+  vector<double> dl(n);
+  vector<pair<double, long> > keys(n);
+  parallel_for((n + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE, threads,
+               [&](const int, const long block) {
+                 const long end = min(n, (block + 1) * ATRIA_BLOCK_SIZE);
+                 for (long k = block * ATRIA_BLOCK_SIZE; k < end; k++) {
+                   dl[k] = index_distance(center_left, Section[k + 1].index());
+                   keys[k] = make_pair(dl[k] - Section[k + 1].dist(), k);
+                 }
+               }, 1);
+  nth_element(keys.begin(), keys.begin() + half, keys.end());
+
+  double Rmax_left = 0;
+  double Rmax_right = 0;
+  vector<neighbor> divided(n);
+  for (long r = 0; r < n; r++) {
+    const long k = keys[r].second;
+    const neighbor &x = Section[k + 1];
+    if (r < half) {
+      divided[r] = neighbor(x.index(), dl[k]);
+      Rmax_left = max(Rmax_left, dl[k]);
+    } else {
+      divided[r] = x;
+      Rmax_right = max(Rmax_right, x.dist());
+    }
+  }
+  std::copy(divided.begin(), divided.end(), Section + 1);
+
+  childs.first->Rmax = Rmax_left;
+  childs.second->Rmax = Rmax_right;
+  return half + 1;
+}
+
 // assign each point to the nearest center, using a kind of quicksort like
 // sorting procedure
 template <class POINT_SET>
 long ATRIA<POINT_SET>::assign_points_to_centers(
     neighbor *const Section, const long c_length,
-    pair<cluster *, cluster *> childs) {
+    pair<cluster *, cluster *> childs, const int threads) const {
   const long center_left = childs.first->center;
   long i = 0;
   long j = c_length - 1;
 
+  // For large clusters, the distances to the left center are computed in
+  // parallel beforehand. The buffer follows all swaps done on Section, so the
+  // resulting partition is the same as with distances computed on demand.
+  vector<double> dl_buffer;
+  if (threads > 1) {
+    dl_buffer.resize(c_length);
+    parallel_for((c_length + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE, threads,
+                 [&](const int, const long block) {
+                   const long end = min(c_length - 1, (block + 1) * ATRIA_BLOCK_SIZE);
+                   for (long k = max(1L, block * ATRIA_BLOCK_SIZE); k < end; k++) {
+                     dl_buffer[k] =
+                         index_distance(center_left, Section[k].index());
+                   }
+                 }, 1);
+  }
+  double *const dl_buf = dl_buffer.empty() ? nullptr : dl_buffer.data();
+
   // maximal distance fron one cluster's center to
   // nearneigh_searcher<POINT_SET>::points belonging to this cluster
   double Rmax_left = 0;
@@ -291,8 +1207,8 @@ long ATRIA<POINT_SET>::assign_points_to_centers(
 
     while (i + 1 < j) {
       i++;
-      const double dl = nearneigh_searcher<POINT_SET>::points.distance(
-          center_left, Section[i].index());
+      const double dl = dl_buf ? dl_buf[i]
+                               : index_distance(center_left, Section[i].index());
       // reuse information instead of calculating dr =
       //const double dr = nearneigh_searcher<POINT_SET>::points.distance(center_right,
       //  Section[i].index());
@@ -319,8 +1235,8 @@ long ATRIA<POINT_SET>::assign_points_to_centers(
           Section[j]
               .dist(); // nearneigh_searcher<POINT_SET>::points.distance(center_right,
                        // Section[j].index());
-      const double dl = nearneigh_searcher<POINT_SET>::points.distance(
-          center_left, Section[j].index());
+      const double dl = dl_buf ? dl_buf[j]
+                               : index_distance(center_left, Section[j].index());
 
       if (dr >= dl) {
         // point belongs to the left corner
@@ -338,6 +1254,8 @@ long ATRIA<POINT_SET>::assign_points_to_centers(
     if (i == j - 1) {
       if ((!i_belongs_to_left) && (!j_belongs_to_right)) {
         swap(Section, i, j);
+        if (dl_buf)
+          swap(dl_buf, i, j);
       } else if (!i_belongs_to_left) {
         i--;
         j--;
@@ -348,6 +1266,8 @@ long ATRIA<POINT_SET>::assign_points_to_centers(
       break; // finished walking through the array
     } else {
       swap(Section, i, j);
+      if (dl_buf)
+        swap(dl_buf, i, j);
     }
   }
 
@@ -357,45 +1277,165 @@ long ATRIA<POINT_SET>::assign_points_to_centers(
   return j;
 }
 
-template <class POINT_SET> void ATRIA<POINT_SET>::create_tree() {
-  long k;
-
+template <class POINT_SET>
+void ATRIA<POINT_SET>::create_tree(const int threads) {
   if (nearneigh_searcher<POINT_SET>::err)
     return;
 
-  std::stack<cluster_pointer, cluster_pointer_vector> Stack; // used for tree construction
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
 
   // select random center for root cluster, move this to first position of the
-  // indices array
-  root = new cluster(1, nearneigh_searcher<POINT_SET>::Nused - 1);
-  root->center = My_Utilities::randindex(nearneigh_searcher<POINT_SET>::Nused);
-  permutation_table[0] = neighbor(root->center, 0);
+  // indices array. Point k is stored at position k + 1 for k < root center,
+  // and at position k for k > root center.
+  const long root_center = My_Utilities::randindex(N);
+  permutation_table[0] = neighbor(root_center, 0);
+  for (long pos = 1; pos < N; pos++)
+    permutation_table[pos] = neighbor((pos <= root_center) ? pos - 1 : pos, 0);
+
+  tree_counters totals;
+  if (!build_tree(permutation_table, N, nodes, threads, totals)) {
+    Rcpp::Rcerr << "Out of memory" <<std::endl;
+    nearneigh_searcher<POINT_SET>::err = 1;
+    return;
+  }
+  total_clusters = totals.clusters;
+  terminal_nodes = totals.terminal_nodes;
+  total_points_in_terminal_node = totals.points_in_terminal_nodes;
+  reset_quality();
+
+#ifdef VERBOSE
+  Rcpp::Rcout << "Root center : " << root_center <<std::endl;
+  Rcpp::Rcout << "Root starting index  : " << 1 <<std::endl;
+  Rcpp::Rcout << "Root length : " << N - 1 <<std::endl;
+  Rcpp::Rcout << "Root Rmax : " << nodes[0].R_max() <<std::endl;
+  if (totals.singular_clusters > 0)
+    Rcpp::Rcout << "ATRIA : Data seem to be singular, search may be very inefficient"
+          <<std::endl;
+#endif
+}
+
+// Build a search tree of the points in table[0 .. n - 1] and store it in
+// target. The indices of the points must be set, with the center of the root
+// in table[0]. Nothing else of this object is modified, so a new tree can be
+// built on a background thread while the current one is searched, and there
+// must be no calls to the R API in here. totals receives the number of tree
+// nodes, including the root. Returns false when out of memory.
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::build_tree(neighbor *const table, const long n,
+                                  node_array &target, const int threads,
+                                  tree_counters &totals) const {
+  cluster *const root = new cluster(1, n - 1);
+  root->center = table[0].index();
+
+  // Compute the distances of all other points to the root center in parallel
+  // blocks.
+  const long root_center = root->center;
+  PROFILE_START(root_start);
+  parallel_for((n - 1 + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE, threads,
+               [&](const int, const long block) {
+                 const long end = min(n, (block + 1) * ATRIA_BLOCK_SIZE + 1);
+                 for (long pos = block * ATRIA_BLOCK_SIZE + 1; pos < end; pos++) {
+                   table[pos].dist() =
+                       index_distance(table[pos].index(), root_center);
+                 }
+               }, 1);
 
   root->Rmax = 0;
-  for (k = 0; k < root->center; k++) {
-    const double d =
-        nearneigh_searcher<POINT_SET>::points.distance(k, root->center);
-    permutation_table[k + 1] = neighbor(k, d);
-    if (d > root->Rmax)
-      root->Rmax = d;
+  for (long pos = 1; pos < n; pos++) {
+    if (table[pos].dist() > root->Rmax)
+      root->Rmax = table[pos].dist();
   }
-  for (k = root->center + 1; k < nearneigh_searcher<POINT_SET>::Nused; k++) {
-    const double d =
-        nearneigh_searcher<POINT_SET>::points.distance(k, root->center);
-    permutation_table[k] = neighbor(k, d);
-    if (d > root->Rmax)
-      root->Rmax = d;
+  PROFILE_STOP(root_start, phase_build_root);
+
+  // Now create the tree. Subtrees are built as tasks by a work-stealing
+  // scheduler, starting with the root cluster. Left and right subclusters
+  // work on disjoint sections of the permutation table, so the resulting
+  // tree does not depend on the number of threads.
+  vector<tree_counters> counters(threads < 1 ? 1 : threads);
+  task_scheduler<cluster *> scheduler(threads);
+  scheduler.run(root, [&](const int thread, cluster *const c,
+                          task_scheduler<cluster *> &s) {
+    create_subtree(c, table, n, thread, s, counters[thread]);
+  });
+
+  totals = tree_counters();
+  totals.clusters = 1;
+  for (const auto &tc : counters) {
+    totals.clusters += tc.clusters;
+    totals.terminal_nodes += tc.terminal_nodes;
+    totals.points_in_terminal_nodes += tc.points_in_terminal_nodes;
+    totals.singular_clusters += tc.singular_clusters;
   }
 
-#ifdef VERBOSE
-  Rcpp::Rcout << "Root center : " << root->center <<std::endl;
-  Rcpp::Rcout << "Root starting index  : " << root->start <<std::endl;
-  Rcpp::Rcout << "Root length : " << root->length <<std::endl;
-  Rcpp::Rcout << "Root Rmax : " << root->Rmax <<std::endl;
-#endif
+  // Store the finished tree in a flat array and free the cluster objects.
+  PROFILE_START(nodes_start);
+  const bool ok = flatten_tree(root, target, totals.clusters);
+  destroy_tree(root);
+  PROFILE_STOP(nodes_start, phase_build_nodes);
+  return ok;
+}
 
-  // Now create the tree. Start by pushing the root cluster onto the stack.
-  Stack.push(root);
+// Copy the tree of cluster objects into a node array in breadth first
+// order. The root is stored at position 0, position 1 is left unused, so that
+// each pair of children starts at an even position.
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::flatten_tree(const cluster *const root,
+                                    node_array &target,
+                                    const long clusters) const {
+  if (!target.allocate(clusters + 1))
+    return false;
+  target[1] = tree_node();
+  store_subtree(root, 0, 2, target);
+  return true;
+}
+
+// Store the subtree below cluster subtree_root in breadth first order, the
+// root at position pos and the pairs of children from position next_free on.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::store_subtree(const cluster *const subtree_root,
+                                     const node_index pos,
+                                     node_index next_free,
+                                     node_array &target) const {
+  std::queue<pair<const cluster *, node_index> > Queue;
+  Queue.push(make_pair(subtree_root, pos));
+
+  while (!Queue.empty()) {
+    const cluster *const c = Queue.front().first;
+    tree_node &node = target[Queue.front().second];
+    Queue.pop();
+
+    node = tree_node();
+    node.Rmax = c->Rmax;
+    node.Rmedian = c->Rmedian;
+    node.center = c->center;
+    node.center_row = c->center;
+    if (c->is_terminal()) {
+      node.first = c->start;
+      node.length = c->length;
+    } else {
+      node.first = next_free;
+      node.length = 0;
+      Queue.push(make_pair((const cluster *)c->left, next_free));
+      Queue.push(make_pair((const cluster *)c->right, next_free + 1));
+      next_free += 2;
+    }
+  }
+}
+
+// Build the subtree below cluster c. Subclusters that are big enough to be
+// worth it are spawned as new tasks for the scheduler, smaller ones are
+// processed right away (use stacks to avoid recursive call of this function).
+// The clusters are sections of table, N is the number of points in the tree.
+// This runs on worker threads, so there must be no calls to the R API in here.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::create_subtree(cluster *const subtree_root,
+                                      neighbor *const table, const long N,
+                                      const int thread,
+                                      task_scheduler<cluster *> &scheduler,
+                                      tree_counters &counters) const {
+  std::stack<cluster_pointer, cluster_pointer_vector> Stack; // used for tree construction
+  Stack.push(subtree_root);
+  vector<double> radii;
 
   while (!Stack.empty()) {
     cluster* const c = Stack.top();
@@ -404,21 +1444,58 @@ template <class POINT_SET> void ATRIA<POINT_SET>::create_tree() {
     const long c_start = c->start;
     const long c_length = c->length;
 
-    neighbor* const Section = permutation_table + c_start;
+    neighbor* const Section = table + c_start;
+
+    // The distances of the points to the center of this cluster are still
+    // in the table, before they are overwritten by dividing the cluster.
+    if (c_length > 0) {
+      radii.resize(c_length);
+      for (long i = 0; i < c_length; i++)
+        radii[i] = Section[i].dist();
+      nth_element(radii.begin(), radii.begin() + c_length / 2, radii.end());
+      c->Rmedian = radii[c_length / 2];
+    }
 
     if (c->length >= MINPOINTS) { // Further divide this cluster ?
-      pair<long, long> new_child_centers =
-          find_child_cluster_centers((const cluster*) c, Section, c_length);
+      // Huge clusters near the root get their share of the threads for
+      // parallel distance scans.
+      int scan_threads = 1;
+      if (c_length >= ATRIA_PARALLEL_SCAN_MINPOINTS)
+        scan_threads = max(1L, (scheduler.threads() * c_length) / N);
 
-      if ((new_child_centers.first == -1) || (new_child_centers.second == -1))
-        continue; // cluster could not be divided further and has already been
-                  // marked as terminal cluster/node
+      PROFILE_START(centers_start);
+      pair<long, long> new_child_centers =
+          find_child_cluster_centers((const cluster*) c, Section, c_length,
+                                     scan_threads);
+      PROFILE_STOP(centers_start, phase_build_centers);
+
+      if ((new_child_centers.first == -1) || (new_child_centers.second == -1)) {
+        // cluster could not be divided further, all points coincide
+        counters.terminal_nodes++;
+        counters.points_in_terminal_nodes += c_length;
+        counters.singular_clusters++;
+        continue;
+      }
+      if (SPLIT == split_medoid) {
+        PROFILE_SCOPE(phase_build_centers);
+        new_child_centers = move_centers_to_medoids(
+            Section, c_length, new_child_centers, scan_threads);
+      }
 
+      PROFILE_START(nodes_start);
       c->left = new cluster(new_child_centers.first);
       c->right = new cluster(new_child_centers.second);
+      PROFILE_STOP(nodes_start, phase_build_nodes);
 
       // create two subclusters and set properties
-      const long j = assign_points_to_centers(Section, c_length, pair<cluster *, cluster *>(c->left, c->right));
+      const pair<cluster *, cluster *> childs(c->left, c->right);
+      PROFILE_START(assign_start);
+      const long j =
+          (SPLIT == split_balanced)
+              ? divide_points_at_median(Section, c_length, childs, scan_threads)
+              : assign_points_to_centers(Section, c_length, childs,
+                                         scan_threads);
+      PROFILE_STOP(assign_start, phase_build_assign);
 
       c->left->start = c_start + 1; // leave centers out
       c->left->length = j - 1;
@@ -426,12 +1503,21 @@ template <class POINT_SET> void ATRIA<POINT_SET>::create_tree() {
       c->right->start = c_start + j;
       c->right->length = c_length - j - 1;
 
-      // process new subclusters (use stacks to avoid recursive call of this
-      // function)
-      Stack.push(c->right);
-      Stack.push(c->left);
+      // process new subclusters
+      if ((scheduler.threads() > 1) &&
+          (c->right->length >= ATRIA_TASK_MINPOINTS)) {
+        scheduler.spawn(thread, c->right);
+      } else {
+        Stack.push(c->right);
+      }
+      if ((scheduler.threads() > 1) &&
+          (c->left->length >= ATRIA_TASK_MINPOINTS)) {
+        scheduler.spawn(thread, c->left);
+      } else {
+        Stack.push(c->left);
+      }
 
-      total_clusters += 2;
+      counters.clusters += 2;
 #ifdef DEBUG
       Rcpp::Rcout << "Cluster start " << c_start << " len: " << c_length << " radius: " << c->Rmax << " ";
       Rcpp::Rcout << "left child ctr & len: " << (c->left)->center << " " << (c->left)->length << "  ";
@@ -440,8 +1526,8 @@ template <class POINT_SET> void ATRIA<POINT_SET>::create_tree() {
     } else {              // this is going to be a terminal node
       c->Rmax = -c->Rmax; // a Rmax value <= 0 marks this cluster as a terminal
                           // node of the search tree
-      terminal_nodes++;
-      total_points_in_terminal_node += c_length;
+      counters.terminal_nodes++;
+      counters.points_in_terminal_nodes += c_length;
 #ifdef DEBUG
       Rcpp::Rcout << "Terminal node " << c->length << "  " << c->center << "  "
            << c->Rmax <<std::endl;
@@ -450,7 +1536,57 @@ template <class POINT_SET> void ATRIA<POINT_SET>::create_tree() {
   }
 }
 
-template <class POINT_SET> void ATRIA<POINT_SET>::destroy_tree() {
+// Permute the points into the order of the permutation table, so that row r
+// of the point set holds point permutation_table[r].index(). The points of a
+// terminal node then occupy the rows c->first .. c->first + c->length - 1.
+// The center rows of all nodes are updated accordingly. The current rows of
+// the points are given by index_row(). Free entries of the table get rows
+// that hold no point, the excluded points follow the table.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::reorder_points() {
+  POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+  const long rows = max(points.size(), table_size);
+  vector<node_index> order(rows);
+  vector<char> used(rows, 0);
+  for (long r = 0; r < table_size; r++) {
+    const long i = permutation_table[r].index();
+    if (i != ATRIA_FREE_ENTRY) {
+      order[r] = index_row(i);
+      used[order[r]] = 1;
+    }
+  }
+  long unused = 0;
+  for (long r = 0; r < rows; r++) {
+    if ((r < table_size) &&
+        (permutation_table[r].index() != ATRIA_FREE_ENTRY))
+      continue;
+    while (used[unused])
+      unused++;
+    order[r] = unused++;
+  }
+  if (!points.resize_points(rows) ||
+      !points.permute_points(rows,
+                             [&order](const long r) { return order[r]; })) {
+    Rcpp::Rcerr << "Point set can not be reordered" <<std::endl;
+    return;
+  }
+  points.resize_points(table_size + excluded_points);
+
+  vector<node_index> row_of(N);
+  for (long r = 0; r < table_size; r++) {
+    if (permutation_table[r].index() != ATRIA_FREE_ENTRY)
+      row_of[permutation_table[r].index()] = r;
+  }
+  for (node_index n = 0; n < nodes.size(); n++) {
+    if (n != 1) // position 1 is unused
+      nodes[n].center_row = row_of[nodes[n].center];
+  }
+  reordered = true;
+}
+
+template <class POINT_SET>
+void ATRIA<POINT_SET>::destroy_tree(cluster *const root) {
   stack<cluster_pointer, cluster_pointer_vector> Stack;
   Stack.push(root);
 
@@ -468,29 +1604,818 @@ template <class POINT_SET> void ATRIA<POINT_SET>::destroy_tree() {
   }
 }
 
+// Remember the rows of the reordered points by index, so that the tree can
+// be modified (or rebuilt) and the points reordered afterwards. Points that
+// are not in the permutation table are stored at the row of their index.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::set_build_rows() {
+  build_rows.clear();
+  if (!reordered)
+    return;
+  build_rows.resize(nearneigh_searcher<POINT_SET>::points.size());
+  for (long r = 0; r < (long)build_rows.size(); r++)
+    build_rows[r] = r;
+  for (long r = 0; r < table_size; r++) {
+    if (permutation_table[r].index() != ATRIA_FREE_ENTRY)
+      build_rows[permutation_table[r].index()] = r;
+  }
+}
+
+template <class POINT_SET>
+void ATRIA<POINT_SET>::copy_points(const long *indices, const long n,
+                                   double *x) const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  vector<node_index> row_of;
+  if (reordered) {
+    row_of.resize(points.size());
+    for (long r = 0; r < (long)row_of.size(); r++)
+      row_of[r] = r;
+    for (long r = 0; r < table_size; r++) {
+      if (permutation_table[r].index() != ATRIA_FREE_ENTRY)
+        row_of[permutation_table[r].index()] = r;
+    }
+  }
+  for (long i = 0; i < n; i++) {
+    const long row = reordered ? row_of[indices[i]] : indices[i];
+    double *dest = x + i;
+    for (auto c = points.point_begin(row); c != points.point_end(row); ++c) {
+      *dest = *c;
+      dest += n;
+    }
+  }
+}
+
+template <class POINT_SET>
+long ATRIA<POINT_SET>::insert_points(const double *x, const long n) {
+  POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  finish_rebuild(true);
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+
+  if (nearneigh_searcher<POINT_SET>::err || mapping || (excluded_points > 0)) {
+    Rcpp::Rcerr << "Points can not be added to this searcher" << std::endl;
+    return -1;
+  }
+  if (N + n >= (long)UINT32_MAX) {
+    Rcpp::Rcerr << "Too many points, tree nodes use 32 bit indices" << std::endl;
+    return -1;
+  }
+  const long rows = points.size();
+  if (!points.append_points(x, n)) {
+    Rcpp::Rcerr << "Points can not be added to this point set" << std::endl;
+    return -1;
+  }
+  drop_spill_tree();
+  if (leaf_of.empty())
+    index_leaves();
+  nearneigh_searcher<POINT_SET>::Nused = N + n;
+  if (!deleted.empty())
+    deleted.resize(N + n, 0);
+  leaf_of.resize(N + n, 1);
+
+  // The new point j is appended at row rows + j - N and takes a free entry
+  // of its terminal node, a reordered point is copied to the row of that
+  // entry. Points that do not fit into their terminal node are collected in
+  // 'added', the permutation table is then laid out again.
+  vector<pair<node_index, neighbor> > added;
+  for (long j = N; j < N + n; j++) {
+    const long row = rows + j - N;
+    const typename POINT_SET::row_iterator p = points.point_begin(row);
+    node_index c = 0;
+    double d = points.distance(nodes[0].center_row, p);
+    while (!nodes[c].is_terminal()) {
+      nodes[c].Rmax = max(nodes[c].Rmax, d);
+      const node_index left = nodes[c].first;
+      const double dl = points.distance(nodes[left].center_row, p);
+      const double dr = points.distance(nodes[left + 1].center_row, p);
+      if (dl > dr) {
+        c = left + 1;
+        d = dr;
+      } else {
+        c = left;
+        d = dl;
+      }
+    }
+
+    tree_node &leaf = nodes[c];
+    const long end = leaf.first + leaf.length;
+    const long last = leaf.first + leaf_capacity[c];
+    long free = end;
+    while ((free < last) &&
+           (permutation_table[free].index() != ATRIA_FREE_ENTRY))
+      free++;
+    if (free == last) {
+      leaf.Rmax = -max(leaf.R_max(), d);
+      added.push_back(make_pair(c, neighbor(j, d)));
+      continue;
+    }
+    // The first deleted point behind the node's points makes room.
+    if (free != end) {
+      permutation_table[free] = permutation_table[end];
+      if (reordered)
+        points.copy_point(end, free);
+    }
+    permutation_table[end] = neighbor(j, d);
+    if (reordered)
+      points.copy_point(row, end);
+    leaf_radius_sum -= leaf.R_max() * leaf.length;
+    leaf.Rmax = -max(leaf.R_max(), d);
+    leaf.length++;
+    leaf_radius_sum += leaf.R_max() * leaf.length;
+    total_points_in_terminal_node++;
+    leaf_of[j] = c;
+  }
+  changed_points += n;
+
+  if (!added.empty()) {
+    set_build_rows();
+    if (reordered) {
+      for (const auto &a : added)
+        build_rows[a.second.index()] = rows + a.second.index() - N;
+    }
+    update_layout(added);
+  } else if (reordered) {
+    points.resize_points(rows); // all new points were copied to their entries
+  }
+  return N;
+}
+
+template <class POINT_SET>
+long ATRIA<POINT_SET>::delete_points(const long *indices, const long n) {
+  POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  finish_rebuild(true);
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+
+  if (nearneigh_searcher<POINT_SET>::err || mapping) {
+    Rcpp::Rcerr << "Points can not be deleted from this searcher" << std::endl;
+    return -1;
+  }
+  for (long i = 0; i < n; i++) {
+    if ((indices[i] < 0) || (indices[i] >= N)) {
+      Rcpp::Rcerr << "Index of point to delete out of range" << std::endl;
+      return -1;
+    }
+  }
+  drop_spill_tree();
+  if (deleted.empty())
+    deleted.assign(N, 0);
+  if (leaf_of.empty())
+    index_leaves();
+
+  // A deleted point of a terminal node is exchanged with the node's last
+  // point, which shortens the node by one. Deleted centers stay in the tree.
+  long count = 0;
+  for (long i = 0; i < n; i++) {
+    const long j = indices[i];
+    if (deleted[j])
+      continue;
+    deleted[j] = 1;
+    count++;
+    const node_index c = leaf_of[j];
+    if (c == 1)
+      continue;
+    tree_node &leaf = nodes[c];
+    const long last = leaf.first + leaf.length - 1;
+    long pos = leaf.first;
+    while (permutation_table[pos].index() != j)
+      pos++;
+    std::swap(permutation_table[pos], permutation_table[last]);
+    if (reordered)
+      points.swap_points(pos, last);
+    leaf_radius_sum -= leaf.R_max();
+    leaf.length--;
+    total_points_in_terminal_node--;
+    leaf_of[j] = 1;
+  }
+  deleted_points += count;
+  changed_points += count;
+  return count;
+}
+
+// Set leaf_capacity and leaf_of for a permutation table that was not laid
+// out by add_slack(), e.g. of a new tree. Its terminal nodes have no free
+// entries.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::index_leaves() {
+  leaf_capacity.assign(nodes.size(), 0);
+  leaf_of.assign(nearneigh_searcher<POINT_SET>::Nused, 1);
+  for (node_index n = 0; n < nodes.size(); n++) {
+    const tree_node &c = nodes[n];
+    if ((n == 1) || !c.is_terminal())
+      continue;
+    leaf_capacity[n] = c.length;
+    for (long i = 0; i < (long)c.length; i++)
+      leaf_of[permutation_table[c.first + i].index()] = n;
+  }
+}
+
+// Rewrite the permutation table when inserted points do not fit into their
+// terminal nodes. The table is laid out in depth first order of the tree,
+// the center of each node followed by the points below it. The points in
+// 'added' (pairs of terminal node and point, with its distance to the
+// node's center) are appended to their terminal nodes, deleted points are
+// moved to the end of the table. Terminal nodes that became too large are
+// divided, and all terminal nodes get free entries, see add_slack().
+// Reordered points are reordered again, build_rows must give their current
+// rows.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::update_layout(
+    vector<pair<node_index, neighbor> > &added) {
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+
+  stable_sort(added.begin(), added.end(),
+              [](const pair<node_index, neighbor> &a,
+                 const pair<node_index, neighbor> &b) {
+                return a.first < b.first;
+              });
+
+  neighbor *const table = new neighbor[N];
+  vector<char> placed(N, 0);
+  long pos = 0;
+  stack<node_index, vector<node_index> > Stack;
+  Stack.push(0);
+  while (!Stack.empty()) {
+    tree_node &c = nodes[Stack.top()];
+    const node_index n = Stack.top();
+    Stack.pop();
+
+    table[pos++] = neighbor(c.center, 0);
+    placed[c.center] = 1;
+    if (c.is_terminal()) {
+      const long first = pos;
+      for (long i = 0; i < (long)c.length; i++) {
+        table[pos] = permutation_table[c.first + i];
+        placed[table[pos++].index()] = 1;
+      }
+      auto range = equal_range(added.begin(), added.end(),
+                               make_pair(n, neighbor()),
+                               [](const pair<node_index, neighbor> &a,
+                                  const pair<node_index, neighbor> &b) {
+                                 return a.first < b.first;
+                               });
+      for (auto i = range.first; i != range.second; ++i) {
+        table[pos++] = i->second;
+        placed[i->second.index()] = 1;
+      }
+      c.first = first;
+      c.length = pos - first;
+    } else {
+      Stack.push(c.first + 1);
+      Stack.push(c.first);
+    }
+  }
+  const long tree_points = pos;
+  for (long r = 0; r < table_size; r++) {
+    const long i = permutation_table[r].index();
+    if ((i != ATRIA_FREE_ENTRY) && !placed[i])
+      table[pos++] = permutation_table[r];
+  }
+
+  delete[] permutation_table;
+  permutation_table = table;
+  table_size = N;
+
+  // Nodes appended by splitting are small enough already.
+  const node_index old_nodes = nodes.size();
+  for (node_index n = 0; n < old_nodes; n++) {
+    if ((n != 1) && nodes[n].is_terminal() &&
+        ((long)nodes[n].length >= MINPOINTS))
+      split_leaf(n);
+  }
+  count_tree();
+  add_slack(tree_points);
+
+  if (reordered)
+    reorder_points();
+  build_rows.clear();
+}
+
+// Spread the permutation table, whose first tree_points entries hold the
+// tree in depth first order and the rest deleted points, so that each
+// terminal node with n points is followed by n / ATRIA_LEAF_SLACK + 1 free
+// entries, and set leaf_capacity and leaf_of. Points can only be inserted
+// if no points are excluded, the table is then kept as it is.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::add_slack(const long tree_points) {
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+  leaf_capacity.clear();
+  leaf_of.clear();
+  long size = N;
+  for (node_index n = 0; n < nodes.size(); n++) {
+    if ((n != 1) && nodes[n].is_terminal())
+      size += nodes[n].length / ATRIA_LEAF_SLACK + 1;
+  }
+  if ((excluded_points > 0) || (size >= (long)UINT32_MAX))
+    return;
+
+  neighbor *const table = new neighbor[size];
+  leaf_capacity.assign(nodes.size(), 0);
+  leaf_of.assign(N, 1);
+  long pos = 0;
+  stack<node_index, vector<node_index> > Stack;
+  Stack.push(0);
+  while (!Stack.empty()) {
+    tree_node &c = nodes[Stack.top()];
+    const node_index n = Stack.top();
+    Stack.pop();
+
+    table[pos++] = neighbor(c.center, 0);
+    if (c.is_terminal()) {
+      const long first = pos;
+      for (long i = 0; i < (long)c.length; i++) {
+        table[pos] = permutation_table[c.first + i];
+        leaf_of[table[pos++].index()] = n;
+      }
+      leaf_capacity[n] = c.length + c.length / ATRIA_LEAF_SLACK + 1;
+      while (pos < first + (long)leaf_capacity[n])
+        table[pos++] = neighbor(ATRIA_FREE_ENTRY, 0);
+      c.first = first;
+    } else {
+      Stack.push(c.first + 1);
+      Stack.push(c.first);
+    }
+  }
+  for (long r = tree_points; r < N; r++)
+    table[pos++] = permutation_table[r];
+
+  delete[] permutation_table;
+  permutation_table = table;
+  table_size = size;
+}
+
+// Divide terminal node n like a cluster during construction, the nodes of
+// the new subtree are appended to the node array. Returns false if the node
+// can not be divided, because all its points coincide (the node is singular,
+// Rmax == 0) or when out of memory.
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::split_leaf(const node_index n) {
+  const tree_node leaf = nodes[n];
+  if (leaf.Rmax == 0.0)
+    return false;
+  cluster *const c = new cluster(leaf.first, leaf.length, leaf.center);
+  c->Rmax = leaf.R_max();
+
+  task_scheduler<cluster *> scheduler(1);
+  tree_counters counters;
+  create_subtree(c, permutation_table, nearneigh_searcher<POINT_SET>::Nused, 0,
+                 scheduler, counters);
+
+  bool ok = !c->is_terminal();
+  if (ok) {
+    const node_index next_free = nodes.size();
+    ok = nodes.resize(next_free + counters.clusters);
+    if (ok) {
+      store_subtree(c, n, next_free, nodes);
+    } else {
+      // Keep the terminal node, with the distances of its points to its
+      // center, which were overwritten while dividing it.
+      Rcpp::Rcerr << "Out of memory" << std::endl;
+      neighbor *const Section = permutation_table + leaf.first;
+      for (long i = 0; i < (long)leaf.length; i++)
+        Section[i].dist() = index_distance(Section[i].index(), leaf.center);
+    }
+  }
+  destroy_tree(c);
+  return ok;
+}
+
+// Count the nodes of the tree after it was modified.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::count_tree() {
+  total_clusters = (long)nodes.size() - 1;
+  terminal_nodes = 0;
+  total_points_in_terminal_node = 0;
+  leaf_radius_sum = 0;
+  for (node_index n = 0; n < nodes.size(); n++) {
+    if ((n != 1) && nodes[n].is_terminal()) {
+      terminal_nodes++;
+      total_points_in_terminal_node += nodes[n].length;
+      leaf_radius_sum += nodes[n].R_max() * nodes[n].length;
+    }
+  }
+}
+
+// Take the current tree as the reference for tree_drift().
+template <class POINT_SET>
+void ATRIA<POINT_SET>::reset_quality() {
+  count_tree();
+  build_points = nearneigh_searcher<POINT_SET>::Nused - deleted_points;
+  changed_points = 0;
+  build_leaf_radius = mean_leaf_radius();
+}
+
+template <class POINT_SET>
+tree_shape ATRIA<POINT_SET>::shape(const tree_node *const root) {
+  tree_shape st;
+  st.nodes = 0;
+  st.depth = 0;
+  double leaf_depth = 0;
+  double radius = 0;
+  double leaf_radius = 0;
+  long count = 0;
+  stack<pair<node_index, long>, vector<pair<node_index, long> > > Stack;
+  Stack.push(make_pair(node_index(0), 0L));
+  while (!Stack.empty()) {
+    const tree_node &c = root[Stack.top().first];
+    const long depth = Stack.top().second;
+    Stack.pop();
+    st.nodes++;
+    st.depth = max(st.depth, depth);
+    radius += c.R_max();
+    if (c.is_terminal()) {
+      leaf_depth += (double)depth * c.length;
+      leaf_radius += c.R_max() * c.length;
+      count += c.length;
+    } else {
+      Stack.push(make_pair(c.first, depth + 1));
+      Stack.push(make_pair(c.first + 1, depth + 1));
+    }
+  }
+  st.mean_leaf_depth = (count > 0) ? leaf_depth / count : 0;
+  st.mean_radius = radius / st.nodes;
+  st.mean_leaf_radius = (count > 0) ? leaf_radius / count : 0;
+  return st;
+}
+
+template <class POINT_SET>
+double ATRIA<POINT_SET>::tree_drift() const {
+  const double changes = (double)changed_points / max(1L, build_points);
+  const double radius = mean_leaf_radius();
+  double growth = 0;
+  if (radius > build_leaf_radius)
+    growth = (build_leaf_radius > 0) ? radius / build_leaf_radius - 1 : 1;
+  return max(changes, growth);
+}
+
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::start_rebuild(const int threads) {
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+  const long n = N - deleted_points;
+  if (nearneigh_searcher<POINT_SET>::err || mapping || rebuild || (n < 1))
+    return false;
+
+  // The center of the root is chosen at random among the points that are
+  // not deleted, the deleted points follow the points of the tree.
+  rebuild.reset(new tree_build());
+  tree_build &t = *rebuild;
+  t.table.resize(N);
+  t.points = n;
+  t.ok = false;
+  const long root_center = My_Utilities::randindex(n);
+  long pos = 1;
+  long tail = n;
+  long k = 0;
+  for (long i = 0; i < N; i++) {
+    if (is_deleted(i))
+      t.table[tail++] = neighbor(i, 0);
+    else if (k++ == root_center)
+      t.table[0] = neighbor(i, 0);
+    else
+      t.table[pos++] = neighbor(i, 0);
+  }
+
+  // The points and build_rows are only read until finish_rebuild(), as
+  // insertions and deletions wait for the rebuild to finish.
+  set_build_rows();
+  rebuild_finished = false;
+  rebuild_thread = std::thread([this, threads]() {
+    tree_build &t = *rebuild;
+    try {
+      t.ok = build_tree(t.table.data(), t.points, t.nodes, threads,
+                        t.counters);
+    } catch (...) {
+      t.ok = false;
+    }
+    rebuild_finished = true;
+  });
+  return true;
+}
+
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::finish_rebuild(const bool wait) {
+  if (!rebuild || (!wait && !rebuild_finished))
+    return false;
+  rebuild_thread.join();
+
+  tree_build &t = *rebuild;
+  const bool ok = t.ok;
+  if (ok) {
+    std::copy(t.table.begin(), t.table.end(), permutation_table);
+    table_size = t.table.size();
+    nodes.swap(t.nodes);
+    add_slack(t.points);
+    if (reordered)
+      reorder_points();
+    reset_quality();
+    drop_spill_tree();
+  }
+  build_rows.clear();
+  rebuild.reset();
+  return ok;
+}
+
+template <class POINT_SET>
+bool ATRIA<POINT_SET>::build_spill_tree(const double overlap,
+                                        const long max_points,
+                                        const int threads,
+                                        const double max_duplication) {
+  finish_rebuild(true);
+  drop_spill_tree();
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+  if (nearneigh_searcher<POINT_SET>::err || !(overlap >= 0) ||
+      (overlap >= 1) || (max_points < 1) || !(max_duplication >= 1))
+    return false;
+
+  set_build_rows();
+  try {
+    // The root is centered at the first point of the search tree that is
+    // not deleted, usually the center of its root.
+    vector<neighbor> root_points;
+    root_points.reserve(N - deleted_points);
+    long root_center = -1;
+    for (long pos = 0; pos < table_size; pos++) {
+      const long i = permutation_table[pos].index();
+      if ((i == ATRIA_FREE_ENTRY) || is_deleted(i))
+        continue;
+      if (root_center < 0)
+        root_center = i;
+      else
+        root_points.push_back(neighbor(i, 0));
+    }
+
+    const long root_length = root_points.size();
+    // The subtree of each node may store at most as many points as its
+    // allowance, which counts the points of the node (not its center). The
+    // root is allowed max_duplication times the points of the searcher.
+    const double budget = max_duplication * (N - deleted_points) - 1;
+    parallel_for((root_length + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE,
+                 threads, [&](const int, const long block) {
+                   const long end =
+                       min(root_length, (block + 1) * ATRIA_BLOCK_SIZE);
+                   for (long i = block * ATRIA_BLOCK_SIZE; i < end; i++)
+                     root_points[i].dist() =
+                         index_distance(root_center, root_points[i].index());
+                 }, 1);
+
+    tree_node root;
+    root.center = root_center;
+    root.center_row = index_row(root_center);
+    root.Rmedian = 0;
+    spill_nodes.push_back(root);
+    spill_split.push_back(0);
+
+    // Each entry holds a node, its allowance and its points, with their
+    // distances to the node's center.
+    struct pending {
+      node_index n;
+      double allowance;
+      vector<neighbor> pts;
+    };
+    stack<pending> Stack;
+    Stack.push(pending{0, budget, std::move(root_points)});
+    vector<double> dl, dr;
+    while (!Stack.empty()) {
+      const node_index n = Stack.top().n;
+      const double allowance = Stack.top().allowance;
+      vector<neighbor> pts(std::move(Stack.top().pts));
+      Stack.pop();
+      const long length = pts.size();
+      const int scan_threads =
+          (length >= ATRIA_PARALLEL_SCAN_MINPOINTS) ? threads : 1;
+      const long blocks = (length + ATRIA_BLOCK_SIZE - 1) / ATRIA_BLOCK_SIZE;
+
+      // The right center is the point farthest from the node's center, the
+      // left center the point farthest from the right center.
+      double Rmax = 0;
+      long right = -1;
+      for (long i = 0; i < length; i++) {
+        if (pts[i].dist() > Rmax) {
+          Rmax = pts[i].dist();
+          right = i;
+        }
+      }
+      long left = -1;
+      if ((length >= max_points) && (right >= 0)) {
+        const long center_right = pts[right].index();
+        dr.resize(length);
+        parallel_for(blocks, scan_threads, [&](const int, const long block) {
+          const long end = min(length, (block + 1) * ATRIA_BLOCK_SIZE);
+          for (long i = block * ATRIA_BLOCK_SIZE; i < end; i++)
+            dr[i] = index_distance(center_right, pts[i].index());
+        }, 1);
+        double dist = 0;
+        for (long i = 0; i < length; i++) {
+          if ((i != right) && (dr[i] > dist)) {
+            dist = dr[i];
+            left = i;
+          }
+        }
+      }
+
+      if (left < 0) { // small node or all points coincide
+        if (spill_table.size() + length >= UINT32_MAX)
+          throw std::bad_alloc(); // too many points for 32 bit indices
+        spill_nodes[n].Rmax = -Rmax;
+        spill_nodes[n].first = spill_table.size();
+        spill_nodes[n].length = length;
+        for (const neighbor &p : pts) {
+          spill_table.push_back(p);
+          if (reordered)
+            spill_rows.push_back(index_row(p.index()));
+        }
+        continue;
+      }
+
+      const long center_left = pts[left].index();
+      dl.resize(length);
+      parallel_for(blocks, scan_threads, [&](const int, const long block) {
+        const long end = min(length, (block + 1) * ATRIA_BLOCK_SIZE);
+        for (long i = block * ATRIA_BLOCK_SIZE; i < end; i++)
+          dl[i] = index_distance(center_left, pts[i].index());
+      }, 1);
+
+      // The points are ordered by dl - dr, the ones below the median go to
+      // the left child, the others to the right one. The points within
+      // 'extra' positions from the median go to both. The subtree can afford
+      // an overlap of at most ratio^(1 / levels) - 1 on each of the about
+      // 'levels' levels below the node, with ratio = allowance / length, so
+      // the overlap is reduced evenly on all levels when the allowance does
+      // not suffice. The rest of the surplus is shared by the children in
+      // proportion to their number of points.
+      vector<pair<double, long> > keys;
+      keys.reserve(length - 2);
+      for (long i = 0; i < length; i++) {
+        if ((i != left) && (i != right))
+          keys.push_back(make_pair(dl[i] - dr[i], i));
+      }
+      const long m = keys.size();
+      const long half = m / 2;
+      const double surplus = max(0.0, allowance - length);
+      // The number of levels depends on the overlap itself, a few iterations
+      // starting from the requested overlap find it.
+      double affordable = overlap;
+      for (int i = 0; i < 3; i++) {
+        const double levels =
+            max(1.0, ceil(log((double)length / max_points) /
+                          log(2 / (1 + affordable))));
+        affordable = min(overlap, pow(1 + surplus / length, 1 / levels) - 1);
+      }
+      const long extra = min(min(half, (long)(affordable * m / 2 + 0.5)),
+                             (long)(surplus / 2));
+      const long lo = half - extra;
+      const long hi = min(m, half + extra);
+      if (half < m) {
+        nth_element(keys.begin(), keys.begin() + half, keys.end());
+        spill_split[n] = keys[half].first;
+        if (lo < half)
+          nth_element(keys.begin(), keys.begin() + lo, keys.begin() + half);
+        if (hi > half + 1)
+          nth_element(keys.begin() + half + 1, keys.begin() + hi - 1,
+                      keys.end());
+      } else {
+        spill_split[n] = 0;
+      }
+      vector<neighbor> left_points, right_points;
+      left_points.reserve(hi);
+      right_points.reserve(m - lo);
+      for (long r = 0; r < hi; r++) {
+        const long i = keys[r].second;
+        left_points.push_back(neighbor(pts[i].index(), dl[i]));
+      }
+      for (long r = lo; r < m; r++) {
+        const long i = keys[r].second;
+        right_points.push_back(neighbor(pts[i].index(), dr[i]));
+      }
+
+      const node_index child = spill_nodes.size();
+      tree_node c;
+      c.Rmedian = 0;
+      c.center = center_left;
+      c.center_row = index_row(center_left);
+      spill_nodes.push_back(c);
+      c.center = pts[right].index();
+      c.center_row = index_row(c.center);
+      spill_nodes.push_back(c);
+      spill_split.resize(spill_nodes.size(), 0);
+      spill_nodes[n].Rmax = Rmax;
+      spill_nodes[n].first = child;
+      spill_nodes[n].length = 0;
+
+      pts = vector<neighbor>();
+      const double share =
+          (m > 0) ? (surplus - 2 * extra) / (hi + m - lo) : 0;
+      const double left_allowance = hi * (1 + share);
+      const double right_allowance = (m - lo) * (1 + share);
+      Stack.push(pending{node_index(child + 1), right_allowance,
+                         std::move(right_points)});
+      Stack.push(pending{child, left_allowance, std::move(left_points)});
+    }
+  } catch (std::bad_alloc &) {
+    Rcpp::Rcerr << "Out of memory" << std::endl;
+    drop_spill_tree();
+  }
+  build_rows.clear();
+  return has_spill_tree();
+}
+
+// Search the terminal node of the spill tree that the query point falls
+// into, and the centers on the way to it.
 template <class POINT_SET>
 template <class ForwardIterator>
-long ATRIA<POINT_SET>::search_k_neighbors(vector<neighbor> &v, const long k,
+void ATRIA<POINT_SET>::defeatist_search(search_context &ctx,
+                                        ForwardIterator query_point,
+                                        const long first,
+                                        const long last) const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  SortedNeighborTable &table = ctx.table;
+  auto test_center = [&](const tree_node *const c, const double d) {
+    const double t = table_distance(d, squared_table());
+    if ((table.highdist() > t) && ((c->center < first) || (c->center > last)))
+      table.insert(neighbor(c->center, t));
+  };
+
+  const tree_node *c = spill_nodes.data();
+  double d = points.distance(c->center_row, query_point);
+  ctx.points_searched++;
+  test_center(c, d);
+  while (!c->is_terminal()) {
+    const tree_node *const left = &spill_nodes[c->first];
+    const double dl = points.distance(left[0].center_row, query_point);
+    const double dr = points.distance(left[1].center_row, query_point);
+    ctx.points_searched += 2;
+    test_center(left, dl);
+    test_center(left + 1, dr);
+    if (dl - dr >= spill_split[c - spill_nodes.data()]) {
+      c = left + 1;
+      d = dr;
+    } else {
+      c = left;
+      d = dl;
+    }
+  }
+
+  ctx.terminal_cluster_searched++;
+  const neighbor *const section = spill_table.data() + c->first;
+  for (long i = 0; i < (long)c->length; i++) {
+    const long j = section[i].index();
+    if ((j >= first) && (j <= last))
+      continue;
+    if (table.highdist() >
+        table_distance(fabs(d - section[i].dist()), squared_table())) {
+      const long row = reordered ? spill_rows[c->first + i] : j;
+      test(ctx, j, row, query_point, table.highdist(), squared_table());
+    }
+  }
+}
+
+template <class POINT_SET>
+template <class ForwardIterator>
+long ATRIA<POINT_SET>::search_k_neighbors(search_context &ctx,
+                                          vector<neighbor> &v, const long k,
                                           ForwardIterator query_point,
                                           const long first, const long last,
-                                          const double epsilon) {
-  number_of_queries++;
-  table.init_search(k);
+                                          const search_limits &limits) const {
+  ctx.start_query();
+  ctx.table.init_search(k);
 
-  search(query_point, first, last, epsilon);
-
-  // Append nearneigh_searcher<POINT_SET>::table items to v. Initially v
-  // should be empty, afterwards nearneigh_searcher<POINT_SET>::table is empty.
-  return table.finish_search(v);
+  if (limits.defeatist && has_spill_tree())
+    defeatist_search(ctx, query_point, first, last);
+  else
+    search(ctx, query_point, first, last, limits);
+  ctx.finish_query(true_distance(ctx.table.highdist(), squared_table()));
+
+  // Append ctx.table items to v. Initially v should be empty, afterwards
+  // ctx.table is empty.
+  PROFILE_SCOPE(phase_search_results);
+  const size_t found = v.size();
+  const long count = ctx.table.finish_search(v);
+  for (size_t i = found; i < v.size(); i++)
+    v[i].dist() = true_distance(v[i].dist(), squared_table());
+  return count;
 }
 
 template <class POINT_SET>
 template <class ForwardIterator>
-void ATRIA<POINT_SET>::search(ForwardIterator query_point, const long first,
-                              const long last, const double epsilon) {
-  points_searched++;
+void ATRIA<POINT_SET>::search(search_context &ctx,
+                              ForwardIterator query_point, const long first,
+                              const long last,
+                              const search_limits &limits) const {
+  priority_queue<SearchItem, vector<SearchItem>, searchitemCompare>
+      &search_queue = ctx.search_queue;
+  SortedNeighborTable &table = ctx.table;
+
+  // The budgets of this query as limits of the statistics counters.
+  const unsigned long max_points_searched =
+      (limits.max_distances > 0) ? ctx.points_searched + limits.max_distances
+                                 : ULONG_MAX;
+  const unsigned long max_terminal_nodes =
+      (limits.max_terminal_nodes > 0)
+          ? ctx.terminal_cluster_searched + limits.max_terminal_nodes
+          : ULONG_MAX;
+
+  ctx.points_searched++;
+  const tree_node *const root = nodes.data();
   const double root_dist =
-      nearneigh_searcher<POINT_SET>::points.distance(root->center, query_point);
+      nearneigh_searcher<POINT_SET>::points.distance(root->center_row, query_point);
 
   // Clear search queue.
   while (!search_queue.empty())
@@ -498,57 +2423,87 @@ void ATRIA<POINT_SET>::search(ForwardIterator query_point, const long first,
 
   // Push root cluster as search item into the PR-QUEUE
   search_queue.push(SearchItem(root, root_dist));
+  ctx.queue_pushes++;
 
   while (!search_queue.empty()) {
+    PROFILE_START(pop_start);
     const SearchItem si = search_queue.top();
     search_queue.pop();
-    const cluster *const c = si.clusterp();
-
-    if ((table.highdist() > si.dist()) &&
-        ((c->center < first) || (c->center > last)))
-      table.insert(neighbor(c->center, si.dist()));
-
-    // Support approximative (epsilon > 0) queries.
-    if (table.highdist() >= (si.d_min() * (1.0 + epsilon))) {
+    PROFILE_STOP(pop_start, phase_search_queue);
+    const tree_node *const c = si.clusterp();
+    // distance to the center as kept in the table
+    const double d = table_distance(si.dist(), squared_table());
+
+    if ((table.highdist() > d) &&
+        ((c->center < first) || (c->center > last)) && !is_deleted(c->center))
+      table.insert(neighbor(c->center, d));
+
+    if (ctx.points_searched >= max_points_searched)
+      break; // budget exhausted
+
+    // Support approximative (epsilon > 0 or median pruning) queries.
+    const double high = true_distance(table.highdist(), squared_table());
+    if ((high >= (si.d_min() * (1.0 + limits.epsilon))) &&
+        (!limits.median_pruning || (high >= si.dist() - c->Rmedian))) {
       if (c->is_terminal()) {
-        const neighbor *const Section = permutation_table + c->start;
-        terminal_cluster_searched++;
+        if (ctx.terminal_cluster_searched >= max_terminal_nodes)
+          break; // budget exhausted
+        PROFILE_SCOPE(phase_search_leaves);
+        const neighbor *const Section = permutation_table + c->first;
+        ctx.terminal_cluster_searched++;
 
         // Do all points in the cluster coincide ?
         if (c->Rmax == 0.0) {
           for (long i = 0; i < c->length; i++) {
             const long j = Section[i].index();
 
-            if (table.highdist() <= si.dist())
+            if (table.highdist() <= d)
               break;
 
             if ((j < first) || (j > last))
-              table.insert(neighbor(j, si.dist()));
+              table.insert(neighbor(j, d));
           }
         } else {
           for (long i = 0; i < c->length; i++) {
             const long j = Section[i].index();
 
+            if (i + 1 < c->length)
+              nearneigh_searcher<POINT_SET>::points.prefetch(
+                  point_row(c, i + 1, Section[i + 1].index()));
             if ((j < first) || (j > last)) {
-              if (table.highdist() > fabs(si.dist() - Section[i].dist()))
-                test(j, query_point, table.highdist());
+              if (table.highdist() >
+                  table_distance(fabs(si.dist() - Section[i].dist()),
+                                 squared_table())) {
+                if (ctx.points_searched >= max_points_searched)
+                  break;
+                test(ctx, j, point_row(c, i, j), query_point,
+                     table.highdist(), squared_table());
+              }
             }
           }
         }
       } else {
         // This is an internal node.
+        if (ctx.points_searched + 2 > max_points_searched)
+          break; // budget exhausted
+        const tree_node *const left = nodes.left_child(c);
+        const tree_node *const right = left + 1;
+        PROFILE_START(centers_start);
         const double dl = nearneigh_searcher<POINT_SET>::points.distance(
-            c->left->center, query_point);
+            left->center_row, query_point);
         const double dr = nearneigh_searcher<POINT_SET>::points.distance(
-            c->right->center, query_point);
-        points_searched += 2;
+            right->center_row, query_point);
+        PROFILE_STOP(centers_start, phase_search_centers);
+        ctx.points_searched += 2;
         // create child cluster search items
-        SearchItem si_left = SearchItem(c->left, dl, dr, si);
-        SearchItem si_right = SearchItem(c->right, dr, dl, si);
+        SearchItem si_left = SearchItem(left, dl, dr, si);
+        SearchItem si_right = SearchItem(right, dr, dl, si);
 
         // priority based search
+        PROFILE_SCOPE(phase_search_queue);
         search_queue.push(si_right);
         search_queue.push(si_left);
+        ctx.queue_pushes += 2;
       }
     }
   }
@@ -556,36 +2511,42 @@ void ATRIA<POINT_SET>::search(ForwardIterator query_point, const long first,
 
 template <class POINT_SET>
 template <class ForwardIterator>
-long ATRIA<POINT_SET>::search_range(vector<neighbor> &v, const double radius,
+long ATRIA<POINT_SET>::search_range(search_context &ctx, vector<neighbor> &v,
+                                    const double radius,
                                     ForwardIterator query_point,
-                                    const long first, const long last) {
+                                    const long first, const long last) const {
+  stack<SearchItem, vector<SearchItem> > &SearchStack = ctx.SearchStack;
   long count = 0;
 
-  number_of_queries++;
-  points_searched++;
+  ctx.number_of_queries++;
+  ctx.points_searched++;
 
   while (!SearchStack.empty())
     SearchStack.pop(); // make shure stack is empty
 
+  const tree_node *const root = nodes.data();
   SearchStack.push(
       SearchItem(root, nearneigh_searcher<POINT_SET>::points.distance(
-                            root->center, query_point)));
+                            root->center_row, query_point)));
 
   while (!SearchStack.empty()) {
+    PROFILE_START(pop_start);
     const SearchItem si = SearchStack.top();
     SearchStack.pop();
+    PROFILE_STOP(pop_start, phase_search_queue);
 
     if (radius >= si.d_min()) {
-      const cluster *const c = si.clusterp();
+      const tree_node *const c = si.clusterp();
 
       if (((c->center < first) || (c->center > last)) &&
-          (si.dist() <= radius)) {
+          (si.dist() <= radius) && !is_deleted(c->center)) {
         v.push_back(neighbor(c->center, si.dist()));
         count++;
       }
 
       if (c->is_terminal()) { // this is a terminal node
-        const neighbor *const Section = permutation_table + c->start;
+        PROFILE_SCOPE(phase_search_leaves);
+        const neighbor *const Section = permutation_table + c->first;
 
         if (c->Rmax == 0.0) { // cluster has zero radius, so all
                               // nearneigh_searcher<POINT_SET>::points inside
@@ -604,33 +2565,41 @@ long ATRIA<POINT_SET>::search_range(vector<neighbor> &v, const double radius,
           for (long i = 0; i < c->length; i++) {
             const long j = Section[i].index();
 
+            if (i + 1 < c->length)
+              nearneigh_searcher<POINT_SET>::points.prefetch(
+                  point_row(c, i + 1, Section[i + 1].index()));
             if (((j < first) || (j > last)) &&
                 (radius >= fabs(si.dist() - Section[i].dist()))) {
 #ifdef PARTIAL_SEARCH
               const double d = nearneigh_searcher<POINT_SET>::points.distance(
-                  j, query_point, radius);
+                  point_row(c, i, j), query_point, radius);
 #else
               const double d = nearneigh_searcher<POINT_SET>::points.distance(
-                  j, query_point);
+                  point_row(c, i, j), query_point);
 #endif
               if (d <= radius) {
                 v.push_back(neighbor(j, d));
                 count++;
               }
-              points_searched++;
+              ctx.points_searched++;
             }
           }
         }
-        terminal_cluster_searched++;
+        ctx.terminal_cluster_searched++;
       } else { // this is an internal node
+        const tree_node *const left = nodes.left_child(c);
+        const tree_node *const right = left + 1;
+        PROFILE_START(centers_start);
         const double dl = nearneigh_searcher<POINT_SET>::points.distance(
-            c->left->center, query_point);
+            left->center_row, query_point);
         const double dr = nearneigh_searcher<POINT_SET>::points.distance(
-            c->right->center, query_point);
-        points_searched += 2;
-        const SearchItem x = SearchItem(c->left, dl, dr, si);
-        const SearchItem y = SearchItem(c->right, dr, dl, si);
+            right->center_row, query_point);
+        PROFILE_STOP(centers_start, phase_search_centers);
+        ctx.points_searched += 2;
+        const SearchItem x = SearchItem(left, dl, dr, si);
+        const SearchItem y = SearchItem(right, dr, dl, si);
 
+        PROFILE_SCOPE(phase_search_queue);
         SearchStack.push(x);
         SearchStack.push(y);
       }
@@ -642,21 +2611,102 @@ long ATRIA<POINT_SET>::search_range(vector<neighbor> &v, const double radius,
 
 template <class POINT_SET>
 template <class ForwardIterator>
-long ATRIA<POINT_SET>::count_range(const double radius,
+void ATRIA<POINT_SET>::brute_force_k_neighbors(
+    search_context &ctx, vector<neighbor> *v, const long k,
+    const ForwardIterator *query_points, const long nq, const long *first,
+    const long *last, query_statistics *stats) const {
+  const long N = tree_rows();
+  const long tile = max(
+      16L, (long)(ATRIA_BRUTE_FORCE_TILE_BYTES /
+                  (sizeof(typename POINT_SET::value_type) *
+                   nearneigh_searcher<POINT_SET>::points.dimension())));
+  vector<SortedNeighborTable> &tables = ctx.tables;
+  if ((long)tables.size() < nq)
+    tables.resize(nq);
+  vector<unsigned long> searched(nq, 0);
+  for (long q = 0; q < nq; q++)
+    tables[q].init_search(k);
+
+  vector<pair<long, long> > rows;
+  for (long r0 = 0; r0 < N; r0 += tile) {
+    live_rows(r0, min(N, r0 + tile), rows);
+    PROFILE_SCOPE(phase_search_leaves);
+    for (long q = 0; q < nq; q++) {
+      SortedNeighborTable &table = tables[q];
+      const ForwardIterator qp = query_points[q];
+      for (const auto &x : rows) {
+        if ((x.first >= first[q]) && (x.first <= last[q]))
+          continue;
+        const double d =
+            row_distance(x.second, qp, table.highdist(), squared_table());
+        if (d < table.highdist())
+          table.insert(neighbor(x.first, d));
+        searched[q]++;
+      }
+    }
+  }
+
+  PROFILE_SCOPE(phase_search_results);
+  for (long q = 0; q < nq; q++) {
+    ctx.start_query();
+    ctx.points_searched += searched[q];
+    ctx.finish_query(true_distance(tables[q].highdist(), squared_table()));
+    if (stats != nullptr)
+      stats[q] = ctx.last_query;
+    const size_t found = v[q].size();
+    tables[q].finish_search(v[q]);
+    for (size_t i = found; i < v[q].size(); i++)
+      v[q][i].dist() = true_distance(v[q][i].dist(), squared_table());
+  }
+}
+
+template <class POINT_SET>
+template <class ForwardIterator>
+long ATRIA<POINT_SET>::brute_force_range(search_context &ctx,
+                                         vector<neighbor> &v,
+                                         const double radius,
+                                         ForwardIterator query_point,
+                                         const long first,
+                                         const long last) const {
+  const long N = tree_rows();
+  long count = 0;
+
+  ctx.number_of_queries++;
+  PROFILE_SCOPE(phase_search_leaves);
+  for (long r = 0; r < N; r++) {
+    const long j = reordered ? permutation_table[r].index() : r;
+    if ((j == ATRIA_FREE_ENTRY) || ((j >= first) && (j <= last)) ||
+        is_deleted(j))
+      continue;
+    const double d = row_distance(r, query_point, radius, std::false_type());
+    if (d <= radius) {
+      v.push_back(neighbor(j, d));
+      count++;
+    }
+    ctx.points_searched++;
+  }
+  return count;
+}
+
+template <class POINT_SET>
+template <class ForwardIterator>
+long ATRIA<POINT_SET>::count_range(search_context &ctx, const double radius,
                                    ForwardIterator query_point,
-                                   const long first, const long last) {
+                                   const long first, const long last) const {
+  stack<SearchItem, vector<SearchItem> > &SearchStack = ctx.SearchStack;
   long count = 0;
 
-  number_of_queries++;
-  points_searched++;
+  ctx.number_of_queries++;
+  ctx.points_searched++;
 
   // Make shure stack is empty.
   while (!SearchStack.empty())
     SearchStack.pop();
 
+  const tree_node *const root = nodes.data();
   SearchStack.push(
       SearchItem(root, nearneigh_searcher<POINT_SET>::points.distance(
-                            root->center, query_point)));
+                            root->center_row, query_point)));
 
   while (!SearchStack.empty()) {
     const SearchItem si = SearchStack.top();
@@ -664,15 +2714,15 @@ long ATRIA<POINT_SET>::count_range(const double radius,
     SearchStack.pop();
 
     if (radius >= si.d_min()) {
-      const cluster *const c = si.clusterp();
+      const tree_node *const c = si.clusterp();
 
       if (((c->center < first) || (c->center > last)) &&
-          (si.dist() <= radius)) {
+          (si.dist() <= radius) && !is_deleted(c->center)) {
         count++;
       }
 
       if (c->is_terminal()) { // this is a terminal terminal node
-        const neighbor *const Section = permutation_table + c->start;
+        const neighbor *const Section = permutation_table + c->first;
 
         if (c->Rmax == 0.0) { // cluster has zero radius, so all
                               // nearneigh_searcher<POINT_SET>::points inside
@@ -690,31 +2740,36 @@ long ATRIA<POINT_SET>::count_range(const double radius,
           for (long i = 0; i < c->length; i++) {
             const long j = Section[i].index(); // index of Vergleichspunkt
 
+            if (i + 1 < c->length)
+              nearneigh_searcher<POINT_SET>::points.prefetch(
+                  point_row(c, i + 1, Section[i + 1].index()));
             if (((j < first) || (j > last)) &&
                 (radius >= fabs(si.dist() - Section[i].dist()))) {
 #ifdef PARTIAL_SEARCH
               if (nearneigh_searcher<POINT_SET>::points.distance(
-                      j, query_point, radius) <= radius)
+                      point_row(c, i, j), query_point, radius) <= radius)
                 count++;
 #else
               if (nearneigh_searcher<POINT_SET>::points.distance(
-                      j, query_point) <= radius)
+                      point_row(c, i, j), query_point) <= radius)
                 count++;
 #endif
-              points_searched++;
+              ctx.points_searched++;
             }
           }
         }
-        terminal_cluster_searched++;
+        ctx.terminal_cluster_searched++;
       } else { // this is an internal node
+        const tree_node *const left = nodes.left_child(c);
+        const tree_node *const right = left + 1;
         const double dl = nearneigh_searcher<POINT_SET>::points.distance(
-            c->left->center, query_point);
+            left->center_row, query_point);
         const double dr = nearneigh_searcher<POINT_SET>::points.distance(
-            c->right->center, query_point);
-        points_searched += 2;
+            right->center_row, query_point);
+        ctx.points_searched += 2;
 
-        const SearchItem x = SearchItem(c->left, dl, dr, si);
-        const SearchItem y = SearchItem(c->right, dr, dl, si);
+        const SearchItem x = SearchItem(left, dl, dr, si);
+        const SearchItem y = SearchItem(right, dr, dl, si);
 
         SearchStack.push(x);
         SearchStack.push(y);
@@ -725,4 +2780,617 @@ long ATRIA<POINT_SET>::count_range(const double radius,
   return count;
 }
 
+// Same traversal as count_range with the largest radius. Each point found is
+// counted in the bin of its distance, the bins are summed up at the end.
+template <class POINT_SET>
+template <class ForwardIterator>
+void ATRIA<POINT_SET>::count_range_multi(search_context &ctx,
+                                         const radius_bins &bins,
+                                         ForwardIterator query_point,
+                                         const long first, const long last,
+                                         long *const counts) const {
+  stack<SearchItem, vector<SearchItem> > &SearchStack = ctx.SearchStack;
+  const double radius = bins.max_radius();
+  const long nbins = bins.size();
+
+  for (long b = 0; b < nbins; b++)
+    counts[b] = 0;
+
+  ctx.number_of_queries++;
+  ctx.points_searched++;
+
+  // Make shure stack is empty.
+  while (!SearchStack.empty())
+    SearchStack.pop();
+
+  const tree_node *const root = nodes.data();
+  SearchStack.push(
+      SearchItem(root, nearneigh_searcher<POINT_SET>::points.distance(
+                            root->center_row, query_point)));
+
+  while (!SearchStack.empty()) {
+    const SearchItem si = SearchStack.top();
+
+    SearchStack.pop();
+
+    if (radius >= si.d_min()) {
+      const tree_node *const c = si.clusterp();
+
+      if (((c->center < first) || (c->center > last)) &&
+          (si.dist() <= radius) && !is_deleted(c->center)) {
+        counts[bins.bin(si.dist())]++;
+      }
+
+      if (c->is_terminal()) {
+        const neighbor *const Section = permutation_table + c->first;
+
+        if (c->Rmax == 0.0) { // cluster has zero radius, so all points
+                              // inside will have the same distance to q
+          if (radius >= si.dist()) {
+            long count = 0;
+            for (long i = 0; i < c->length; i++) {
+              const long j = Section[i].index();
+
+              if ((j < first) || (j > last)) {
+                count++;
+              }
+            }
+            counts[bins.bin(si.dist())] += count;
+          }
+        } else {
+          for (long i = 0; i < c->length; i++) {
+            const long j = Section[i].index();
+
+            if (i + 1 < c->length)
+              nearneigh_searcher<POINT_SET>::points.prefetch(
+                  point_row(c, i + 1, Section[i + 1].index()));
+            if (((j < first) || (j > last)) &&
+                (radius >= fabs(si.dist() - Section[i].dist()))) {
+#ifdef PARTIAL_SEARCH
+              const double d = nearneigh_searcher<POINT_SET>::points.distance(
+                  point_row(c, i, j), query_point, radius);
+#else
+              const double d = nearneigh_searcher<POINT_SET>::points.distance(
+                  point_row(c, i, j), query_point);
+#endif
+              if (d <= radius)
+                counts[bins.bin(d)]++;
+              ctx.points_searched++;
+            }
+          }
+        }
+        ctx.terminal_cluster_searched++;
+      } else { // this is an internal node
+        const tree_node *const left = nodes.left_child(c);
+        const tree_node *const right = left + 1;
+        const double dl = nearneigh_searcher<POINT_SET>::points.distance(
+            left->center_row, query_point);
+        const double dr = nearneigh_searcher<POINT_SET>::points.distance(
+            right->center_row, query_point);
+        ctx.points_searched += 2;
+
+        const SearchItem x = SearchItem(left, dl, dr, si);
+        const SearchItem y = SearchItem(right, dr, dl, si);
+
+        SearchStack.push(x);
+        SearchStack.push(y);
+      }
+    }
+  }
+
+  for (long b = 1; b < nbins; b++)
+    counts[b] += counts[b - 1];
+}
+
+template <class POINT_SET>
+template <class Function>
+void ATRIA<POINT_SET>::all_k_neighbors(const long k, const long theiler_window,
+                                       const int threads, Function store) {
+  const int nthreads = (threads < 1) ? 1 : threads;
+  vector<search_context> contexts(nthreads);
+  vector<dual_queue> queues(nthreads);
+  vector<vector<SortedNeighborTable> > tables(nthreads);
+  vector<vector<neighbor> > results(nthreads);
+
+  vector<node_index> leaves;
+  for (node_index n = 0; n < nodes.size(); n++) {
+    if ((n != 1) && nodes[n].is_terminal() && (nodes[n].length > 0))
+      leaves.push_back(n);
+  }
+
+  // Points in terminal nodes.
+  parallel_for((long)leaves.size(), nthreads,
+               [&](const int t, const long l) {
+                 const tree_node *const q = &nodes[leaves[l]];
+                 leaf_k_neighbors(contexts[t], queues[t], tables[t], q, k,
+                                  theiler_window);
+                 const neighbor *const Section = permutation_table + q->first;
+                 for (long i = 0; i < q->length; i++) {
+                   vector<neighbor> &v = results[t];
+                   v.clear();
+                   tables[t][i].finish_search(v);
+                   store(t, Section[i].index(), v);
+                 }
+               }, 1);
+
+  // Centers of all tree nodes, position 1 of the node array is unused.
+  // Deleted centers are skipped.
+  parallel_for((long)nodes.size(), nthreads,
+               [&](const int t, const long n) {
+                 if ((n == 1) || is_deleted(nodes[n].center))
+                   return;
+                 const tree_node &c = nodes[n];
+                 vector<neighbor> &v = results[t];
+                 v.clear();
+                 search_k_neighbors(
+                     contexts[t], v, k,
+                     nearneigh_searcher<POINT_SET>::points.point_begin(
+                         c.center_row),
+                     (long)c.center - theiler_window,
+                     (long)c.center + theiler_window);
+                 store(t, (long)c.center, v);
+               });
+
+  for (const auto &ctx : contexts)
+    merge_statistics(ctx);
+}
+
+// Search the k nearest neighbors of all points in terminal node q, the
+// results are left in tables[0 .. q->length - 1]. The reference tree is
+// traversed in order of increasing lower bound for the distance between
+// points of q and points of the reference node. A reference node is
+// pruned when this bound exceeds the current k-th neighbor distance of every
+// query point. Distances to centers of reference nodes are computed once for
+// the whole terminal node and bound the distance of each query point p via
+// the triangle inequality, as the distance of p to q's center is known from
+// the permutation table.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::leaf_k_neighbors(search_context &ctx,
+                                        dual_queue &queue,
+                                        vector<SortedNeighborTable> &tables,
+                                        const tree_node *const q,
+                                        const long k,
+                                        const long theiler_window) const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const neighbor *const QSection = permutation_table + q->first;
+  const long nq = q->length;
+  const double Rq = q->R_max();
+
+  if ((long)tables.size() < nq)
+    tables.resize(nq);
+  for (long i = 0; i < nq; i++)
+    tables[i].init_search(k);
+  ctx.number_of_queries += nq;
+
+  // Start with the neighbors within q itself, which gives tight bounds for
+  // the traversal right from the beginning. The distances to q's center are
+  // known already, every other pair of points is computed only once.
+  const long q_center = q->center;
+  for (long i = 0; i < nq; i++) {
+    const long j = QSection[i].index();
+    if (((q_center < j - theiler_window) || (q_center > j + theiler_window)) &&
+        !is_deleted(q_center))
+      tables[i].insert(neighbor(q_center, QSection[i].dist()));
+    const typename POINT_SET::row_iterator p =
+        points.point_begin(point_row(q, i, j));
+    for (long r = i + 1; r < nq; r++) {
+      const long m = QSection[r].index();
+      if ((m < j - theiler_window) || (m > j + theiler_window)) {
+        const double d = points.distance(point_row(q, r, m), p);
+        ctx.points_searched++;
+        if (d < tables[i].highdist())
+          tables[i].insert(neighbor(m, d));
+        if (d < tables[r].highdist())
+          tables[r].insert(neighbor(j, d));
+      }
+    }
+  }
+
+  // Largest k-th neighbor distance of all query points.
+  double highdist = 0;
+  for (long i = 0; i < nq; i++)
+    highdist = max(highdist, tables[i].highdist());
+
+  while (!queue.empty())
+    queue.pop();
+  const tree_node *const root = nodes.data();
+  const double d_root = points.distance(root->center_row,
+                                        points.point_begin(q->center_row));
+  ctx.points_searched++;
+  queue.push(dual_item(root, d_root, max(0.0, d_root - Rq - root->R_max())));
+  ctx.queue_pushes++;
+
+  while (!queue.empty()) {
+    const dual_item item = queue.top();
+    queue.pop();
+    if (item.lb >= highdist)
+      break; // all remaining nodes have a larger lower bound
+
+    const tree_node *const c = item.node;
+    const long center = c->center;
+
+    for (long i = 0; (c != q) && (i < nq); i++) {
+      SortedNeighborTable &table = tables[i];
+      const long j = QSection[i].index();
+      const double lb = fabs(item.d - QSection[i].dist()); // <= d(p, center)
+      const typename POINT_SET::row_iterator p =
+          points.point_begin(point_row(q, i, j));
+
+      if (c->is_terminal()) {
+        if (lb - c->R_max() >= table.highdist())
+          continue;
+        // The exact distance to the center bounds the distances to all
+        // points in the reference node.
+        const double dc = points.distance(c->center_row, p);
+        ctx.points_searched++;
+        if ((dc < table.highdist()) &&
+            ((center < j - theiler_window) || (center > j + theiler_window)) &&
+            !is_deleted(center))
+          table.insert(neighbor(center, dc));
+
+        const neighbor *const Section = permutation_table + c->first;
+        for (long r = 0; r < c->length; r++) {
+          const long m = Section[r].index();
+          if ((m < j - theiler_window) || (m > j + theiler_window)) {
+            if (table.highdist() > fabs(dc - Section[r].dist())) {
+#ifdef PARTIAL_SEARCH
+              const double d =
+                  points.distance(point_row(c, r, m), p, table.highdist());
+#else
+              const double d = points.distance(point_row(c, r, m), p);
+#endif
+              ctx.points_searched++;
+              if (d < table.highdist())
+                table.insert(neighbor(m, d));
+            }
+          }
+        }
+      } else if ((lb < table.highdist()) &&
+                 ((center < j - theiler_window) ||
+                  (center > j + theiler_window)) &&
+                 !is_deleted(center)) {
+        // The center of an internal node is a candidate itself.
+#ifdef PARTIAL_SEARCH
+        const double d = points.distance(c->center_row, p, table.highdist());
+#else
+        const double d = points.distance(c->center_row, p);
+#endif
+        ctx.points_searched++;
+        if (d < table.highdist())
+          table.insert(neighbor(center, d));
+      }
+    }
+
+    highdist = 0;
+    for (long i = 0; i < nq; i++)
+      highdist = max(highdist, tables[i].highdist());
+
+    if (c->is_terminal()) {
+      ctx.terminal_cluster_searched++;
+    } else {
+      const tree_node *const left = nodes.left_child(c);
+      const tree_node *const right = left + 1;
+      const double dl = points.distance(left->center_row,
+                                        points.point_begin(q->center_row));
+      const double dr = points.distance(right->center_row,
+                                        points.point_begin(q->center_row));
+      ctx.points_searched += 2;
+      queue.push(
+          dual_item(left, dl, max(item.lb, dl - Rq - left->R_max())));
+      queue.push(
+          dual_item(right, dr, max(item.lb, dr - Rq - right->R_max())));
+      ctx.queue_pushes += 2;
+    }
+  }
+}
+
+// Counting pairs of points is a dual-tree traversal. A subtree consists of
+// the node's center and all points below the node, all of them are within
+// distance R_max() of the center. For two disjoint subtrees with centers at
+// distance d, all pair distances lie within [d - Ra - Rb, d + Ra + Rb], all
+// pairs within one subtree within [0, 2 R]. If no radius separates the
+// bounds, the product of the subtree sizes is added to the common bin.
+// Otherwise the node with the larger radius is split into its center and
+// its two children. Pairs of points within the Theiler window are counted
+// like all others and subtracted afterwards, which is cheap compared with
+// tracking index ranges of subtrees.
+template <class POINT_SET>
+uint64_t ATRIA<POINT_SET>::count_pairs(const radius_bins &bins,
+                                       const long theiler_window,
+                                       const char *const sampled,
+                                       const int threads,
+                                       uint64_t *const counts) const {
+  const long N = nearneigh_searcher<POINT_SET>::Nused;
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const long nbins = bins.size();
+  const int nthreads = (threads < 1) ? 1 : threads;
+
+  // Deleted points are treated like points that are not sampled.
+  vector<char> live;
+  if (deleted_points > 0) {
+    live.resize(N);
+    for (long i = 0; i < N; i++)
+      live[i] = !deleted[i] && ((sampled == nullptr) || sampled[i]);
+  }
+  pair_count_args args(bins, live.empty() ? sampled : live.data());
+
+  // Children are stored behind their parents, so the subtree sizes can be
+  // accumulated in a single backward pass.
+  args.sizes.assign(nodes.size(), 0);
+  for (long n = (long)nodes.size() - 1; n >= 0; n--) {
+    if (n == 1) // position 1 is unused
+      continue;
+    const tree_node &c = nodes[n];
+    uint64_t size = args.in_sample(c.center);
+    if (c.is_terminal()) {
+      for (long i = 0; i < (long)c.length; i++)
+        size += args.in_sample(permutation_table[c.first + i].index());
+    } else {
+      size += args.sizes[c.first] + args.sizes[c.first + 1];
+    }
+    args.sizes[n] = size;
+  }
+
+  vector<pair_counter> counters(nthreads);
+  for (auto &counter : counters)
+    counter.hist.assign(nbins + 1, 0);
+
+  task_scheduler<node_pair> scheduler(nthreads);
+  scheduler.run(node_pair(0, 0), [&](const int t, const node_pair &task,
+                                     task_scheduler<node_pair> &s) {
+    count_node_pairs(args, task, counters[t], t, s);
+  });
+
+  const uint64_t n_sampled = args.sizes[0];
+  uint64_t pairs = (n_sampled < 2) ? 0 : (n_sampled * (n_sampled - 1)) / 2;
+
+  // Remove the pairs within the Theiler window.
+  if ((theiler_window > 0) && (n_sampled > 1)) {
+    vector<node_index> row_of;
+    if (reordered) {
+      row_of.resize(N);
+      for (long r = 0; r < table_size; r++) {
+        if (permutation_table[r].index() != ATRIA_FREE_ENTRY)
+          row_of[permutation_table[r].index()] = r;
+      }
+    }
+    const double radius = bins.max_radius();
+    vector<uint64_t> excluded(nthreads, 0);
+    parallel_for(N, nthreads, [&](const int t, const long i) {
+      if (!args.in_sample(i))
+        return;
+      const auto query_point = points.point_begin(reordered ? row_of[i] : i);
+      const long last = min(N - 1, i + theiler_window);
+      for (long j = i + 1; j <= last; j++) {
+        if (!args.in_sample(j))
+          continue;
+        const long row = reordered ? row_of[j] : j;
+#ifdef PARTIAL_SEARCH
+        const double d = points.distance(row, query_point, radius);
+#else
+        const double d = points.distance(row, query_point);
+#endif
+        if (d <= radius)
+          counters[t].hist[bins.bin(d)]--;
+        excluded[t]++;
+      }
+    }, 256);
+    for (const uint64_t e : excluded)
+      pairs -= e;
+  }
+
+  int64_t sum = 0;
+  for (long b = 0; b < nbins; b++) {
+    for (const auto &counter : counters)
+      sum += counter.hist[b];
+    counts[b] = (uint64_t)sum;
+  }
+  return pairs;
+}
+
+template <class POINT_SET>
+void ATRIA<POINT_SET>::count_node_pairs(const pair_count_args &args,
+                                        const node_pair &task,
+                                        pair_counter &counter,
+                                        const int thread,
+                                        task_scheduler<node_pair> &scheduler)
+    const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const radius_bins &bins = args.bins;
+  const double radius = bins.max_radius();
+  vector<node_pair> &pending = counter.pairs;
+  vector<int64_t> &hist = counter.hist;
+
+  // Large pairs of subtrees become tasks of their own, so that idle threads
+  // can take them over.
+  auto push = [&](const node_index a, const node_index b) {
+    if ((scheduler.threads() > 1) &&
+        (args.sizes[a] * args.sizes[b] >= ATRIA_TASK_MINPAIRS))
+      scheduler.spawn(thread, node_pair(a, b));
+    else
+      pending.push_back(node_pair(a, b));
+  };
+
+  pending.clear();
+  pending.push_back(task);
+
+  while (!pending.empty()) {
+    const node_pair p = pending.back();
+    pending.pop_back();
+
+    const tree_node *const a = &nodes[p.first];
+    const uint64_t na = args.sizes[p.first];
+
+    if (p.first == p.second) { // pairs within a single subtree
+      if (na < 2)
+        continue;
+      if (bins.same_bin(0, 2 * a->R_max())) {
+        hist[0] += (na * (na - 1)) / 2;
+        continue;
+      }
+      if (a->is_terminal()) {
+        count_leaf_pairs(args, a, counter);
+        continue;
+      }
+      const tree_node *const left = nodes.left_child(a);
+      const tree_node *const right = left + 1;
+      if (args.in_sample(a->center)) {
+        const auto center = points.point_begin(a->center_row);
+        count_point_pairs(args, a->center_row, left,
+                          points.distance(left->center_row, center), counter);
+        count_point_pairs(args, a->center_row, right,
+                          points.distance(right->center_row, center), counter);
+      }
+      push(a->first, a->first);
+      push(a->first + 1, a->first + 1);
+      push(a->first, a->first + 1);
+      continue;
+    }
+
+    const tree_node *const b = &nodes[p.second];
+    const uint64_t nb = args.sizes[p.second];
+    if ((na == 0) || (nb == 0))
+      continue;
+
+    const double d =
+        points.distance(b->center_row, points.point_begin(a->center_row));
+    if (d - a->R_max() - b->R_max() > radius)
+      continue;
+    const long bin = bins.bin(max(0.0, d - a->R_max() - b->R_max()));
+    if (bins.same_bin(bin, d + a->R_max() + b->R_max())) {
+      hist[bin] += na * nb;
+      continue;
+    }
+
+    if (a->is_terminal() && b->is_terminal()) {
+      // The center and every point of a against all points of b.
+      if (args.in_sample(a->center))
+        count_point_pairs(args, a->center_row, b, d, counter);
+      const neighbor *const Section = permutation_table + a->first;
+      for (long i = 0; i < (long)a->length; i++) {
+        const long j = Section[i].index();
+        if (!args.in_sample(j))
+          continue;
+        if (fabs(d - Section[i].dist()) - b->R_max() > radius)
+          continue;
+        const long row = point_row(a, i, j);
+        count_point_pairs(
+            args, row, b,
+            points.distance(b->center_row, points.point_begin(row)), counter);
+      }
+      continue;
+    }
+
+    // Split the node with the larger radius into its center and children.
+    const bool split_a =
+        !a->is_terminal() && (b->is_terminal() || (a->R_max() >= b->R_max()));
+    const tree_node *const s = split_a ? a : b;
+    const node_index other = split_a ? p.second : p.first;
+    if (args.in_sample(s->center))
+      count_point_pairs(args, s->center_row, &nodes[other], d, counter);
+    push(s->first, other);
+    push(s->first + 1, other);
+  }
+}
+
+// Count the pairs of the point at row 'row' of the point set with all points
+// in the subtree of node c, d is the distance between the point and the
+// center of c.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::count_point_pairs(const pair_count_args &args,
+                                         const long row,
+                                         const tree_node *const c,
+                                         const double d,
+                                         pair_counter &counter) const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const radius_bins &bins = args.bins;
+  const double radius = bins.max_radius();
+  const auto query_point = points.point_begin(row);
+  vector<pair<const tree_node *, double> > &pending = counter.nodes;
+  vector<int64_t> &hist = counter.hist;
+
+  pending.clear();
+  pending.push_back(make_pair(c, d));
+
+  while (!pending.empty()) {
+    const tree_node *const n = pending.back().first;
+    const double dn = pending.back().second;
+    pending.pop_back();
+
+    const uint64_t size = args.sizes[n - nodes.data()];
+    if ((size == 0) || (dn - n->R_max() > radius))
+      continue;
+    const long bin = bins.bin(max(0.0, dn - n->R_max()));
+    if (bins.same_bin(bin, dn + n->R_max())) {
+      hist[bin] += size;
+      continue;
+    }
+
+    if ((dn <= radius) && args.in_sample(n->center))
+      hist[bins.bin(dn)]++;
+
+    if (n->is_terminal()) {
+      const neighbor *const Section = permutation_table + n->first;
+      for (long i = 0; i < (long)n->length; i++) {
+        const long j = Section[i].index();
+        if (!args.in_sample(j))
+          continue;
+        if (fabs(dn - Section[i].dist()) > radius)
+          continue;
+#ifdef PARTIAL_SEARCH
+        const double dj =
+            points.distance(point_row(n, i, j), query_point, radius);
+#else
+        const double dj = points.distance(point_row(n, i, j), query_point);
+#endif
+        if (dj <= radius)
+          hist[bins.bin(dj)]++;
+      }
+    } else {
+      const tree_node *const left = nodes.left_child(n);
+      pending.push_back(
+          make_pair(left, points.distance(left->center_row, query_point)));
+      pending.push_back(make_pair(
+          left + 1, points.distance(left[1].center_row, query_point)));
+    }
+  }
+}
+
+// Count the pairs within the subtree of terminal node c.
+template <class POINT_SET>
+void ATRIA<POINT_SET>::count_leaf_pairs(const pair_count_args &args,
+                                        const tree_node *const c,
+                                        pair_counter &counter) const {
+  const POINT_SET &points = nearneigh_searcher<POINT_SET>::points;
+  const radius_bins &bins = args.bins;
+  const double radius = bins.max_radius();
+  const neighbor *const Section = permutation_table + c->first;
+  const bool center = args.in_sample(c->center);
+  vector<int64_t> &hist = counter.hist;
+
+  for (long i = 0; i < (long)c->length; i++) {
+    const long j = Section[i].index();
+    if (!args.in_sample(j))
+      continue;
+    const double s = Section[i].dist();
+    if (center && (s <= radius))
+      hist[bins.bin(s)]++;
+    const auto query_point = points.point_begin(point_row(c, i, j));
+    for (long k = i + 1; k < (long)c->length; k++) {
+      const long l = Section[k].index();
+      if (!args.in_sample(l))
+        continue;
+      if (fabs(s - Section[k].dist()) > radius)
+        continue;
+#ifdef PARTIAL_SEARCH
+      const double d = points.distance(point_row(c, k, l), query_point, radius);
+#else
+      const double d = points.distance(point_row(c, k, l), query_point);
+#endif
+      if (d <= radius)
+        hist[bins.bin(d)]++;
+    }
+  }
+}
+
 #endif // ifdef NEARNEIGH_SEARCH_H
@@ -3,7 +3,9 @@
 
 #include <climits>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
 #include <deque>
@@ -47,23 +49,68 @@ public:
   }
 };
 
+// Table of the k nearest neighbors found so far during a search. For small k
+// the neighbors are kept in an array sorted by distance, insertion moves the
+// farther neighbors one position up. For larger k a bounded max-heap is used,
+// the farthest neighbor is replaced when a closer one is found. The storage
+// grows to the largest k seen and is reused by all following searches.
 class SortedNeighborTable {
 protected:
   long NNR; // number of neighbors to be searched
+  long n;   // number of neighbors in the table
 
-  priority_queue<neighbor, vector<neighbor>, neighborCompare> pq;
+  vector<neighbor> items;
   double hd; // cache highest distance
 
+  // Up to this number of neighbors, a sorted array is used instead of a heap.
+  static const long SORTED_MAX_NNR = 32;
+
+  void replace_top(const neighbor &x);
+
 public:
-  SortedNeighborTable() : NNR(1), hd(DBL_MAX){};
-  SortedNeighborTable(const long nnr) : NNR(nnr), hd(DBL_MAX){};
+  SortedNeighborTable() : NNR(1), n(0), hd(DBL_MAX){};
+  SortedNeighborTable(const long nnr) : NNR(nnr), n(0), hd(DBL_MAX){};
   ~SortedNeighborTable(){};
 
   inline double highdist() const { return hd; };
-  void insert(const neighbor &x);
+
+  inline void insert(const neighbor &x) {
+    if (NNR <= SORTED_MAX_NNR) {
+      long pos;
+      if (n < NNR) {
+        if (n == (long)items.size())
+          items.push_back(x);
+        pos = n++;
+      } else if (x.dist() < items[n - 1].dist()) {
+        pos = n - 1; // the farthest neighbor drops out
+      } else {
+        return;
+      }
+      for (; (pos > 0) && (items[pos - 1].dist() > x.dist()); pos--)
+        items[pos] = items[pos - 1];
+      items[pos] = x;
+      if (n == NNR)
+        hd = items[n - 1].dist();
+    } else {
+      if (n < NNR) {
+        if (n == (long)items.size())
+          items.push_back(x);
+        else
+          items[n] = x;
+        n++;
+        push_heap(items.begin(), items.begin() + n, neighborCompare());
+        if (n == NNR)
+          hd = items[0].dist();
+      } else if (x.dist() < items[0].dist()) {
+        replace_top(x);
+        hd = items[0].dist();
+      }
+    }
+  }
 
   inline void init_search(const long nnr) {
     NNR = nnr;
+    n = 0;
     hd = DBL_MAX;
   }
   long finish_search(vector<neighbor> &v);
@@ -80,6 +127,7 @@ public:
                // the point set
   double Rmax; // if Rmax <= 0 we have a terminal node (so we have to use
                // fabs(Rmax) to get the true value for Rmax)
+  double Rmedian; // median distance from the center to the cluster's points
 
   union {
     cluster *left; // used in case of a non-terminal node
@@ -96,12 +144,13 @@ public:
   static long OLD_BLOCK_SIZE;
   static long BLOCK_SIZE;
 
-  cluster() : center(0), Rmax(DBL_MAX), start(0), length(0){};
-  cluster(const long c) : center(c), Rmax(DBL_MAX), start(0), length(0){};
+  cluster() : center(0), Rmax(DBL_MAX), Rmedian(0), start(0), length(0){};
+  cluster(const long c)
+      : center(c), Rmax(DBL_MAX), Rmedian(0), start(0), length(0){};
   cluster(const long s, const long l)
-      : center(0), Rmax(DBL_MAX), start(s), length(l){};
+      : center(0), Rmax(DBL_MAX), Rmedian(0), start(s), length(l){};
   cluster(const long s, const long l, const long c)
-      : center(c), Rmax(DBL_MAX), start(s), length(l){};
+      : center(c), Rmax(DBL_MAX), Rmedian(0), start(s), length(l){};
 
   ~cluster(){};
 
@@ -114,11 +163,110 @@ public:
 #endif
 };
 
-// During k-nearest neighbor search, clusters are treated as searchitems
+// Nodes of a finished search tree are addressed by 32 bit indices.
+typedef uint32_t node_index;
+
+// Compact node of a finished search tree. While a tree is under construction,
+// it is made of cluster objects, afterwards it is flattened into one
+// contiguous array of tree_nodes (see class node_array) in breadth first
+// order. The two children of an internal node are stored next to each other,
+// the left child at an even position, so both fit into one cache line.
+class tree_node {
+public:
+  double Rmax;       // if Rmax <= 0 we have a terminal node (so we have to use
+                     // fabs(Rmax) to get the true value for Rmax)
+  node_index center; // index of center point for this node (points directly
+                     // into the point set)
+  node_index first;  // terminal node : start of the node's points in the
+                     // permutation table, internal node : array position of
+                     // the left child, the right child follows at first + 1
+  node_index length; // terminal node : number of points
+  node_index center_row; // row of the center point in the point set, differs
+                         // from center if the points were reordered
+  double Rmedian;    // median distance from the center to the node's points,
+                     // used to prune nodes in approximate searches
+
+  inline int is_terminal() const { return (Rmax <= 0); };
+  inline double R_max() const { return fabs(Rmax); };
+};
+
+// Contiguous, cache line aligned storage for all nodes of a search tree. The
+// whole tree is released with a single free.
+class node_array {
+private:
+  void *memory;
+  tree_node *nodes;
+  node_index n;
+
+public:
+  node_array() : memory(nullptr), nodes(nullptr), n(0){};
+  node_array(const node_array &) = delete;
+  node_array &operator=(const node_array &) = delete;
+  ~node_array() { free(memory); };
+
+  // Allocate (uninitialized) storage for count nodes, returns false when
+  // out of memory.
+  bool allocate(const node_index count) {
+    free(memory);
+    n = 0;
+    nodes = nullptr;
+    memory = malloc(count * sizeof(tree_node) + 63);
+    if (memory == nullptr)
+      return false;
+    nodes = (tree_node *)(((uintptr_t)memory + 63) & ~((uintptr_t)63));
+    n = count;
+    return true;
+  }
+
+  // Change the number of nodes to count, keeping the first min(count,
+  // size()) nodes. Returns false when out of memory, the nodes are then
+  // unchanged.
+  bool resize(const node_index count) {
+    void *m = malloc(count * sizeof(tree_node) + 63);
+    if (m == nullptr)
+      return false;
+    tree_node *p = (tree_node *)(((uintptr_t)m + 63) & ~((uintptr_t)63));
+    if (nodes != nullptr)
+      memcpy(p, nodes, min(count, n) * sizeof(tree_node));
+    free(memory);
+    memory = m;
+    nodes = p;
+    n = count;
+    return true;
+  }
+
+  void swap(node_array &other) {
+    std::swap(memory, other.memory);
+    std::swap(nodes, other.nodes);
+    std::swap(n, other.n);
+  }
+
+  // Use count nodes in external, read-only memory (e.g. a memory mapped
+  // file), which is not released by this object.
+  void attach(const tree_node *external, const node_index count) {
+    free(memory);
+    memory = nullptr;
+    nodes = const_cast<tree_node *>(external);
+    n = count;
+  }
+
+  inline node_index size() const { return n; };
+  inline tree_node &operator[](const node_index i) { return nodes[i]; };
+  inline const tree_node &operator[](const node_index i) const {
+    return nodes[i];
+  };
+  inline const tree_node *data() const { return nodes; };
+  // The left child of an internal node, the right child is left_child(c) + 1.
+  inline const tree_node *left_child(const tree_node *c) const {
+    return nodes + c->first;
+  };
+};
+
+// During k-nearest neighbor search, tree nodes are treated as searchitems
 // These searchitems are inserted into a priority queue
 class searchitem {
 protected:
-  const cluster *c; // pointer to cluster object
+  const tree_node *c; // pointer to tree node
   double d;         // distance from query point to the cluster's center
   double dbrother;  // distance from query point to brother cluster's center
 
@@ -129,17 +277,17 @@ protected:
 public:
   searchitem(){};
 
-  inline searchitem(const cluster *C, const double D)
+  inline searchitem(const tree_node *C, const double D)
       : c(C), d(D), dbrother(DBL_MAX), dmin(D - C->R_max()),
         dmax(D + C->R_max()){};
 
-  inline searchitem(const cluster *C, const double D, const double Dbrother,
+  inline searchitem(const tree_node *C, const double D, const double Dbrother,
                     const searchitem &parent)
       : c(C), d(D), dbrother(Dbrother),
         dmin(max(0.0, max(D - C->R_max(), parent.dmin))),
         dmax(min(parent.dmax, D + C->R_max())){};
 
-  inline const cluster *clusterp() const { return c; };
+  inline const tree_node *clusterp() const { return c; };
   inline double dist() const { return d; };
   inline double dist_brother() const { return dbrother; };
 
@@ -161,7 +309,168 @@ public:
   };
 };
 
+// Assigns distances to the bins of an ascending vector of radii. bin(d) is the
+// number of radii that are smaller than d, so a distance d <= radii[b] falls
+// into bin b or a lower one. For few radii all of them are compared without
+// branches, which the compiler can vectorize, otherwise a binary search is
+// used.
+class radius_bins {
+protected:
+  const double *radii;
+  long n;
+
+  static const long LINEAR_MAX_BINS = 64;
+
+public:
+  radius_bins(const double *r, const long nr) : radii(r), n(nr){};
+
+  inline long size() const { return n; };
+  inline double max_radius() const { return radii[n - 1]; };
+
+  inline long bin(const double d) const {
+    if (n > LINEAR_MAX_BINS)
+      return lower_bound(radii, radii + n, d) - radii;
+    long b = 0;
+    for (long i = 0; i < n; i++)
+      b += (d > radii[i]);
+    return b;
+  }
+
+  // True if all distances between lower and upper fall into bin b, given
+  // that b = bin(lower) and lower <= upper.
+  inline bool same_bin(const long b, const double upper) const {
+    return (b == n) || (upper <= radii[b]);
+  }
+};
+
 typedef cluster *cluster_pointer;
 typedef vector<cluster_pointer> cluster_pointer_vector;
 
+// Limits of approximate k nearest neighbor searches, the default limits give
+// exact searches. With epsilon > 0, the distances of the neighbors found
+// may exceed the true ones by the factor 1 + epsilon. With median_pruning, a
+// tree node is also skipped if the current k-th neighbor is closer to the
+// query point than the ball around the node's center that holds half of its
+// points. The search stops after max_distances distance calculations or
+// max_terminal_nodes terminal nodes searched, 0 means no limit, and returns
+// the best neighbors found so far. With defeatist, the spill tree is searched
+// instead of the search tree, see ATRIA::build_spill_tree(), and the other
+// limits are ignored.
+class search_limits {
+public:
+  double epsilon;
+  bool median_pruning;
+  unsigned long max_distances;
+  unsigned long max_terminal_nodes;
+  bool defeatist;
+
+  search_limits(const double eps = 0)
+      : epsilon(eps), median_pruning(false), max_distances(0),
+        max_terminal_nodes(0), defeatist(false){};
+
+  // True if the limits ask for the exact k nearest neighbors.
+  bool exact() const {
+    return (epsilon == 0) && !median_pruning && (max_distances == 0) &&
+           (max_terminal_nodes == 0) && !defeatist;
+  }
+};
+
+// Number of bins of the histograms of search_counters. Bin 0 counts queries
+// with a count of 0, bin b > 0 the queries with counts from 2^(b-1) to
+// 2^b - 1, the last bin also all larger counts.
+#define SEARCH_HISTOGRAM_BINS 32
+
+// What the last k nearest neighbor search of a context did: the number of
+// distances computed, of terminal nodes searched and of search items pushed
+// on the priority queue, and the final pruning radius, the distance of the
+// k-th neighbor (DBL_MAX if less than k neighbors were found).
+struct query_statistics {
+  unsigned long distances;
+  unsigned long terminal_nodes;
+  unsigned long queue_pushes;
+  double radius;
+};
+
+// Statistics counters of all searches done with a context, and histograms of
+// the number of distances computed and of terminal nodes searched per k
+// nearest neighbor search. They are cheap enough to be always collected.
+class search_counters {
+public:
+  unsigned long terminal_cluster_searched;
+  unsigned long points_searched;
+  unsigned long number_of_queries;
+  unsigned long queue_pushes;
+  unsigned long distance_histogram[SEARCH_HISTOGRAM_BINS];
+  unsigned long terminal_node_histogram[SEARCH_HISTOGRAM_BINS];
+
+  search_counters() { reset_statistics(); };
+
+  void reset_statistics() {
+    terminal_cluster_searched = 0;
+    points_searched = 0;
+    number_of_queries = 0;
+    queue_pushes = 0;
+    std::fill(distance_histogram, distance_histogram + SEARCH_HISTOGRAM_BINS,
+              0UL);
+    std::fill(terminal_node_histogram,
+              terminal_node_histogram + SEARCH_HISTOGRAM_BINS, 0UL);
+  }
+
+  // Add the statistics counters of another context to this one.
+  void merge_statistics(const search_counters &other) {
+    terminal_cluster_searched += other.terminal_cluster_searched;
+    points_searched += other.points_searched;
+    number_of_queries += other.number_of_queries;
+    queue_pushes += other.queue_pushes;
+    for (int b = 0; b < SEARCH_HISTOGRAM_BINS; b++) {
+      distance_histogram[b] += other.distance_histogram[b];
+      terminal_node_histogram[b] += other.terminal_node_histogram[b];
+    }
+  }
+
+  // The bin of the histograms for a count n.
+  static inline int histogram_bin(unsigned long n) {
+    int b = 0;
+    while ((n > 0) && (b < SEARCH_HISTOGRAM_BINS - 1)) {
+      n >>= 1;
+      b++;
+    }
+    return b;
+  }
+};
+
+// The mutable state of a search: the priority queue and stack used for tree
+// traversal, the table of neighbors found so far and the statistics counters.
+// Keeping this apart from the searcher allows several threads to query the
+// same (read-only) search tree concurrently, each one with its own context.
+class search_context : public search_counters {
+public:
+  priority_queue<searchitem, vector<searchitem>, searchitemCompare>
+      search_queue;
+  stack<searchitem, vector<searchitem> > SearchStack; // used for range searches/counts
+  SortedNeighborTable table;
+  vector<SortedNeighborTable> tables; // one per query of brute force searches
+
+  query_statistics last_query;
+
+  // Start the statistics of a k nearest neighbor search.
+  void start_query() {
+    number_of_queries++;
+    last_query.distances = points_searched;
+    last_query.terminal_nodes = terminal_cluster_searched;
+    last_query.queue_pushes = queue_pushes;
+  }
+
+  // Finish the statistics of the k nearest neighbor search started last.
+  void finish_query(const double radius) {
+    last_query.distances = points_searched - last_query.distances;
+    last_query.terminal_nodes =
+        terminal_cluster_searched - last_query.terminal_nodes;
+    last_query.queue_pushes = queue_pushes - last_query.queue_pushes;
+    last_query.radius = radius;
+    distance_histogram[histogram_bin(last_query.distances)]++;
+    terminal_node_histogram[histogram_bin(last_query.terminal_nodes)]++;
+  }
+};
+
 #endif
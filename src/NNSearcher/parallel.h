@@ -0,0 +1,150 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A minimal parallel loop on top of std::thread. The iterations 0..n-1 are
+// handed out in chunks of 'chunk' consecutive iterations to 'threads' worker
+// threads, so that expensive and cheap iterations even out between workers.
+// fn is called as fn(thread, i), where thread = 0..threads-1 identifies the
+// calling worker, e.g. to select per-thread data like a search_context.
+// With threads <= 1 (or a single chunk of work) the loop runs in the calling
+// thread. An exception thrown by fn is rethrown after all workers finished.
+template <class Function>
+void parallel_for(const long n, const int threads, Function fn,
+                  const long chunk = 16) {
+  if ((threads <= 1) || (n <= chunk)) {
+    for (long i = 0; i < n; i++)
+      fn(0, i);
+    return;
+  }
+
+  std::atomic<long> next(0);
+  std::exception_ptr error = nullptr;
+  std::atomic<bool> failed(false);
+
+  auto worker = [&](const int thread) {
+    try {
+      while (!failed) {
+        const long begin = next.fetch_add(chunk);
+        if (begin >= n)
+          break;
+        const long end = (begin + chunk < n) ? begin + chunk : n;
+        for (long i = begin; i < end; i++)
+          fn(thread, i);
+      }
+    } catch (...) {
+      if (!failed.exchange(true))
+        error = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  pool.reserve(threads - 1);
+  for (int t = 1; t < threads; t++)
+    pool.push_back(std::thread(worker, t));
+  worker(0);
+  for (auto &t : pool)
+    t.join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// Work-stealing execution of a dynamically growing set of tasks, e.g. the
+// subtrees of a search tree under construction. Every worker thread owns a
+// deque of tasks. It takes the most recently spawned task from the back of
+// its own deque (depth first, good locality) and, when that is empty, steals
+// the oldest task from the front of another worker's deque (which usually is
+// the largest piece of work left). run() returns once all tasks, including
+// the ones spawned while running, are finished. fn is called as
+// fn(thread, task, scheduler) and may call scheduler.spawn(thread, t).
+template <class TASK> class task_scheduler {
+private:
+  struct worker_queue {
+    std::mutex lock;
+    std::deque<TASK> tasks;
+  };
+  const int nthreads;
+  std::vector<worker_queue> queues;
+  std::atomic<long> pending; // spawned, but not yet finished tasks
+  std::atomic<bool> failed;
+
+  bool next(const int thread, TASK &task) {
+    {
+      worker_queue &own = queues[thread];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (!own.tasks.empty()) {
+        task = own.tasks.back();
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (int i = 1; i < nthreads; i++) {
+      worker_queue &victim = queues[(thread + i) % nthreads];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  task_scheduler(const int threads)
+      : nthreads((threads < 1) ? 1 : threads), queues(nthreads), pending(0),
+        failed(false){};
+
+  inline int threads() const { return nthreads; }
+
+  void spawn(const int thread, const TASK &task) {
+    pending++;
+    worker_queue &own = queues[thread];
+    std::lock_guard<std::mutex> guard(own.lock);
+    own.tasks.push_back(task);
+  }
+
+  template <class Function> void run(const TASK &initial, Function fn) {
+    std::exception_ptr error = nullptr;
+
+    auto worker = [&](const int thread) {
+      try {
+        TASK task;
+        while (!failed) {
+          if (next(thread, task)) {
+            fn(thread, task, *this);
+            pending--;
+          } else if (pending == 0) {
+            break;
+          } else {
+            std::this_thread::yield();
+          }
+        }
+      } catch (...) {
+        if (!failed.exchange(true))
+          error = std::current_exception();
+      }
+    };
+
+    spawn(0, initial);
+    std::vector<std::thread> pool;
+    pool.reserve(nthreads - 1);
+    for (int t = 1; t < nthreads; t++)
+      pool.push_back(std::thread(worker, t));
+    worker(0);
+    for (auto &t : pool)
+      t.join();
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+#endif
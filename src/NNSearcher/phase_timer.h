@@ -0,0 +1,265 @@
+#ifndef PHASE_TIMER_H
+#define PHASE_TIMER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Timing of the phases of tree construction and searches. The phases are
+// marked in the code with the macros PROFILE_SCOPE(phase), which times the
+// rest of the enclosing block, and PROFILE_START(name) ... PROFILE_STOP(name,
+// phase), which time the statements in between. Unless ATRIA_PROFILE is
+// defined (see src/Makevars), the macros expand to nothing and the timing
+// costs nothing at all.
+//
+// Each thread adds its timings to a slot of its own, so threads never wait
+// for each other. Slots of finished threads are reused by new ones. If a
+// trace is recorded, every timed phase is also stored as an event, which can
+// be written as a Chrome trace file (see chrome://tracing or Perfetto).
+//
+// On x86 the time stamp counter is used as the clock, as it is read in a few
+// cycles, elsewhere std::chrono::steady_clock.
+
+#if (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define ATRIA_PROFILE_TSC 1
+#else
+#define ATRIA_PROFILE_TSC 0
+#endif
+
+enum profile_phase {
+  phase_build_root,      // distances of all points to the root center
+  phase_build_centers,   // choice of the centers of child clusters
+  phase_build_assign,    // assignment of points to the child centers
+  phase_build_nodes,     // allocation of clusters and of the node array
+  phase_search_queue,    // priority queue and stack operations of searches
+  phase_search_centers,  // distances to the centers of internal nodes
+  phase_search_leaves,   // scans of terminal nodes
+  phase_search_results,  // conversion of the neighbor table into results
+  phase_convert_results, // copying results to R objects
+  PROFILE_PHASES
+};
+
+inline const char *profile_phase_name(const int phase) {
+  static const char *const names[PROFILE_PHASES] = {
+      "build_root",     "build_centers",  "build_assign",
+      "build_nodes",    "search_queue",   "search_centers",
+      "search_leaves",  "search_results", "convert_results"};
+  return names[phase];
+}
+
+// Maximum number of trace events stored per thread, later ones are dropped.
+#define PROFILE_MAX_EVENTS (1L << 20)
+
+inline uint64_t profile_ticks() {
+#if ATRIA_PROFILE_TSC
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Clock ticks per second, the time stamp counter is calibrated against
+// steady_clock once.
+inline double profile_ticks_per_second() {
+#if ATRIA_PROFILE_TSC
+  static const double rate = []() {
+    const auto t0 = std::chrono::steady_clock::now();
+    const uint64_t c0 = profile_ticks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const auto t1 = std::chrono::steady_clock::now();
+    const uint64_t c1 = profile_ticks();
+    return (c1 - c0) / std::chrono::duration<double>(t1 - t0).count();
+  }();
+  return rate;
+#else
+  return 1e9;
+#endif
+}
+
+struct profile_event {
+  int phase;
+  uint64_t start;
+  uint64_t duration;
+};
+
+// The timings of one thread. Only the owning thread writes to the totals,
+// relaxed atomics let others read them while it is running.
+class profile_slot {
+public:
+  std::atomic<uint64_t> ticks[PROFILE_PHASES];
+  std::atomic<uint64_t> calls[PROFILE_PHASES];
+  std::mutex events_lock;
+  std::vector<profile_event> events;
+
+  profile_slot() { reset(); };
+
+  void reset() {
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+      ticks[p].store(0, std::memory_order_relaxed);
+      calls[p].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+class profile_registry {
+private:
+  std::mutex lock;
+  std::vector<std::unique_ptr<profile_slot> > slots;
+  std::vector<bool> used;
+
+public:
+  std::atomic<bool> tracing;
+  std::atomic<uint64_t> trace_origin;
+
+  profile_registry() : tracing(false), trace_origin(0){};
+
+  static profile_registry &instance() {
+    static profile_registry registry;
+    return registry;
+  }
+
+  long acquire() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t s = 0; s < used.size(); s++) {
+      if (!used[s]) {
+        used[s] = true;
+        return s;
+      }
+    }
+    slots.push_back(std::unique_ptr<profile_slot>(new profile_slot()));
+    used.push_back(true);
+    return slots.size() - 1;
+  }
+
+  void release(const long s) {
+    std::lock_guard<std::mutex> guard(lock);
+    used[s] = false;
+  }
+
+  profile_slot *slot(const long s) {
+    std::lock_guard<std::mutex> guard(lock);
+    return slots[s].get();
+  }
+
+  long number_of_slots() {
+    std::lock_guard<std::mutex> guard(lock);
+    return slots.size();
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &s : slots)
+      s->reset();
+  }
+
+  // Start recording trace events, events recorded before are discarded.
+  void start_trace() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &s : slots) {
+      std::lock_guard<std::mutex> events_guard(s->events_lock);
+      s->events.clear();
+    }
+    trace_origin = profile_ticks();
+    tracing = true;
+  }
+
+  // Stop recording and write the events in the Chrome trace event format,
+  // with one track per slot. Returns the number of events written, or -1 if
+  // the file can not be written.
+  long write_trace(const std::string &path) {
+    tracing = false;
+    std::ofstream out(path.c_str());
+    if (!out)
+      return -1;
+    const double us_per_tick = 1e6 / profile_ticks_per_second();
+    const uint64_t origin = trace_origin;
+    long written = 0;
+    out << "{\"traceEvents\":[";
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t s = 0; s < slots.size(); s++) {
+      std::lock_guard<std::mutex> events_guard(slots[s]->events_lock);
+      for (const auto &e : slots[s]->events) {
+        out << (written > 0 ? ",\n" : "\n") << "{\"name\":\""
+            << profile_phase_name(e.phase) << "\",\"ph\":\"X\",\"ts\":"
+            << (double)(int64_t)(e.start - origin) * us_per_tick
+            << ",\"dur\":" << e.duration * us_per_tick
+            << ",\"pid\":1,\"tid\":" << s << "}";
+        written++;
+      }
+      slots[s]->events.clear();
+    }
+    out << "\n]}\n";
+    return out ? written : -1;
+  }
+};
+
+// The slot of the calling thread, it is returned to the registry when the
+// thread ends.
+class profile_slot_owner {
+public:
+  const long index;
+  profile_slot *const slot;
+
+  profile_slot_owner()
+      : index(profile_registry::instance().acquire()),
+        slot(profile_registry::instance().slot(index)){};
+  ~profile_slot_owner() { profile_registry::instance().release(index); };
+};
+
+inline profile_slot &profile_thread_slot() {
+  static thread_local profile_slot_owner owner;
+  return *owner.slot;
+}
+
+// Add the time since start to a phase of the calling thread.
+inline void profile_record(const int phase, const uint64_t start) {
+  const uint64_t duration = profile_ticks() - start;
+  profile_slot &s = profile_thread_slot();
+  s.ticks[phase].store(s.ticks[phase].load(std::memory_order_relaxed) +
+                           duration,
+                       std::memory_order_relaxed);
+  s.calls[phase].store(s.calls[phase].load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+  if (profile_registry::instance().tracing.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> guard(s.events_lock);
+    if ((long)s.events.size() < PROFILE_MAX_EVENTS) {
+      profile_event e = {phase, start, duration};
+      s.events.push_back(e);
+    }
+  }
+}
+
+class profile_scope {
+private:
+  const int phase;
+  const uint64_t start;
+
+public:
+  explicit profile_scope(const int p) : phase(p), start(profile_ticks()){};
+  ~profile_scope() { profile_record(phase, start); };
+};
+
+#ifdef ATRIA_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(phase)                                                  \
+  const profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(phase)
+#define PROFILE_START(name) const uint64_t name = profile_ticks()
+#define PROFILE_STOP(name, phase) profile_record(phase, name)
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_START(name)
+#define PROFILE_STOP(name, phase)
+#endif
+
+#endif
@@ -3,6 +3,15 @@
 
 #include <Rcpp.h>
 #include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "metric.h"
 
 // This file gives an example class for the implementation of a point_set which
 // can be used by the nearest neighbor algorithm This particular implementation
@@ -10,12 +19,15 @@
 // matrix. The coordinates of one point is given by one row of this matrix.
 template <class METRIC> class point_set_base {
 protected:
-  const long N; // number of points
+  long N; // number of points, point sets may grow, see append_points
   point_set_base<METRIC>(const long n) : N(n){};
 public:
   ~point_set_base<METRIC>(){};
   inline long size() const { return N; };
   typedef METRIC Metric;
+  // True if the point set provides distance_squared(), which returns squared
+  // distances for metrics with has_squared_distance.
+  static const bool squared_distances = false;
 };
 
 // Define a row major point_set, i.e. data belonging to the same point
@@ -31,19 +43,28 @@ public:
 // point from the data set and an externally given point. Class point_set is
 // parametrized by the METRIC that is used top compute distances. METRIC must be
 // a class having an operator(). For possible implementations of a METRIC, see
-// file "metric.h" in this directory.
-template <class METRIC>
+// file "metric.h" in this directory. The coordinates are stored with type T,
+// float by default, which halves the memory consumption at the cost of
+// precision. Use double to keep the precision of the R matrix.
+// Alternatively, the points can be read from external memory, e.g. a memory
+// mapped index file, which is kept alive by a shared pointer to its owner.
+template <class METRIC, class T = float>
 class rm_point_set : public point_set_base<METRIC> {
 
 protected:
   const long D; // dimension
-  float* matrix_ptr; // points are stored row-major in a C style array
+  T* matrix_ptr; // points are stored row-major in a C style array
+  long capacity; // number of points that fit into matrix_ptr
+  std::shared_ptr<const void> owner; // set if matrix_ptr is external memory
   const METRIC Distance; // a function object that calculates distances
 public:
+  typedef T value_type;
+
   rm_point_set() = delete;
   rm_point_set(const rm_point_set& from) = delete;
-  rm_point_set(const Rcpp::NumericMatrix& m)
-    : point_set_base<METRIC>(m.nrow()), D(m.ncol()), matrix_ptr(new float[m.nrow() * m.ncol()]), Distance(){
+  rm_point_set(const Rcpp::NumericMatrix& m, const METRIC& metric = METRIC())
+    : point_set_base<METRIC>(m.nrow()), D(m.ncol()), matrix_ptr(new T[m.nrow() * m.ncol()]),
+      capacity(m.nrow()), Distance(metric){
       for (long n=0; n < point_set_base<METRIC>::N; n++) {
         const auto v = m(n, Rcpp::_);
         std::copy(v.begin(), v.end(), matrix_ptr + n*D);
@@ -52,9 +73,16 @@ public:
       Rcpp::Rcout << "Point set constructor called." << std::endl;
 #endif
     };
+  // Read-only points of external memory, the points can not be reordered.
+  rm_point_set(const T* data, const long n, const long d,
+               const std::shared_ptr<const void>& o,
+               const METRIC& metric = METRIC())
+    : point_set_base<METRIC>(n), D(d), matrix_ptr(const_cast<T*>(data)),
+      capacity(n), owner(o), Distance(metric){};
   // Move constructor here.
   rm_point_set(rm_point_set&& from)
-    : point_set_base<METRIC>(from.N), D(from.D), Distance(){
+    : point_set_base<METRIC>(from.N), D(from.D), capacity(from.capacity),
+      owner(std::move(from.owner)), Distance(from.Distance){
       matrix_ptr = from.matrix_ptr;
       from.matrix_ptr = nullptr;
 #ifdef DEBUG
@@ -69,11 +97,12 @@ public:
       Rcpp::Rcout << "Point set destructor called." << std::endl;
     }
 #endif
-    delete[] matrix_ptr;
+    if (!owner)
+      delete[] matrix_ptr;
   };
   inline long dimension() const { return D; };
 
-  typedef const float* row_iterator; // pointer that iterates over the elements
+  typedef const T* row_iterator; // pointer that iterates over the elements
   // of one point in the rm_point_set (points are row vectors)
 
   row_iterator point_begin(const long n) const { return matrix_ptr + n*D; }
@@ -81,6 +110,84 @@ public:
     return matrix_ptr + (n + 1) * D; // past-the-end
   }
 
+  // Hint the processor to load the first elements of point n into the cache.
+  inline void prefetch(const long n) const {
+#if defined(__GNUC__)
+    __builtin_prefetch(matrix_ptr + n * D);
+#endif
+  }
+
+  // Change the number of points to n. The storage grows geometrically, so
+  // that adding a few points at a time costs amortized O(D) per point, and
+  // is kept when the point set shrinks. New points are not initialized.
+  // Returns false for points in external memory.
+  bool resize_points(const long n) {
+    if (owner)
+      return false;
+    const long N = point_set_base<METRIC>::N;
+    if (n > capacity) {
+      const long c = std::max(n, 2 * capacity);
+      T* p = new T[c * D];
+      std::copy(matrix_ptr, matrix_ptr + N * D, p);
+      delete[] matrix_ptr;
+      matrix_ptr = p;
+      capacity = c;
+    }
+    point_set_base<METRIC>::N = n;
+    return true;
+  }
+
+  // Append the n rows of the column-major n by D matrix x as new points.
+  // Returns false for points in external memory.
+  bool append_points(const double* x, const long n) {
+    const long N = point_set_base<METRIC>::N;
+    if (!resize_points(N + n))
+      return false;
+    for (long i = 0; i < n; i++) {
+      for (long d = 0; d < D; d++)
+        matrix_ptr[(N + i) * D + d] = x[i + d * n];
+    }
+    return true;
+  }
+
+  // Overwrite point dest with point src, or exchange the two points. Only
+  // for points in owned memory.
+  void copy_point(const long src, const long dest) {
+    std::copy(point_begin(src), point_end(src), matrix_ptr + dest * D);
+  }
+  void swap_points(const long a, const long b) {
+    std::swap_ranges(matrix_ptr + a * D, matrix_ptr + (a + 1) * D,
+                     matrix_ptr + b * D);
+  }
+
+  // Reorder the first n points in place, such that afterwards point r is the
+  // point that was formerly stored at index order(r). order must be a
+  // permutation of 0..n-1. The cycles of the permutation are followed with a
+  // buffer of a single point, so no second copy of the data is needed.
+  // Returns false for points in external memory, else true.
+  template <class Order> bool permute_points(const long n, Order order) {
+    if (owner)
+      return false;
+    std::vector<bool> done(n, false);
+    std::vector<T> buffer(D);
+    for (long r = 0; r < n; r++) {
+      if (done[r])
+        continue;
+      std::copy(point_begin(r), point_end(r), buffer.begin());
+      long dest = r;
+      while (true) {
+        done[dest] = true;
+        const long src = order(dest);
+        if (src == r)
+          break;
+        std::copy(point_begin(src), point_end(src), matrix_ptr + dest * D);
+        dest = src;
+      }
+      std::copy(buffer.begin(), buffer.end(), matrix_ptr + dest * D);
+    }
+    return true;
+  }
+
   template <class ForwardIterator>
   inline double distance(const long index1, ForwardIterator vec2) const {
     return Distance(point_begin(index1), point_end(index1), vec2);
@@ -94,6 +201,438 @@ public:
     return Distance(point_begin(index1), point_end(index1),
                     point_begin(index2));
   }
+
+  static const bool squared_distances = has_squared_distance<METRIC>::value;
+  template <class ForwardIterator>
+  inline double distance_squared(const long index1,
+                                 ForwardIterator vec2) const {
+    return Distance.squared(point_begin(index1), point_end(index1), vec2);
+  }
+  template <class ForwardIterator>
+  inline double distance_squared(const long index1, ForwardIterator vec2,
+                                 const double thresh2) const {
+    return Distance.squared(point_begin(index1), point_end(index1), vec2,
+                            thresh2);
+  }
+};
+
+// Iterator over the coordinates of one point of a column-major matrix, i.e.
+// over the elements of one matrix row, which are 'stride' elements apart.
+template <class T> class strided_iterator {
+protected:
+  const T *ptr;
+  long stride;
+
+public:
+  strided_iterator(const T *p, const long s) : ptr(p), stride(s){};
+  inline const T &operator*() const { return *ptr; };
+  inline strided_iterator &operator++() {
+    ptr += stride;
+    return *this;
+  };
+  inline bool operator==(const strided_iterator &x) const {
+    return ptr == x.ptr;
+  };
+  inline bool operator!=(const strided_iterator &x) const {
+    return ptr != x.ptr;
+  };
+};
+
+// Define a column-major point_set that works directly on the memory of the
+// input Rcpp::NumericMatrix, without copying the data. The object keeps a
+// reference to the R matrix, which protects it from the garbage collector as
+// long as the point set exists. Since the coordinates of one point are N
+// elements apart, distance computations are slower than for rm_point_set and
+// can not use the vectorized distance kernels. Use this class when the data
+// set is too large to be held in memory twice. The points can not be
+// reordered, as this would modify the R object.
+template <class METRIC>
+class cm_point_set : public point_set_base<METRIC> {
+
+protected:
+  const long D; // dimension
+  Rcpp::NumericMatrix matrix; // keeps the R object alive
+  const double* matrix_ptr; // points are stored column-major
+  const METRIC Distance; // a function object that calculates distances
+public:
+  typedef double value_type;
+
+  cm_point_set() = delete;
+  cm_point_set(const cm_point_set& from) = delete;
+  cm_point_set(const Rcpp::NumericMatrix& m, const METRIC& metric = METRIC())
+    : point_set_base<METRIC>(m.nrow()), D(m.ncol()), matrix(m),
+      matrix_ptr(m.begin()), Distance(metric){};
+  cm_point_set(cm_point_set&& from)
+    : point_set_base<METRIC>(from.N), D(from.D), matrix(from.matrix),
+      matrix_ptr(from.matrix_ptr), Distance(from.Distance){};
+  ~cm_point_set(){};
+  inline long dimension() const { return D; };
+
+  typedef strided_iterator<double> row_iterator; // iterates over the elements
+  // of one point in the cm_point_set (points are row vectors)
+
+  row_iterator point_begin(const long n) const {
+    return row_iterator(matrix_ptr + n, point_set_base<METRIC>::N);
+  }
+  row_iterator point_end(const long n) const {
+    return row_iterator(matrix_ptr + n + D * point_set_base<METRIC>::N,
+                        point_set_base<METRIC>::N); // past-the-end
+  }
+
+  inline void prefetch(const long n) const {
+#if defined(__GNUC__)
+    __builtin_prefetch(matrix_ptr + n);
+#endif
+  }
+
+  // The R matrix is not modified, returns false.
+  template <class Order> bool permute_points(const long, Order) {
+    return false;
+  }
+  bool append_points(const double*, const long) { return false; }
+  bool resize_points(const long) { return false; }
+  void copy_point(const long, const long) {}
+  void swap_points(const long, const long) {}
+
+  template <class ForwardIterator>
+  inline double distance(const long index1, ForwardIterator vec2) const {
+    return Distance(point_begin(index1), point_end(index1), vec2);
+  }
+  template <class ForwardIterator>
+  inline double distance(const long index1, ForwardIterator vec2,
+                         const double thresh) const {
+    return Distance(point_begin(index1), point_end(index1), vec2, thresh);
+  }
+  inline double distance(const long index1, const long index2) const {
+    return Distance(point_begin(index1), point_end(index1),
+                    point_begin(index2));
+  }
+
+  static const bool squared_distances = has_squared_distance<METRIC>::value;
+  template <class ForwardIterator>
+  inline double distance_squared(const long index1,
+                                 ForwardIterator vec2) const {
+    return Distance.squared(point_begin(index1), point_end(index1), vec2);
+  }
+  template <class ForwardIterator>
+  inline double distance_squared(const long index1, ForwardIterator vec2,
+                                 const double thresh2) const {
+    return Distance.squared(point_begin(index1), point_end(index1), vec2,
+                            thresh2);
+  }
+};
+
+// Iterator over the coordinates of one point of a quantized_point_set, which
+// are decoded from their codes as offset + scale * code on the fly.
+template <class Q> class dequantizing_iterator {
+protected:
+  const Q *code;
+  const double *scale;
+  const double *offset;
+
+public:
+  dequantizing_iterator(const Q *c, const double *s, const double *o)
+      : code(c), scale(s), offset(o){};
+  inline double operator*() const { return *offset + *scale * *code; };
+  inline dequantizing_iterator &operator++() {
+    ++code;
+    ++scale;
+    ++offset;
+    return *this;
+  };
+  inline bool operator==(const dequantizing_iterator &x) const {
+    return code == x.code;
+  };
+  inline bool operator!=(const dequantizing_iterator &x) const {
+    return code != x.code;
+  };
+};
+
+// Define a point_set that keeps the points of an R matrix quantized to
+// unsigned integer codes of type Q (uint8_t or uint16_t), with a scale and
+// an offset per dimension. The codes are 4 (uint8_t) or 2 (uint16_t) times
+// smaller than the float rows of rm_point_set, which shrinks the working set
+// of leaf scans. Like cm_point_set, the object keeps a reference to the R
+// matrix, which gives the exact coordinates, so the codes add to the memory
+// of the R matrix instead of replacing it. Columns of integers that fit into
+// the range of Q are stored without loss. All distances are exact:
+// thresholded distances, which are computed for the points of terminal nodes
+// during searches, are first computed on the decoded points. As the distance
+// of a decoded point to its exact point is at most max_error(), points whose
+// decoded distance exceeds the threshold by more than that are rejected
+// without reading the R matrix. Only the remaining candidates are re-ranked
+// with their exact coordinates. Distances without a threshold, e.g. to the
+// centers of tree nodes and during tree construction, read the R matrix. If
+// all columns are stored without loss, the R matrix is never read for
+// distances. The points can not be reordered, as this would modify the R
+// object.
+template <class METRIC, class Q = uint8_t>
+class quantized_point_set : public point_set_base<METRIC> {
+
+protected:
+  const long D; // dimension
+  Rcpp::NumericMatrix matrix; // keeps the R object alive
+  const double* matrix_ptr; // exact points, stored column-major
+  std::vector<Q> codes; // quantized points, stored row-major
+  std::vector<double> scale; // per dimension
+  std::vector<double> offset; // per dimension
+  double error; // bound of the distance between a point and its decoded point
+  const METRIC Distance; // a function object that calculates distances
+
+  typedef dequantizing_iterator<Q> code_iterator;
+  inline code_iterator code_begin(const long n) const {
+    return code_iterator(codes.data() + n * D, scale.data(), offset.data());
+  }
+  inline code_iterator code_end(const long n) const {
+    return code_iterator(codes.data() + (n + 1) * D, scale.data(),
+                         offset.data());
+  }
+
+public:
+  typedef double value_type;
+
+  quantized_point_set() = delete;
+  quantized_point_set(const quantized_point_set& from) = delete;
+  quantized_point_set(const Rcpp::NumericMatrix& m,
+                      const METRIC& metric = METRIC())
+    : point_set_base<METRIC>(m.nrow()), D(m.ncol()), matrix(m),
+      matrix_ptr(m.begin()), codes(m.nrow() * m.ncol()), scale(m.ncol(), 0),
+      offset(m.ncol(), 0), error(0), Distance(metric){
+      const long N = point_set_base<METRIC>::N;
+      const double levels = std::numeric_limits<Q>::max();
+      for (long d = 0; d < D; d++) {
+        const double *x = matrix_ptr + d * N;
+        double lo = x[0], hi = x[0];
+        bool integers = true;
+        for (long n = 0; n < N; n++) {
+          lo = std::min(lo, x[n]);
+          hi = std::max(hi, x[n]);
+          integers = integers && (x[n] == std::floor(x[n]));
+        }
+        offset[d] = lo;
+        if (integers && (hi - lo <= levels)) {
+          scale[d] = 1;
+        } else if (hi > lo) {
+          scale[d] = (hi - lo) / levels;
+        }
+        for (long n = 0; n < N; n++) {
+          const double c =
+              (scale[d] > 0) ? std::floor((x[n] - lo) / scale[d] + 0.5) : 0;
+          codes[n * D + d] = (Q)std::min(c, levels);
+        }
+      }
+      // The largest distance of a point to its decoded point, measured with
+      // the metric itself, so the bound holds for every metric.
+      for (long n = 0; n < N; n++)
+        error = std::max(error, Distance(code_begin(n), code_end(n),
+                                         point_begin(n)));
+    };
+  quantized_point_set(quantized_point_set&& from)
+    : point_set_base<METRIC>(from.N), D(from.D), matrix(from.matrix),
+      matrix_ptr(from.matrix_ptr), codes(std::move(from.codes)),
+      scale(std::move(from.scale)), offset(std::move(from.offset)),
+      error(from.error), Distance(from.Distance){};
+  ~quantized_point_set(){};
+  inline long dimension() const { return D; };
+
+  // Bound of the distance between any point and its decoded point, 0 if
+  // the points are stored without loss.
+  inline double max_error() const { return error; };
+
+  typedef strided_iterator<double> row_iterator; // iterates over the exact
+  // coordinates of one point (points are row vectors of the R matrix)
+
+  row_iterator point_begin(const long n) const {
+    return row_iterator(matrix_ptr + n, point_set_base<METRIC>::N);
+  }
+  row_iterator point_end(const long n) const {
+    return row_iterator(matrix_ptr + n + D * point_set_base<METRIC>::N,
+                        point_set_base<METRIC>::N); // past-the-end
+  }
+
+  inline void prefetch(const long n) const {
+#if defined(__GNUC__)
+    __builtin_prefetch(codes.data() + n * D);
+#endif
+  }
+
+  // The R matrix is not modified, returns false.
+  template <class Order> bool permute_points(const long, Order) {
+    return false;
+  }
+  bool append_points(const double*, const long) { return false; }
+  bool resize_points(const long) { return false; }
+  void copy_point(const long, const long) {}
+  void swap_points(const long, const long) {}
+
+  template <class ForwardIterator>
+  inline double distance(const long index1, ForwardIterator vec2) const {
+    if (error == 0)
+      return Distance(code_begin(index1), code_end(index1), vec2);
+    return Distance(point_begin(index1), point_end(index1), vec2);
+  }
+  template <class ForwardIterator>
+  inline double distance(const long index1, ForwardIterator vec2,
+                         const double thresh) const {
+    if (error == 0)
+      return Distance(code_begin(index1), code_end(index1), vec2, thresh);
+    // The relative slack covers rounding errors of the decoded distance.
+    const double bound = (thresh + error) * (1 + 1e-12);
+    if (Distance(code_begin(index1), code_end(index1), vec2, bound) > bound)
+      return DBL_MAX;
+    return Distance(point_begin(index1), point_end(index1), vec2, thresh);
+  }
+  inline double distance(const long index1, const long index2) const {
+    if (error == 0)
+      return Distance(code_begin(index1), code_end(index1),
+                      code_begin(index2));
+    return Distance(point_begin(index1), point_end(index1),
+                    point_begin(index2));
+  }
+};
+
+// Define a point_set of the delay vectors of a scalar time series, as used in
+// nonlinear time series analysis. Point n is the delay vector
+// (s[n], s[n + delay], ..., s[n + (dim - 1) * delay]) of the series s, so a
+// series of length L gives L - (dim - 1) * delay points. Only the series is
+// stored and the coordinates are read from it on the fly, which needs dim
+// times less memory than the embedding matrix. The series is either copied
+// with element type T or, for T = double, the R vector is used in place and
+// kept alive by a reference like in cm_point_set. For delay 1, the
+// coordinates of a point are contiguous and the vectorized distance kernels
+// are used. The points can not be reordered or extended, as they overlap.
+template <class METRIC, class T = double>
+class embedding_point_set : public point_set_base<METRIC> {
+
+protected:
+  const long D;                // embedding dimension
+  const long delay;            // distance of coordinates in the series
+  Rcpp::NumericVector series;  // keeps the R object alive if used in place
+  std::vector<T> copy;         // the series, if it is copied
+  const T* series_ptr;         // first element of the series
+  const METRIC Distance; // a function object that calculates distances
+public:
+  typedef T value_type;
+
+  embedding_point_set() = delete;
+  embedding_point_set(const embedding_point_set& from) = delete;
+  // The series must contain at least (dim - 1) * delay + 1 values. in_place
+  // is only allowed for T = double.
+  embedding_point_set(const Rcpp::NumericVector& s, const long dim,
+                      const long tau, const bool in_place,
+                      const METRIC& metric = METRIC())
+    : point_set_base<METRIC>(s.size() - (dim - 1) * tau), D(dim), delay(tau),
+      series_ptr(nullptr), Distance(metric){
+      if (in_place && std::is_same<T, double>::value) {
+        series = s;
+        series_ptr = (const T*)series.begin();
+      } else {
+        copy.assign(s.begin(), s.end());
+        series_ptr = copy.data();
+      }
+    };
+  // The buffer of a moved std::vector stays valid, so series_ptr does too.
+  embedding_point_set(embedding_point_set&& from)
+    : point_set_base<METRIC>(from.N), D(from.D), delay(from.delay),
+      series(from.series), copy(std::move(from.copy)),
+      series_ptr(from.series_ptr), Distance(from.Distance){};
+  ~embedding_point_set(){};
+  inline long dimension() const { return D; };
+  inline long embedding_delay() const { return delay; };
+
+  typedef strided_iterator<T> row_iterator; // iterates over the elements
+  // of one delay vector
+
+  row_iterator point_begin(const long n) const {
+    return row_iterator(series_ptr + n, delay);
+  }
+  row_iterator point_end(const long n) const {
+    return row_iterator(series_ptr + n + D * delay, delay); // past-the-end
+  }
+
+  inline void prefetch(const long n) const {
+#if defined(__GNUC__)
+    __builtin_prefetch(series_ptr + n);
+#endif
+  }
+
+  // The delay vectors share their elements, returns false.
+  template <class Order> bool permute_points(const long, Order) {
+    return false;
+  }
+  bool append_points(const double*, const long) { return false; }
+  bool resize_points(const long) { return false; }
+  void copy_point(const long, const long) {}
+  void swap_points(const long, const long) {}
+
+  template <class ForwardIterator>
+  inline double distance(const long index1, ForwardIterator vec2) const {
+    if (delay == 1)
+      return Distance(series_ptr + index1, series_ptr + index1 + D, vec2);
+    return Distance(point_begin(index1), point_end(index1), vec2);
+  }
+  template <class ForwardIterator>
+  inline double distance(const long index1, ForwardIterator vec2,
+                         const double thresh) const {
+    if (delay == 1)
+      return Distance(series_ptr + index1, series_ptr + index1 + D, vec2,
+                      thresh);
+    return Distance(point_begin(index1), point_end(index1), vec2, thresh);
+  }
+  // Distances to delay vectors of this point set given by point_begin(),
+  // like the query points of all_k_neighbors.
+  inline double distance(const long index1, row_iterator vec2) const {
+    if (delay == 1)
+      return Distance(series_ptr + index1, series_ptr + index1 + D, &*vec2);
+    return Distance(point_begin(index1), point_end(index1), vec2);
+  }
+  inline double distance(const long index1, row_iterator vec2,
+                         const double thresh) const {
+    if (delay == 1)
+      return Distance(series_ptr + index1, series_ptr + index1 + D, &*vec2,
+                      thresh);
+    return Distance(point_begin(index1), point_end(index1), vec2, thresh);
+  }
+  inline double distance(const long index1, const long index2) const {
+    if (delay == 1)
+      return Distance(series_ptr + index1, series_ptr + index1 + D,
+                      series_ptr + index2);
+    return Distance(point_begin(index1), point_end(index1),
+                    point_begin(index2));
+  }
+
+  static const bool squared_distances = has_squared_distance<METRIC>::value;
+  template <class ForwardIterator>
+  inline double distance_squared(const long index1,
+                                 ForwardIterator vec2) const {
+    if (delay == 1)
+      return Distance.squared(series_ptr + index1, series_ptr + index1 + D,
+                              vec2);
+    return Distance.squared(point_begin(index1), point_end(index1), vec2);
+  }
+  template <class ForwardIterator>
+  inline double distance_squared(const long index1, ForwardIterator vec2,
+                                 const double thresh2) const {
+    if (delay == 1)
+      return Distance.squared(series_ptr + index1, series_ptr + index1 + D,
+                              vec2, thresh2);
+    return Distance.squared(point_begin(index1), point_end(index1), vec2,
+                            thresh2);
+  }
+  inline double distance_squared(const long index1, row_iterator vec2) const {
+    if (delay == 1)
+      return Distance.squared(series_ptr + index1, series_ptr + index1 + D,
+                              &*vec2);
+    return Distance.squared(point_begin(index1), point_end(index1), vec2);
+  }
+  inline double distance_squared(const long index1, row_iterator vec2,
+                                 const double thresh2) const {
+    if (delay == 1)
+      return Distance.squared(series_ptr + index1, series_ptr + index1 + D,
+                              &*vec2, thresh2);
+    return Distance.squared(point_begin(index1), point_end(index1), vec2,
+                            thresh2);
+  }
 };
 
 #endif
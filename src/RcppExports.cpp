@@ -7,8 +7,8 @@
 using namespace Rcpp;
 
 // create_searcher
-XPtr<Searcher> create_searcher(NumericMatrix x, const string metric, const long exclude_samples, const long cluster_max_points, const uint32 seed);
-RcppExport SEXP _atriar_create_searcher(SEXP xSEXP, SEXP metricSEXP, SEXP exclude_samplesSEXP, SEXP cluster_max_pointsSEXP, SEXP seedSEXP) {
+XPtr<Searcher> create_searcher(NumericMatrix x, const string metric, const long exclude_samples, const long cluster_max_points, const uint32 seed, const int threads, const bool reorder_points, const string storage, const double p, NumericVector weights, const string split, const string engine, const bool auto_tune, const long tune_k, const double tune_radius);
+RcppExport SEXP _atriar_create_searcher(SEXP xSEXP, SEXP metricSEXP, SEXP exclude_samplesSEXP, SEXP cluster_max_pointsSEXP, SEXP seedSEXP, SEXP threadsSEXP, SEXP reorder_pointsSEXP, SEXP storageSEXP, SEXP pSEXP, SEXP weightsSEXP, SEXP splitSEXP, SEXP engineSEXP, SEXP auto_tuneSEXP, SEXP tune_kSEXP, SEXP tune_radiusSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -17,7 +17,40 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const long >::type exclude_samples(exclude_samplesSEXP);
     Rcpp::traits::input_parameter< const long >::type cluster_max_points(cluster_max_pointsSEXP);
     Rcpp::traits::input_parameter< const uint32 >::type seed(seedSEXP);
-    rcpp_result_gen = Rcpp::wrap(create_searcher(x, metric, exclude_samples, cluster_max_points, seed));
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type reorder_points(reorder_pointsSEXP);
+    Rcpp::traits::input_parameter< const string >::type storage(storageSEXP);
+    Rcpp::traits::input_parameter< const double >::type p(pSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type weights(weightsSEXP);
+    Rcpp::traits::input_parameter< const string >::type split(splitSEXP);
+    Rcpp::traits::input_parameter< const string >::type engine(engineSEXP);
+    Rcpp::traits::input_parameter< const bool >::type auto_tune(auto_tuneSEXP);
+    Rcpp::traits::input_parameter< const long >::type tune_k(tune_kSEXP);
+    Rcpp::traits::input_parameter< const double >::type tune_radius(tune_radiusSEXP);
+    rcpp_result_gen = Rcpp::wrap(create_searcher(x, metric, exclude_samples, cluster_max_points, seed, threads, reorder_points, storage, p, weights, split, engine, auto_tune, tune_k, tune_radius));
+    return rcpp_result_gen;
+END_RCPP
+}
+// create_embedding_searcher
+XPtr<Searcher> create_embedding_searcher(NumericVector series, const long dim, const long delay, const string metric, const long exclude_samples, const long cluster_max_points, const uint32 seed, const int threads, const string storage, const double p, NumericVector weights, const string split, const string engine);
+RcppExport SEXP _atriar_create_embedding_searcher(SEXP seriesSEXP, SEXP dimSEXP, SEXP delaySEXP, SEXP metricSEXP, SEXP exclude_samplesSEXP, SEXP cluster_max_pointsSEXP, SEXP seedSEXP, SEXP threadsSEXP, SEXP storageSEXP, SEXP pSEXP, SEXP weightsSEXP, SEXP splitSEXP, SEXP engineSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type series(seriesSEXP);
+    Rcpp::traits::input_parameter< const long >::type dim(dimSEXP);
+    Rcpp::traits::input_parameter< const long >::type delay(delaySEXP);
+    Rcpp::traits::input_parameter< const string >::type metric(metricSEXP);
+    Rcpp::traits::input_parameter< const long >::type exclude_samples(exclude_samplesSEXP);
+    Rcpp::traits::input_parameter< const long >::type cluster_max_points(cluster_max_pointsSEXP);
+    Rcpp::traits::input_parameter< const uint32 >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const string >::type storage(storageSEXP);
+    Rcpp::traits::input_parameter< const double >::type p(pSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type weights(weightsSEXP);
+    Rcpp::traits::input_parameter< const string >::type split(splitSEXP);
+    Rcpp::traits::input_parameter< const string >::type engine(engineSEXP);
+    rcpp_result_gen = Rcpp::wrap(create_embedding_searcher(series, dim, delay, metric, exclude_samples, cluster_max_points, seed, threads, storage, p, weights, split, engine));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -32,6 +65,173 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// save_searcher
+bool save_searcher(XPtr<Searcher> searcher, const string path);
+RcppExport SEXP _atriar_save_searcher(SEXP searcherSEXP, SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< const string >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(save_searcher(searcher, path));
+    return rcpp_result_gen;
+END_RCPP
+}
+// load_searcher
+XPtr<Searcher> load_searcher(const string path, const string engine);
+RcppExport SEXP _atriar_load_searcher(SEXP pathSEXP, SEXP engineSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const string >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const string >::type engine(engineSEXP);
+    rcpp_result_gen = Rcpp::wrap(load_searcher(path, engine));
+    return rcpp_result_gen;
+END_RCPP
+}
+// insert_points
+IntegerVector insert_points(XPtr<Searcher> searcher, NumericMatrix x, const int threads, const double rebuild_threshold);
+RcppExport SEXP _atriar_insert_points(SEXP searcherSEXP, SEXP xSEXP, SEXP threadsSEXP, SEXP rebuild_thresholdSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const double >::type rebuild_threshold(rebuild_thresholdSEXP);
+    rcpp_result_gen = Rcpp::wrap(insert_points(searcher, x, threads, rebuild_threshold));
+    return rcpp_result_gen;
+END_RCPP
+}
+// delete_points
+long delete_points(XPtr<Searcher> searcher, IntegerVector indices, const int threads, const double rebuild_threshold);
+RcppExport SEXP _atriar_delete_points(SEXP searcherSEXP, SEXP indicesSEXP, SEXP threadsSEXP, SEXP rebuild_thresholdSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type indices(indicesSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const double >::type rebuild_threshold(rebuild_thresholdSEXP);
+    rcpp_result_gen = Rcpp::wrap(delete_points(searcher, indices, threads, rebuild_threshold));
+    return rcpp_result_gen;
+END_RCPP
+}
+// tree_drift
+double tree_drift(XPtr<Searcher> searcher);
+RcppExport SEXP _atriar_tree_drift(SEXP searcherSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    rcpp_result_gen = Rcpp::wrap(tree_drift(searcher));
+    return rcpp_result_gen;
+END_RCPP
+}
+// tree_statistics
+List tree_statistics(XPtr<Searcher> searcher);
+RcppExport SEXP _atriar_tree_statistics(SEXP searcherSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    rcpp_result_gen = Rcpp::wrap(tree_statistics(searcher));
+    return rcpp_result_gen;
+END_RCPP
+}
+// searcher_stats
+List searcher_stats(XPtr<Searcher> searcher, const bool reset);
+RcppExport SEXP _atriar_searcher_stats(SEXP searcherSEXP, SEXP resetSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< const bool >::type reset(resetSEXP);
+    rcpp_result_gen = Rcpp::wrap(searcher_stats(searcher, reset));
+    return rcpp_result_gen;
+END_RCPP
+}
+// search_efficiency
+double search_efficiency(XPtr<Searcher> searcher);
+RcppExport SEXP _atriar_search_efficiency(SEXP searcherSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    rcpp_result_gen = Rcpp::wrap(search_efficiency(searcher));
+    return rcpp_result_gen;
+END_RCPP
+}
+// search_engine
+List search_engine(XPtr<Searcher> searcher);
+RcppExport SEXP _atriar_search_engine(SEXP searcherSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    rcpp_result_gen = Rcpp::wrap(search_engine(searcher));
+    return rcpp_result_gen;
+END_RCPP
+}
+// set_search_engine
+List set_search_engine(XPtr<Searcher> searcher, const string engine);
+RcppExport SEXP _atriar_set_search_engine(SEXP searcherSEXP, SEXP engineSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< const string >::type engine(engineSEXP);
+    rcpp_result_gen = Rcpp::wrap(set_search_engine(searcher, engine));
+    return rcpp_result_gen;
+END_RCPP
+}
+// phase_timings
+DataFrame phase_timings(const bool reset);
+RcppExport SEXP _atriar_phase_timings(SEXP resetSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const bool >::type reset(resetSEXP);
+    rcpp_result_gen = Rcpp::wrap(phase_timings(reset));
+    return rcpp_result_gen;
+END_RCPP
+}
+// record_phase_trace
+bool record_phase_trace();
+RcppExport SEXP _atriar_record_phase_trace() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(record_phase_trace());
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_phase_trace
+long write_phase_trace(const string path);
+RcppExport SEXP _atriar_write_phase_trace(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const string >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_phase_trace(path));
+    return rcpp_result_gen;
+END_RCPP
+}
+// build_spill_tree
+List build_spill_tree(XPtr<Searcher> searcher, const double overlap, const long max_points, const int threads, const double max_duplication);
+RcppExport SEXP _atriar_build_spill_tree(SEXP searcherSEXP, SEXP overlapSEXP, SEXP max_pointsSEXP, SEXP threadsSEXP, SEXP max_duplicationSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< const double >::type overlap(overlapSEXP);
+    Rcpp::traits::input_parameter< const long >::type max_points(max_pointsSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const double >::type max_duplication(max_duplicationSEXP);
+    rcpp_result_gen = Rcpp::wrap(build_spill_tree(searcher, overlap, max_points, threads, max_duplication));
+    return rcpp_result_gen;
+END_RCPP
+}
 // number_of_points
 long number_of_points(XPtr<Searcher> searcher);
 RcppExport SEXP _atriar_number_of_points(SEXP searcherSEXP) {
@@ -55,8 +255,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // search_k_neighbors
-List search_k_neighbors(XPtr<Searcher> searcher, const long k, NumericMatrix query_points, IntegerMatrix exclude, const double epsilon);
-RcppExport SEXP _atriar_search_k_neighbors(SEXP searcherSEXP, SEXP kSEXP, SEXP query_pointsSEXP, SEXP excludeSEXP, SEXP epsilonSEXP) {
+List search_k_neighbors(XPtr<Searcher> searcher, const long k, NumericMatrix query_points, IntegerMatrix exclude, const double epsilon, const int threads, const bool median_pruning, const long max_distances, const long max_terminal_nodes, const bool defeatist, const bool stats);
+RcppExport SEXP _atriar_search_k_neighbors(SEXP searcherSEXP, SEXP kSEXP, SEXP query_pointsSEXP, SEXP excludeSEXP, SEXP epsilonSEXP, SEXP threadsSEXP, SEXP median_pruningSEXP, SEXP max_distancesSEXP, SEXP max_terminal_nodesSEXP, SEXP defeatistSEXP, SEXP statsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -65,7 +265,48 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< NumericMatrix >::type query_points(query_pointsSEXP);
     Rcpp::traits::input_parameter< IntegerMatrix >::type exclude(excludeSEXP);
     Rcpp::traits::input_parameter< const double >::type epsilon(epsilonSEXP);
-    rcpp_result_gen = Rcpp::wrap(search_k_neighbors(searcher, k, query_points, exclude, epsilon));
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type median_pruning(median_pruningSEXP);
+    Rcpp::traits::input_parameter< const long >::type max_distances(max_distancesSEXP);
+    Rcpp::traits::input_parameter< const long >::type max_terminal_nodes(max_terminal_nodesSEXP);
+    Rcpp::traits::input_parameter< const bool >::type defeatist(defeatistSEXP);
+    Rcpp::traits::input_parameter< const bool >::type stats(statsSEXP);
+    rcpp_result_gen = Rcpp::wrap(search_k_neighbors(searcher, k, query_points, exclude, epsilon, threads, median_pruning, max_distances, max_terminal_nodes, defeatist, stats));
+    return rcpp_result_gen;
+END_RCPP
+}
+// all_k_neighbors
+List all_k_neighbors(XPtr<Searcher> searcher, const long k, const long theiler_window, const int threads);
+RcppExport SEXP _atriar_all_k_neighbors(SEXP searcherSEXP, SEXP kSEXP, SEXP theiler_windowSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< const long >::type k(kSEXP);
+    Rcpp::traits::input_parameter< const long >::type theiler_window(theiler_windowSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(all_k_neighbors(searcher, k, theiler_window, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// search_k_neighbors_at
+List search_k_neighbors_at(XPtr<Searcher> searcher, const long k, IntegerVector indices, const long theiler_window, const double epsilon, const int threads, const bool median_pruning, const long max_distances, const long max_terminal_nodes, const bool defeatist, const bool stats);
+RcppExport SEXP _atriar_search_k_neighbors_at(SEXP searcherSEXP, SEXP kSEXP, SEXP indicesSEXP, SEXP theiler_windowSEXP, SEXP epsilonSEXP, SEXP threadsSEXP, SEXP median_pruningSEXP, SEXP max_distancesSEXP, SEXP max_terminal_nodesSEXP, SEXP defeatistSEXP, SEXP statsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< const long >::type k(kSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type indices(indicesSEXP);
+    Rcpp::traits::input_parameter< const long >::type theiler_window(theiler_windowSEXP);
+    Rcpp::traits::input_parameter< const double >::type epsilon(epsilonSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type median_pruning(median_pruningSEXP);
+    Rcpp::traits::input_parameter< const long >::type max_distances(max_distancesSEXP);
+    Rcpp::traits::input_parameter< const long >::type max_terminal_nodes(max_terminal_nodesSEXP);
+    Rcpp::traits::input_parameter< const bool >::type defeatist(defeatistSEXP);
+    Rcpp::traits::input_parameter< const bool >::type stats(statsSEXP);
+    rcpp_result_gen = Rcpp::wrap(search_k_neighbors_at(searcher, k, indices, theiler_window, epsilon, threads, median_pruning, max_distances, max_terminal_nodes, defeatist, stats));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -83,6 +324,55 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// count_range_multi
+IntegerMatrix count_range_multi(XPtr<Searcher> searcher, NumericVector radii, NumericMatrix query_points, IntegerMatrix exclude, const int threads);
+RcppExport SEXP _atriar_count_range_multi(SEXP searcherSEXP, SEXP radiiSEXP, SEXP query_pointsSEXP, SEXP excludeSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type radii(radiiSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type query_points(query_pointsSEXP);
+    Rcpp::traits::input_parameter< IntegerMatrix >::type exclude(excludeSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(count_range_multi(searcher, radii, query_points, exclude, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// count_pairs
+List count_pairs(XPtr<Searcher> searcher, NumericVector radii, const long theiler_window, IntegerVector sample, const int threads);
+RcppExport SEXP _atriar_count_pairs(SEXP searcherSEXP, SEXP radiiSEXP, SEXP theiler_windowSEXP, SEXP sampleSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type radii(radiiSEXP);
+    Rcpp::traits::input_parameter< const long >::type theiler_window(theiler_windowSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type sample(sampleSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(count_pairs(searcher, radii, theiler_window, sample, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// corrsum_engine
+List corrsum_engine(XPtr<Searcher> searcher, NumericMatrix data, NumericVector dist_breaks, const double min_actual_pairs, const long min_nr_samples_at_scale, const long max_nr_samples_at_scale, const long batch_size, const int threads, const bool verbose);
+RcppExport SEXP _atriar_corrsum_engine(SEXP searcherSEXP, SEXP dataSEXP, SEXP dist_breaksSEXP, SEXP min_actual_pairsSEXP, SEXP min_nr_samples_at_scaleSEXP, SEXP max_nr_samples_at_scaleSEXP, SEXP batch_sizeSEXP, SEXP threadsSEXP, SEXP verboseSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< XPtr<Searcher> >::type searcher(searcherSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type data(dataSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type dist_breaks(dist_breaksSEXP);
+    Rcpp::traits::input_parameter< const double >::type min_actual_pairs(min_actual_pairsSEXP);
+    Rcpp::traits::input_parameter< const long >::type min_nr_samples_at_scale(min_nr_samples_at_scaleSEXP);
+    Rcpp::traits::input_parameter< const long >::type max_nr_samples_at_scale(max_nr_samples_at_scaleSEXP);
+    Rcpp::traits::input_parameter< const long >::type batch_size(batch_sizeSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type verbose(verboseSEXP);
+    rcpp_result_gen = Rcpp::wrap(corrsum_engine(searcher, data, dist_breaks, min_actual_pairs, min_nr_samples_at_scale, max_nr_samples_at_scale, batch_size, threads, verbose));
+    return rcpp_result_gen;
+END_RCPP
+}
 // boxcount
 List boxcount(IntegerMatrix x, bool verbose);
 RcppExport SEXP _atriar_boxcount(SEXP xSEXP, SEXP verboseSEXP) {
@@ -122,12 +412,32 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_atriar_create_searcher", (DL_FUNC) &_atriar_create_searcher, 5},
+    {"_atriar_create_searcher", (DL_FUNC) &_atriar_create_searcher, 15},
+    {"_atriar_create_embedding_searcher", (DL_FUNC) &_atriar_create_embedding_searcher, 13},
     {"_atriar_release_searcher", (DL_FUNC) &_atriar_release_searcher, 1},
+    {"_atriar_save_searcher", (DL_FUNC) &_atriar_save_searcher, 2},
+    {"_atriar_load_searcher", (DL_FUNC) &_atriar_load_searcher, 2},
+    {"_atriar_insert_points", (DL_FUNC) &_atriar_insert_points, 4},
+    {"_atriar_delete_points", (DL_FUNC) &_atriar_delete_points, 4},
+    {"_atriar_tree_drift", (DL_FUNC) &_atriar_tree_drift, 1},
+    {"_atriar_tree_statistics", (DL_FUNC) &_atriar_tree_statistics, 1},
+    {"_atriar_searcher_stats", (DL_FUNC) &_atriar_searcher_stats, 2},
+    {"_atriar_search_efficiency", (DL_FUNC) &_atriar_search_efficiency, 1},
+    {"_atriar_search_engine", (DL_FUNC) &_atriar_search_engine, 1},
+    {"_atriar_set_search_engine", (DL_FUNC) &_atriar_set_search_engine, 2},
+    {"_atriar_phase_timings", (DL_FUNC) &_atriar_phase_timings, 1},
+    {"_atriar_record_phase_trace", (DL_FUNC) &_atriar_record_phase_trace, 0},
+    {"_atriar_write_phase_trace", (DL_FUNC) &_atriar_write_phase_trace, 1},
+    {"_atriar_build_spill_tree", (DL_FUNC) &_atriar_build_spill_tree, 5},
     {"_atriar_number_of_points", (DL_FUNC) &_atriar_number_of_points, 1},
     {"_atriar_data_set_radius", (DL_FUNC) &_atriar_data_set_radius, 1},
-    {"_atriar_search_k_neighbors", (DL_FUNC) &_atriar_search_k_neighbors, 5},
+    {"_atriar_search_k_neighbors", (DL_FUNC) &_atriar_search_k_neighbors, 11},
+    {"_atriar_all_k_neighbors", (DL_FUNC) &_atriar_all_k_neighbors, 4},
+    {"_atriar_search_k_neighbors_at", (DL_FUNC) &_atriar_search_k_neighbors_at, 11},
     {"_atriar_search_range", (DL_FUNC) &_atriar_search_range, 4},
+    {"_atriar_count_range_multi", (DL_FUNC) &_atriar_count_range_multi, 5},
+    {"_atriar_count_pairs", (DL_FUNC) &_atriar_count_pairs, 5},
+    {"_atriar_corrsum_engine", (DL_FUNC) &_atriar_corrsum_engine, 9},
     {"_atriar_boxcount", (DL_FUNC) &_atriar_boxcount, 2},
     {"_atriar_count_integers", (DL_FUNC) &_atriar_count_integers, 2},
     {"_atriar_henon", (DL_FUNC) &_atriar_henon, 3},
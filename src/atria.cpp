@@ -6,15 +6,88 @@ using namespace Rcpp;
 
 #include "atria.h"
 
+// The candidates of tune_searcher as a data frame, see create_searcher.
+static DataFrame tuning_frame(const vector<tuning_candidate> &candidates) {
+  const long n = candidates.size();
+  CharacterVector stage(n);
+  IntegerVector minpts(n);
+  NumericVector seed(n), build_seconds(n), query_seconds(n), distances(n);
+  LogicalVector chosen(n);
+  for (long i = 0; i < n; i++) {
+    const tuning_candidate &c = candidates[i];
+    stage[i] = (c.stage == 0) ? "leaf_size" : "seed";
+    minpts[i] = c.minpts;
+    seed[i] = c.seed;
+    build_seconds[i] = c.build_seconds;
+    query_seconds[i] = c.query_seconds;
+    distances[i] = c.distances;
+    chosen[i] = c.chosen;
+  }
+  return DataFrame::create(
+      Named("stage") = stage, Named("cluster_max_points") = minpts,
+      Named("seed") = seed, Named("build_seconds") = build_seconds,
+      Named("query_seconds") = query_seconds, Named("distances") = distances,
+      Named("chosen") = chosen, Named("stringsAsFactors") = false);
+}
+
 //' Create ATRIA searcher (ball-tree).
 //' @title FUNCTION_TITLE
 //' @description FUNCTION_DESCRIPTION
 //' @param x PARAM_DESCRIPTION
-//' @param metric PARAM_DESCRIPTION, Default: 'euclidian'
+//' @param metric The distance metric: 'euclidian', 'manhattan', 'maximum',
+//'   'hamming', 'minkowski' of order p, 'weighted_euclidian' with weights or
+//'   'angular', the angle between points in radians, which orders neighbors
+//'   like the cosine distance 1 - cos(angle) ('cosine' is a synonym). Searchers
+//'   with the metrics 'minkowski' and 'weighted_euclidian' can not be saved,
+//'   Default: 'euclidian'
 //' @param exclude_samples PARAM_DESCRIPTION, Default: 0
 //' @param cluster_max_points PARAM_DESCRIPTION, Default: 64
 //' @param seed PARAM_DESCRIPTION, Default: 93453562
-//' @return OUTPUT_DESCRIPTION
+//' @param threads Number of threads used to build the search tree, the
+//'   resulting tree does not depend on it, Default: 1
+//' @param reorder_points If TRUE, the searcher keeps its copy of the data
+//'   points in the order of the leaves of the search tree, which speeds up
+//'   searches on data sets that do not fit into the cache, Default: FALSE
+//' @param storage How the searcher stores the data points: 'float' keeps a
+//'   row-major copy in single precision, 'double' a row-major copy in double
+//'   precision and 'reference' uses the matrix x itself without copying it
+//'   (slower searches, but no additional memory). 'uint8' and 'uint16' keep
+//'   the points quantized to 8 or 16 bits per coordinate, with a scale and an
+//'   offset per column, and use the matrix x itself only for the exact
+//'   distances of points that can not be rejected by their quantized
+//'   distances. Columns of integers that fit into the range of the codes,
+//'   like pixel values, are quantized without loss, Default: 'float'
+//' @param p The order of the 'minkowski' metric, a finite number of at
+//'   least 1 (use the metric 'maximum' for p = Inf), Default: 2
+//' @param weights Non-negative weights of the dimensions for the
+//'   'weighted_euclidian' metric, Default: numeric(0)
+//' @param split How clusters of the search tree are divided: 'farthest'
+//'   uses the point farthest from the cluster's center and the point
+//'   farthest from that one as centers of the two children, 'sampled' the
+//'   farthest pair among a random sample of the cluster's points, which is
+//'   less sensitive to outliers, 'medoid' moves the centers of 'farthest' to
+//'   the points nearest to the centroids of the children, which gives
+//'   smaller radii, and 'balanced' divides the points into two halves of
+//'   equal size, which gives a shallower tree. The neighbors found do not
+//'   depend on it, see tree_statistics, Default: 'farthest'
+//' @param engine How exact k nearest neighbor and range searches are done:
+//'   'tree', 'brute_force' or 'auto', which uses brute force if the tree
+//'   prunes too little, see search_engine, Default: 'auto'
+//' @param auto_tune If TRUE, cluster_max_points and seed are chosen
+//'   automatically: searchers with 8 to 256 points per terminal node are
+//'   built on a random subsample of up to 20000 points, then searchers with
+//'   the fastest of those and 3 seeds (seed first) on all points, and the
+//'   one that answers the queries of 200 data points fastest is returned,
+//'   Default: FALSE
+//' @param tune_k The number of neighbors searched by the queries timed by
+//'   auto_tune, Default: 10
+//' @param tune_radius If positive, auto_tune times range searches with this
+//'   radius instead of k nearest neighbor searches, Default: 0
+//' @return An external pointer to the ATRIA searcher. With auto_tune, it
+//'   has an attribute 'tuning', a data frame of the searchers built, with
+//'   the columns stage ('leaf_size' on the subsample or 'seed' on all
+//'   points), cluster_max_points, seed, build_seconds, query_seconds (for
+//'   all query points), distances (per query point) and chosen.
 //' @details DETAILS
 //' @examples
 //' \dontrun{
@@ -29,8 +102,117 @@ XPtr<Searcher> create_searcher(NumericMatrix x,
                                const string metric = "euclidian",
                                const long exclude_samples = 0,
                                const long cluster_max_points = 64,
-                               const uint32 seed=93453562L) {
-  Searcher *s = new Searcher(x, metric, exclude_samples, cluster_max_points, seed);
+                               const uint32 seed=93453562L,
+                               const int threads = 1,
+                               const bool reorder_points = false,
+                               const string storage = "float",
+                               const double p = 2,
+                               NumericVector weights = NumericVector(),
+                               const string split = "farthest",
+                               const string engine = "auto",
+                               const bool auto_tune = false,
+                               const long tune_k = 10,
+                               const double tune_radius = 0) {
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  metric_parameters param;
+  param.p = p;
+  param.weights.assign(weights.begin(), weights.end());
+  Searcher *s;
+  vector<tuning_candidate> candidates;
+  if (auto_tune) {
+    if ((tune_k <= 0) && (tune_radius <= 0)) {
+      throw Rcpp::exception("Number of neighbors must be positive.");
+    }
+    const tuning_parameters tuning = {metric, storage, split, engine,
+                                      param, exclude_samples, seed, threads,
+                                      reorder_points, tune_k, tune_radius};
+    s = tune_searcher(x, tuning, candidates);
+  } else {
+    s = new Searcher(x, metric, exclude_samples, cluster_max_points, seed,
+                     threads, reorder_points, storage, param, split, engine);
+  }
+  XPtr<Searcher> searcher(s);
+  if (auto_tune)
+    searcher.attr("tuning") = tuning_frame(candidates);
+  Rcout << "Approx. dataset radius: " << s->data_set_radius() << std::endl;
+  return searcher;
+}
+
+//' Create ATRIA searcher on a delay embedding
+//'
+//' Create an ATRIA searcher on the delay vectors of a scalar time series,
+//' without building the embedding matrix. Point i of the searcher is
+//' (series[i], series[i + delay], ..., series[i + (dim - 1) * delay]), so
+//' the searcher has length(series) - (dim - 1) * delay points, in the same
+//' order as the rows of the embedding matrix. Only the series is stored and
+//' the coordinates are computed when they are needed, which needs dim times
+//' less memory than a searcher on the embedding matrix. Use
+//' search_k_neighbors_at to search the neighbors of delay vectors by their
+//' time index. Points of the searcher can not be reordered or inserted.
+//' @param series A numeric vector, the time series.
+//' @param dim The embedding dimension.
+//' @param delay The delay between the coordinates of a point, Default: 1
+//' @param metric The distance metric: 'euclidian', 'manhattan', 'maximum',
+//'   'hamming', 'minkowski' of order p, 'weighted_euclidian' with weights or
+//'   'angular', the angle between points in radians, which orders neighbors
+//'   like the cosine distance 1 - cos(angle) ('cosine' is a synonym). Searchers
+//'   with the metrics 'minkowski' and 'weighted_euclidian' can not be saved,
+//'   Default: 'euclidian'
+//' @param exclude_samples Number of points at the end of the data set that
+//'   are not searched, Default: 0
+//' @param cluster_max_points Maximum number of points in a terminal node of
+//'   the search tree, Default: 64
+//' @param seed Seed of the random choice of the root center, Default:
+//'   93453562
+//' @param threads Number of threads used to build the search tree, the
+//'   resulting tree does not depend on it, Default: 1
+//' @param storage How the searcher stores the series: 'double' and 'float'
+//'   keep a copy in double or single precision, 'reference' uses the vector
+//'   series itself without copying it, Default: 'double'
+//' @param p The order of the 'minkowski' metric, a finite number of at
+//'   least 1 (use the metric 'maximum' for p = Inf), Default: 2
+//' @param weights Non-negative weights of the dimensions for the
+//'   'weighted_euclidian' metric, Default: numeric(0)
+//' @param split How clusters of the search tree are divided: 'farthest'
+//'   uses the point farthest from the cluster's center and the point
+//'   farthest from that one as centers of the two children, 'sampled' the
+//'   farthest pair among a random sample of the cluster's points, which is
+//'   less sensitive to outliers, 'medoid' moves the centers of 'farthest' to
+//'   the points nearest to the centroids of the children, which gives
+//'   smaller radii, and 'balanced' divides the points into two halves of
+//'   equal size, which gives a shallower tree. The neighbors found do not
+//'   depend on it, see tree_statistics, Default: 'farthest'
+//' @param engine How exact k nearest neighbor and range searches are done:
+//'   'tree', 'brute_force' or 'auto', which uses brute force if the tree
+//'   prunes too little, see search_engine, Default: 'auto'
+//' @return An external pointer to the ATRIA searcher.
+//' @rdname create_embedding_searcher
+//' @export
+// [[Rcpp::export]]
+XPtr<Searcher> create_embedding_searcher(NumericVector series, const long dim,
+                                         const long delay = 1,
+                                         const string metric = "euclidian",
+                                         const long exclude_samples = 0,
+                                         const long cluster_max_points = 64,
+                                         const uint32 seed = 93453562L,
+                                         const int threads = 1,
+                                         const string storage = "double",
+                                         const double p = 2,
+                                         NumericVector weights =
+                                             NumericVector(),
+                                         const string split = "farthest",
+                                         const string engine = "auto") {
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  metric_parameters param;
+  param.p = p;
+  param.weights.assign(weights.begin(), weights.end());
+  Searcher *s = new Searcher(series, dim, delay, metric, exclude_samples,
+                             cluster_max_points, seed, threads, storage,
+                             param, split, engine);
   XPtr<Searcher> searcher(s);
   Rcout << "Approx. dataset radius: " << s->data_set_radius() << std::endl;
   return searcher;
@@ -58,6 +240,422 @@ bool release_searcher(XPtr<Searcher> searcher) {
   return !searcher;
 }
 
+//' Save searcher
+//'
+//' Save the points and the search tree of an ATRIA searcher to a binary index
+//' file, which can be opened again with load_searcher, e.g. by other R
+//' sessions. Points of storage "reference", "uint8" and "uint16" are saved
+//' in double precision.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param path Name of the index file, an existing file is overwritten.
+//' @return TRUE, an error is raised if the file can not be written.
+//' @rdname save_searcher
+//' @export
+//[[Rcpp::export]]
+bool save_searcher(XPtr<Searcher> searcher, const string path) {
+  searcher->save(path);
+  return true;
+}
+
+//' Load searcher
+//'
+//' Open an ATRIA searcher saved by save_searcher. The index file is memory
+//' mapped where the operating system supports it, so opening is fast also for
+//' very large files, and processes that open the same file share its memory.
+//' The file must not be modified while a searcher uses it.
+//' @param path Name of the index file.
+//' @param engine How exact k nearest neighbor and range searches are done:
+//'   'tree', 'brute_force' or 'auto', which uses brute force if the tree
+//'   prunes too little, see search_engine, Default: 'auto'
+//' @return An external pointer to the ATRIA searcher.
+//' @rdname load_searcher
+//' @export
+//[[Rcpp::export]]
+XPtr<Searcher> load_searcher(const string path, const string engine = "auto") {
+  Searcher *s = new Searcher(path, engine);
+  XPtr<Searcher> searcher(s);
+  Rcout << "Approx. dataset radius: " << s->data_set_radius() << std::endl;
+  return searcher;
+}
+
+//' Insert points
+//'
+//' Add points to the data set of an ATRIA searcher without building a new
+//' search tree. Each point descends the tree to the child with the closer
+//' center and is added to a terminal node, terminal nodes that grow too large
+//' are divided. When the tree has drifted too far from a freshly built one
+//' (see tree_drift), a new tree is built on a background thread, it replaces
+//' the current one at one of the next calls that use the searcher. Points can
+//' not be added to searchers with storage 'reference', 'uint8' or 'uint16',
+//' with excluded samples or loaded by load_searcher.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param x The new points, one per row.
+//' @param threads Number of threads used to rebuild the tree, Default: 1
+//' @param rebuild_threshold The tree is rebuilt when tree_drift exceeds this
+//'   value, Default: 0.25
+//' @return The indices of the new points.
+//' @rdname insert_points
+//' @export
+//[[Rcpp::export]]
+IntegerVector insert_points(XPtr<Searcher> searcher, NumericMatrix x,
+                            const int threads = 1,
+                            const double rebuild_threshold = 0.25) {
+  if (x.ncol() != searcher->dimension()) {
+    std::string exception_string =
+        "Wrong dimension of points, expected " +
+        std::to_string(searcher->dimension()) + " columns";
+    throw Rcpp::exception(exception_string.c_str());
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  const long first =
+      searcher->insert_points(x.begin(), x.nrow(), threads, rebuild_threshold);
+  IntegerVector indices(x.nrow());
+  for (long i = 0; i < x.nrow(); i++)
+    indices[i] = first + i + 1; // one-based indexing
+  return indices;
+}
+
+//' Delete points
+//'
+//' Remove points from the data set of an ATRIA searcher, they are no longer
+//' found by any search. The indices of the other points do not change. The
+//' search tree is rebuilt in the background like for insert_points. Searchers
+//' with deleted points can not be saved.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param indices The indices of the points to delete.
+//' @param threads Number of threads used to rebuild the tree, Default: 1
+//' @param rebuild_threshold The tree is rebuilt when tree_drift exceeds this
+//'   value, Default: 0.25
+//' @return The number of deleted points, points deleted before are not
+//'   counted.
+//' @rdname delete_points
+//' @export
+//[[Rcpp::export]]
+long delete_points(XPtr<Searcher> searcher, IntegerVector indices,
+                   const int threads = 1,
+                   const double rebuild_threshold = 0.25) {
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  const long N = searcher->number_of_points();
+  std::vector<long> zero_based(indices.size());
+  for (long i = 0; i < indices.size(); i++) {
+    if ((indices[i] == NA_INTEGER) || (indices[i] < 1) || (indices[i] > N)) {
+      std::string exception_string =
+          "Indices must be between 1 and " + std::to_string(N);
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    zero_based[i] = indices[i] - 1;
+  }
+  return searcher->delete_points(zero_based.data(), zero_based.size(),
+                                 threads, rebuild_threshold);
+}
+
+//' Tree drift
+//'
+//' Measure how far the search tree of an ATRIA searcher has drifted from a
+//' freshly built one by insert_points and delete_points: the larger of the
+//' number of points inserted or deleted since the tree was built, relative to
+//' its size then, and the relative growth of the average radius of its
+//' terminal nodes.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @return The drift, 0 for a new tree.
+//' @rdname tree_drift
+//' @export
+//[[Rcpp::export]]
+double tree_drift(XPtr<Searcher> searcher) {
+  return searcher->tree_drift();
+}
+
+//' Tree statistics
+//'
+//' Describe the shape of the search tree of an ATRIA searcher, e.g. to
+//' compare the split strategies of create_searcher on a data set.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @return A list with the depth of the tree (the root has depth 0), the
+//'   mean depth of the terminal nodes and the mean radius Rmax of all nodes
+//'   and of the terminal nodes. Means over terminal nodes are weighted by
+//'   their number of points. Deeper trees and larger radii need more
+//'   distance calculations per search.
+//' @rdname tree_statistics
+//' @export
+//[[Rcpp::export]]
+List tree_statistics(XPtr<Searcher> searcher) {
+  const tree_shape st = searcher->statistics();
+  return List::create(Named("depth") = st.depth,
+                      Named("mean_leaf_depth") = st.mean_leaf_depth,
+                      Named("mean_radius") = st.mean_radius,
+                      Named("mean_leaf_radius") = st.mean_leaf_radius);
+}
+
+//' Search statistics
+//'
+//' Cumulative statistics of all searches of an ATRIA searcher since it was
+//' created or the statistics were reset, e.g. to choose cluster_max_points or
+//' the limits of approximate searches. k nearest neighbor searches, range
+//' searches and counts, all_k_neighbors and the correlation sum all add to
+//' the counters, only the k nearest neighbor searches of single query points
+//' add to the histograms.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param reset If TRUE, the statistics are reset to zero after they were
+//'   read, Default: FALSE
+//' @return A list with the number of queries, the number of distances
+//'   computed, of terminal nodes searched and of search items queued, the
+//'   efficiency (see search_efficiency) and a data frame histogram. Its
+//'   columns distances and terminal_nodes count the k nearest neighbor
+//'   searches that computed that many distances or searched that many
+//'   terminal nodes, from bin_start up to the bin_start of the next row. The
+//'   bins are powers of two, the last one is open.
+//' @rdname searcher_stats
+//' @export
+//[[Rcpp::export]]
+List searcher_stats(XPtr<Searcher> searcher, const bool reset = false) {
+  const search_counters c = searcher->search_statistics();
+  const double efficiency = searcher->search_efficiency();
+  if (reset)
+    searcher->reset_statistics();
+  NumericVector bin_start(SEARCH_HISTOGRAM_BINS);
+  NumericVector distances(SEARCH_HISTOGRAM_BINS);
+  NumericVector terminal_nodes(SEARCH_HISTOGRAM_BINS);
+  for (int b = 0; b < SEARCH_HISTOGRAM_BINS; b++) {
+    bin_start[b] = (b == 0) ? 0 : ldexp(1.0, b - 1);
+    distances[b] = c.distance_histogram[b];
+    terminal_nodes[b] = c.terminal_node_histogram[b];
+  }
+  return List::create(
+      Named("queries") = (double)c.number_of_queries,
+      Named("distances") = (double)c.points_searched,
+      Named("terminal_nodes") = (double)c.terminal_cluster_searched,
+      Named("queue_pushes") = (double)c.queue_pushes,
+      Named("efficiency") = efficiency,
+      Named("histogram") = DataFrame::create(
+          Named("bin_start") = bin_start, Named("distances") = distances,
+          Named("terminal_nodes") = terminal_nodes));
+}
+
+//' Search efficiency
+//'
+//' The average fraction of the data set points whose distance to a query
+//' point was computed, over all searches since the searcher was created or
+//' its statistics were reset (see searcher_stats). Values near 1 mean that
+//' the search tree does not help, NaN that no search was done yet.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @return The fraction of distances computed.
+//' @rdname search_efficiency
+//' @export
+//[[Rcpp::export]]
+double search_efficiency(XPtr<Searcher> searcher) {
+  return searcher->search_efficiency();
+}
+
+// The search engine of a searcher as a list, see search_engine.
+static List search_engine_list(Searcher &searcher) {
+  const bool brute_force = searcher.brute_force();
+  const double efficiency = searcher.sampled_efficiency();
+  return List::create(
+      Named("engine") = searcher.engine(),
+      Named("used") = brute_force ? "brute_force" : "tree",
+      Named("sampled_efficiency") =
+          std::isnan(efficiency) ? NA_REAL : efficiency);
+}
+
+//' Search engine
+//'
+//' How exact k nearest neighbor searches and range searches of an ATRIA
+//' searcher are done: by searching the tree, or by brute force, which
+//' computes the distances of blocks of query points to tiles of data points
+//' that fit into the cache. With engine 'auto', exact searches of the 10
+//' nearest neighbors of 32 data points are run on the tree before the first
+//' exact search (or by search_engine), and brute force is used if they
+//' compute the distances of more than half of the points, as the tree then
+//' costs more than it saves, e.g. for data of high intrinsic dimension.
+//' The sample searches stop after the distances of 55 percent of the points,
+//' so sampling costs less than 18 brute force searches. Both engines find the
+//' same neighbors. Approximate searches, counts of points and all_k_neighbors
+//' always use the tree.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @return A list with the engine setting ('auto', 'tree' or
+//'   'brute_force'), the engine used ('tree' or 'brute_force') and the
+//'   sampled efficiency of the tree (see search_efficiency), NA unless the
+//'   setting is 'auto'.
+//' @rdname search_engine
+//' @export
+//[[Rcpp::export]]
+List search_engine(XPtr<Searcher> searcher) {
+  return search_engine_list(*searcher);
+}
+
+//' Set search engine
+//'
+//' Choose how exact k nearest neighbor searches and range searches of an
+//' ATRIA searcher are done, see search_engine. With 'auto', the efficiency
+//' of the tree is sampled again, e.g. after points were inserted.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param engine 'auto', 'tree' or 'brute_force', Default: 'auto'
+//' @return The search engine of the searcher, see search_engine.
+//' @rdname set_search_engine
+//' @export
+//[[Rcpp::export]]
+List set_search_engine(XPtr<Searcher> searcher,
+                       const string engine = "auto") {
+  searcher->choose_engine(engine);
+  return search_engine_list(*searcher);
+}
+
+//' Phase timings
+//'
+//' Time spent in the phases of tree construction and of searches, summed
+//' per thread, to see whether a change in speed comes from the tree, the
+//' distance calculations or the copying of results to R. The phases are
+//' build_root (distances to the root center), build_centers (choice of the
+//' child centers), build_assign (assignment of points to the children),
+//' build_nodes (allocation of tree nodes), search_queue (priority queue and
+//' stack operations), search_centers (distances to the centers of internal
+//' nodes), search_leaves (scans of terminal nodes), search_results
+//' (conversion of the neighbors found) and convert_results (copying results
+//' to R objects). Timing is only compiled into the package if ATRIA_PROFILE
+//' is defined, see src/Makevars, since it slows down searches.
+//' @param reset If TRUE, the timings are reset to zero after they were read,
+//'   Default: FALSE
+//' @return A data frame with the columns thread, phase, calls and seconds
+//'   and one row for each phase timed on a thread. Threads are numbered
+//'   from 0, numbers of finished threads are reused. Without ATRIA_PROFILE
+//'   the data frame has no rows.
+//' @rdname phase_timings
+//' @export
+//[[Rcpp::export]]
+DataFrame phase_timings(const bool reset = false) {
+  profile_registry &registry = profile_registry::instance();
+  const double tps = profile_ticks_per_second();
+  std::vector<int> thread;
+  std::vector<std::string> phase;
+  std::vector<double> calls, seconds;
+  for (long s = 0; s < registry.number_of_slots(); s++) {
+    const profile_slot *const slot = registry.slot(s);
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+      if (slot->calls[p] == 0)
+        continue;
+      thread.push_back(s);
+      phase.push_back(profile_phase_name(p));
+      calls.push_back(slot->calls[p]);
+      seconds.push_back(slot->ticks[p] / tps);
+    }
+  }
+  if (reset)
+    registry.reset();
+  return DataFrame::create(Named("thread") = wrap(thread),
+                           Named("phase") = wrap(phase),
+                           Named("calls") = wrap(calls),
+                           Named("seconds") = wrap(seconds),
+                           Named("stringsAsFactors") = false);
+}
+
+//' Record a trace of phases
+//'
+//' Start recording every timed phase (see phase_timings) as an event, until
+//' the events are written by write_phase_trace. At most 2^20 events are
+//' recorded per thread.
+//' @return TRUE
+//' @rdname record_phase_trace
+//' @export
+//[[Rcpp::export]]
+bool record_phase_trace() {
+#ifdef ATRIA_PROFILE
+  profile_registry::instance().start_trace();
+  return true;
+#else
+  throw Rcpp::exception(
+      "Phase timing is not compiled in, define ATRIA_PROFILE in src/Makevars.");
+#endif
+}
+
+//' Write a trace of phases
+//'
+//' Stop recording events started by record_phase_trace and write them to a
+//' file in the Chrome trace event format, which can be viewed with
+//' chrome://tracing or Perfetto, one track per thread.
+//' @param path Name of the trace file.
+//' @return The number of events written.
+//' @rdname write_phase_trace
+//' @export
+//[[Rcpp::export]]
+long write_phase_trace(const string path) {
+  const long written = profile_registry::instance().write_trace(path);
+  if (written < 0) {
+    std::string exception_string = "Can not write trace file " + path + ".";
+    throw Rcpp::exception(exception_string.c_str());
+  }
+  return written;
+}
+
+//' Build a spill tree
+//'
+//' Build a spill tree for fast approximate k nearest neighbor searches with
+//' search_k_neighbors(..., defeatist = TRUE), e.g. in high dimensions where
+//' exact searches have to visit a large part of the search tree. The spill
+//' tree is divided into halves of equal size, and the points near the
+//' boundary between two children are stored in both of them. A defeatist
+//' search descends to a single terminal node without backtracking, so it
+//' finds neighbors on the other side of a boundary only if they were stored
+//' on both sides. The spill tree is discarded when points are inserted or
+//' deleted. Use spill_tree_recall to measure recall and speed.
+//'
+//' Each level of the spill tree stores up to 1 + overlap times the points of
+//' the level above, so an unbounded spill tree of N points would store about
+//' N * (1 + overlap)^depth points, with depth about
+//' log(N / max_points) / log(2 / (1 + overlap)), i.e. its size grows
+//' exponentially with the overlap. The spill tree stores at most
+//' max_duplication times the points of the searcher. Each node shares this
+//' budget with its children in proportion to their number of points, and
+//' uses a smaller overlap if its share does not suffice for the overlap on
+//' all levels below it. The overlap is thus reduced evenly across the tree,
+//' a larger overlap never gives a lower recall under the same budget.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param overlap Fraction of the points of each node of the spill tree,
+//'   the ones nearest to the boundary between its children, that are stored
+//'   in both children, 0 <= overlap < 1. More overlap gives a higher recall,
+//'   but a larger spill tree, Default: 0.1
+//' @param max_points Nodes of the spill tree with less than max_points
+//'   points are terminal nodes. A defeatist search computes the distances to
+//'   all points of one terminal node, so larger terminal nodes give a higher
+//'   recall at the cost of speed, Default: 1024
+//' @param threads Number of threads used to build the spill tree, the
+//'   resulting tree does not depend on it, Default: 1
+//' @param max_duplication Maximal number of points stored in the spill tree
+//'   relative to the number of points of the searcher, at least 1,
+//'   Default: 4
+//' @return A list with the number of nodes and the depth of the spill tree,
+//'   the mean depth and radius of its terminal nodes (weighted by their
+//'   number of points) and the duplication, the number of points stored in
+//'   the spill tree relative to the number of points of the searcher.
+//' @rdname build_spill_tree
+//' @export
+//[[Rcpp::export]]
+List build_spill_tree(XPtr<Searcher> searcher, const double overlap = 0.1,
+                      const long max_points = 1024, const int threads = 1,
+                      const double max_duplication = 4) {
+  if (!(overlap >= 0) || (overlap >= 1)) {
+    throw Rcpp::exception("Overlap must be at least 0 and less than 1.");
+  }
+  if (max_points <= 0) {
+    throw Rcpp::exception("Maximal number of points must be positive.");
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  if (!(max_duplication >= 1)) {
+    throw Rcpp::exception("Maximal duplication must be at least 1.");
+  }
+  searcher->build_spill_tree(overlap, max_points, threads, max_duplication);
+  const tree_shape st = searcher->spill_statistics();
+  return List::create(Named("nodes") = st.nodes, Named("depth") = st.depth,
+                      Named("mean_leaf_depth") = st.mean_leaf_depth,
+                      Named("mean_leaf_radius") = st.mean_leaf_radius,
+                      Named("duplication") = searcher->spill_duplication());
+}
+
 //' Number of points,
 //'
 //' Return number of points used to create the searcher.
@@ -107,6 +705,45 @@ double data_set_radius(XPtr<Searcher> searcher) {
   return searcher->data_set_radius();
 }
 
+// Limits of approximate k nearest neighbor searches from the arguments of the
+// search functions below.
+static search_limits approximation(const Searcher &searcher,
+                                   const double epsilon,
+                                   const bool median_pruning,
+                                   const long max_distances,
+                                   const long max_terminal_nodes,
+                                   const bool defeatist) {
+  if ((max_distances < 0) || (max_terminal_nodes < 0)) {
+    throw Rcpp::exception("Search budgets can not be negative.");
+  }
+  if (defeatist && !searcher.has_spill_tree()) {
+    throw Rcpp::exception(
+        "Defeatist searches need a spill tree, see build_spill_tree.");
+  }
+  search_limits limits(epsilon);
+  limits.median_pruning = median_pruning;
+  limits.max_distances = max_distances;
+  limits.max_terminal_nodes = max_terminal_nodes;
+  limits.defeatist = defeatist;
+  return limits;
+}
+
+// The per-query statistics written by batch_k_neighbors as a data frame.
+static DataFrame query_statistics_frame(NumericMatrix stats) {
+  const long nq = stats.nrow();
+  NumericVector distances(nq), terminal_nodes(nq), queue_pushes(nq),
+      radius(nq);
+  for (long n = 0; n < nq; n++) {
+    distances[n] = stats(n, 0);
+    terminal_nodes[n] = stats(n, 1);
+    queue_pushes[n] = stats(n, 2);
+    radius[n] = (stats(n, 3) == DBL_MAX) ? R_PosInf : stats(n, 3);
+  }
+  return DataFrame::create(Named("distances") = distances,
+                           Named("terminal_nodes") = terminal_nodes,
+                           Named("queue_pushes") = queue_pushes,
+                           Named("radius") = radius);
+}
 
 //' @title FUNCTION_TITLE
 //' @description FUNCTION_DESCRIPTION
@@ -115,6 +752,25 @@ double data_set_radius(XPtr<Searcher> searcher) {
 //' @param query_points PARAM_DESCRIPTION
 //' @param exclude PARAM_DESCRIPTION, Default: matrix()
 //' @param epsilon PARAM_DESCRIPTION, Default: 0
+//' @param threads Number of threads used to search the query points in
+//'   parallel, Default: 1
+//' @param median_pruning If TRUE, parts of the search tree are skipped when
+//'   the ball around their center that holds half of their points is farther
+//'   away than the k-th neighbor found so far. Faster, but some neighbors may
+//'   be missed, Default: FALSE
+//' @param max_distances Maximal number of distance calculations per query
+//'   point, the best neighbors found when it is reached are returned, 0
+//'   means no limit, Default: 0
+//' @param max_terminal_nodes Maximal number of terminal nodes of the search
+//'   tree searched per query point, 0 means no limit, Default: 0
+//' @param defeatist If TRUE, the spill tree built by build_spill_tree is
+//'   searched without backtracking, which is much faster but may miss
+//'   neighbors. The other limits are then ignored, Default: FALSE
+//' @param stats If TRUE, the result has a third element stats, a data
+//'   frame with the number of distances computed, of terminal nodes
+//'   searched and of search items queued for each query point and the final
+//'   pruning radius, the distance of the k-th neighbor (Inf if less than k
+//'   neighbors were found), Default: FALSE
 //' @return OUTPUT_DESCRIPTION
 //' @details DETAILS
 //' @examples
@@ -129,10 +785,25 @@ double data_set_radius(XPtr<Searcher> searcher) {
 List search_k_neighbors(XPtr<Searcher> searcher, const long k,
                         NumericMatrix query_points,
                         IntegerMatrix exclude = IntegerMatrix(),
-                        const double epsilon = 0) {
+                        const double epsilon = 0,
+                        const int threads = 1,
+                        const bool median_pruning = false,
+                        const long max_distances = 0,
+                        const long max_terminal_nodes = 0,
+                        const bool defeatist = false,
+                        const bool stats = false) {
   if (k <= 0) {
     throw Rcpp::exception("Number of neighbors must be positive.");
   }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  if (query_points.ncol() != searcher->dimension()) {
+    std::string exception_string =
+        "Wrong dimension of query points, expected " +
+        std::to_string(searcher->dimension()) + " columns";
+    throw Rcpp::exception(exception_string.c_str());
+  }
   bool use_exclude = false;
   if ((exclude.nrow() > 1) || (exclude.ncol() > 1)) {
     if ((exclude.nrow() != query_points.nrow()) || (exclude.ncol() != 2)) {
@@ -145,27 +816,151 @@ List search_k_neighbors(XPtr<Searcher> searcher, const long k,
   }
   IntegerMatrix index(query_points.nrow(), k);
   NumericMatrix dist(query_points.nrow(), k);
+  NumericMatrix query_stats(stats ? query_points.nrow() : 0, 4);
 
-  for (long n = 0; n < query_points.nrow(); n++) {
-    vector<neighbor> v;
-    const auto query_point = query_points(n, Rcpp::_);
-    // Search for neighbors.
-    long first = -1;
-    long last = -1;
-    if (use_exclude) {
-      // Convert exclude from one-based to zero-based indexing.
-      // Include neighbor if index < first || index > last
-      first = exclude(n, 0) - 1;
-      last = exclude(n, 1) - 1;
-    }
-    searcher->search_k_neighbors(v, k, query_point.begin(), first, last,
-                                 epsilon);
-    for (long d = 0; d < k; d++) {
-      index(n, d) = v[d].index() + 1; // Convert back to one-based indexing.
-      dist(n, d) = v[d].dist();
+  // The batch search works on the raw column-major data of the matrices, so
+  // that no R API function is called from the worker threads.
+  searcher->search_k_neighbors(query_points.begin(), query_points.nrow(),
+                               query_points.ncol(), k,
+                               use_exclude ? exclude.begin() : nullptr,
+                               approximation(*searcher, epsilon, median_pruning,
+                                             max_distances, max_terminal_nodes,
+                                             defeatist),
+                               threads, index.begin(), dist.begin(),
+                               stats ? query_stats.begin() : nullptr);
+  // Returns an IntegerMatrix and a NumericMatrix
+  if (stats) {
+    return List::create(Named("index") = index, Named("dist") = dist,
+                        Named("stats") = query_statistics_frame(query_stats));
+  }
+  return List::create(Named("index") = index, Named("dist") = dist);
+}
+
+//' All k nearest neighbors
+//'
+//' Search the k nearest neighbors of every point of the data set the searcher
+//' was created with. This is faster than passing the data set as query points
+//' to search_k_neighbors, since nearby points share the traversal of the
+//' search tree and no query matrix has to be copied.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param k Number of neighbors.
+//' @param theiler_window Neighbors whose indices differ by at most
+//'   theiler_window from the index of the point are excluded, the point
+//'   itself is always excluded, Default: 0
+//' @param threads Number of threads used for the search, Default: 1
+//' @return A list with the number_of_points(searcher) by k matrices index
+//'   and dist of the neighbors of every point, sorted by distance.
+//' @rdname all_k_neighbors
+//' @export
+//[[Rcpp::export]]
+List all_k_neighbors(XPtr<Searcher> searcher, const long k,
+                     const long theiler_window = 0, const int threads = 1) {
+  if (k <= 0) {
+    throw Rcpp::exception("Number of neighbors must be positive.");
+  }
+  if (theiler_window < 0) {
+    throw Rcpp::exception("Theiler window can not be negative.");
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  IntegerMatrix index(searcher->number_of_points(), k);
+  NumericMatrix dist(searcher->number_of_points(), k);
+
+  searcher->all_k_neighbors(k, theiler_window, threads, index.begin(),
+                            dist.begin());
+  return List::create(Named("index") = index, Named("dist") = dist);
+}
+
+//' k nearest neighbors of data points
+//'
+//' Search the k nearest neighbors of the data points of a searcher with the
+//' given indices, e.g. the delay vectors at some time indices of a searcher
+//' created by create_embedding_searcher. Neighbors whose indices differ by at
+//' most theiler_window from the index of the query point are excluded, so
+//' the query point itself is never found. The result is the same as passing
+//' the rows of the data set to search_k_neighbors, but the query points do
+//' not have to be built in R.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param k Number of neighbors.
+//' @param indices The indices of the query points in the data set.
+//' @param theiler_window Neighbors whose indices differ by at most
+//'   theiler_window from the index of the query point are excluded,
+//'   Default: 0
+//' @param epsilon Relative error of approximate searches, Default: 0
+//' @param threads Number of threads used to search the query points in
+//'   parallel, Default: 1
+//' @param median_pruning If TRUE, parts of the search tree are skipped when
+//'   the ball around their center that holds half of their points is farther
+//'   away than the k-th neighbor found so far. Faster, but some neighbors may
+//'   be missed, Default: FALSE
+//' @param max_distances Maximal number of distance calculations per query
+//'   point, the best neighbors found when it is reached are returned, 0
+//'   means no limit, Default: 0
+//' @param max_terminal_nodes Maximal number of terminal nodes of the search
+//'   tree searched per query point, 0 means no limit, Default: 0
+//' @param defeatist If TRUE, the spill tree built by build_spill_tree is
+//'   searched without backtracking, which is much faster but may miss
+//'   neighbors. The other limits are then ignored, Default: FALSE
+//' @param stats If TRUE, the result has a third element stats, a data
+//'   frame with the number of distances computed, of terminal nodes
+//'   searched and of search items queued for each query point and the final
+//'   pruning radius, the distance of the k-th neighbor (Inf if less than k
+//'   neighbors were found), Default: FALSE
+//' @return A list with the length(indices) by k matrices index and dist of
+//'   the neighbors of every query point, sorted by distance.
+//' @rdname search_k_neighbors_at
+//' @export
+//[[Rcpp::export]]
+List search_k_neighbors_at(XPtr<Searcher> searcher, const long k,
+                           IntegerVector indices,
+                           const long theiler_window = 0,
+                           const double epsilon = 0, const int threads = 1,
+                           const bool median_pruning = false,
+                           const long max_distances = 0,
+                           const long max_terminal_nodes = 0,
+                           const bool defeatist = false,
+                           const bool stats = false) {
+  if (k <= 0) {
+    throw Rcpp::exception("Number of neighbors must be positive.");
+  }
+  if (theiler_window < 0) {
+    throw Rcpp::exception("Theiler window can not be negative.");
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  const long N = searcher->number_of_points();
+  const long nq = indices.size();
+  std::vector<long> zero_based(nq);
+  IntegerMatrix exclude(nq, 2);
+  for (long n = 0; n < nq; n++) {
+    if ((indices[n] == NA_INTEGER) || (indices[n] < 1) || (indices[n] > N)) {
+      std::string exception_string =
+          "Indices must be between 1 and " + std::to_string(N);
+      throw Rcpp::exception(exception_string.c_str());
     }
+    zero_based[n] = indices[n] - 1;
+    exclude(n, 0) = indices[n] - theiler_window;
+    exclude(n, 1) = indices[n] + theiler_window;
+  }
+  NumericMatrix query_points(nq, searcher->dimension());
+  searcher->copy_points(zero_based.data(), nq, query_points.begin());
+
+  IntegerMatrix index(nq, k);
+  NumericMatrix dist(nq, k);
+  NumericMatrix query_stats(stats ? nq : 0, 4);
+  searcher->search_k_neighbors(query_points.begin(), nq, query_points.ncol(),
+                               k, exclude.begin(),
+                               approximation(*searcher, epsilon, median_pruning,
+                                             max_distances, max_terminal_nodes,
+                                             defeatist),
+                               threads, index.begin(), dist.begin(),
+                               stats ? query_stats.begin() : nullptr);
+  if (stats) {
+    return List::create(Named("index") = index, Named("dist") = dist,
+                        Named("stats") = query_statistics_frame(query_stats));
   }
-  // Returns an IntegerMatrix and a NumericMatrix
   return List::create(Named("index") = index, Named("dist") = dist);
 }
 
@@ -192,6 +987,12 @@ List search_range(XPtr<Searcher> searcher, const double radius,
   if (radius < 0) {
     throw Rcpp::exception("Radius can not be negative.");
   }
+  if (query_points.ncol() != searcher->dimension()) {
+    std::string exception_string =
+        "Wrong dimension of query points, expected " +
+        std::to_string(searcher->dimension()) + " columns";
+    throw Rcpp::exception(exception_string.c_str());
+  }
   bool use_exclude = false;
   if ((exclude.nrow() > 1) || (exclude.ncol() > 1)) {
     if ((exclude.nrow() != query_points.nrow()) || (exclude.ncol() != 2)) {
@@ -207,9 +1008,12 @@ List search_range(XPtr<Searcher> searcher, const double radius,
   IntegerVector count(query_points.nrow());
   List nn(query_points.nrow());
 
+  vector<double> query_point(query_points.ncol());
   for (long n = 0; n < query_points.nrow(); n++) {
     vector<neighbor> v;
-    const auto query_point = query_points(n, Rcpp::_);
+    // Copy the query point to contiguous memory for the distance kernels.
+    const auto row = query_points(n, Rcpp::_);
+    std::copy(row.begin(), row.end(), query_point.begin());
     long first = -1;
     long last = -1;
     if (use_exclude) {
@@ -218,7 +1022,9 @@ List search_range(XPtr<Searcher> searcher, const double radius,
       last = exclude(n, 1) - 1;
     }
     // Search for neighbors.
-    searcher->search_range(v, radius, query_point.begin(), first, last);
+    const double *const qp = query_point.data();
+    searcher->search_range(v, radius, qp, first, last);
+    PROFILE_SCOPE(phase_convert_results);
     count(n) = v.size();
     IntegerVector index(v.size());
     NumericVector dist(v.size());
@@ -231,3 +1037,210 @@ List search_range(XPtr<Searcher> searcher, const double radius,
   // Returns an IntegerMatrix and a NumericMatrix
   return List::create(Named("count") = count, Named("nn") = nn);
 }
+
+//' Count points within several radii
+//'
+//' Count the number of data points within each of several radii around each
+//' query point. The search tree is traversed only once per query point, with
+//' the largest radius, and the distances found are sorted into bins. This is
+//' much faster and needs much less memory than calling search_range for each
+//' radius.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param radii A vector of non-negative radii in ascending order.
+//' @param query_points A matrix with one query point per row.
+//' @param exclude A matrix with two columns, row i gives the first and last
+//'   index of data points that are not counted for query point i,
+//'   Default: matrix()
+//' @param threads Number of threads used to search the query points in
+//'   parallel, Default: 1
+//' @return An integer matrix with one row per query point and one column per
+//'   radius, giving the number of data points within distance radii[j] of
+//'   query point i.
+//' @rdname count_range_multi
+//' @export
+//[[Rcpp::export]]
+IntegerMatrix count_range_multi(XPtr<Searcher> searcher, NumericVector radii,
+                                NumericMatrix query_points,
+                                IntegerMatrix exclude = IntegerMatrix(),
+                                const int threads = 1) {
+  if (radii.size() == 0) {
+    throw Rcpp::exception("At least one radius must be given.");
+  }
+  if (radii[0] < 0) {
+    throw Rcpp::exception("Radius can not be negative.");
+  }
+  for (long b = 1; b < radii.size(); b++) {
+    if (radii[b] < radii[b - 1]) {
+      throw Rcpp::exception("Radii must be in ascending order.");
+    }
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  if (query_points.ncol() != searcher->dimension()) {
+    std::string exception_string =
+        "Wrong dimension of query points, expected " +
+        std::to_string(searcher->dimension()) + " columns";
+    throw Rcpp::exception(exception_string.c_str());
+  }
+  bool use_exclude = false;
+  if ((exclude.nrow() > 1) || (exclude.ncol() > 1)) {
+    if ((exclude.nrow() != query_points.nrow()) || (exclude.ncol() != 2)) {
+      std::string exception_string =
+          "Wrong dimensions for input argument exclude, expected " +
+          std::to_string(query_points.nrow()) + " by 2";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    use_exclude = true;
+  }
+  IntegerMatrix counts(query_points.nrow(), radii.size());
+
+  searcher->count_range_multi(query_points.begin(), query_points.nrow(),
+                              query_points.ncol(), radii.begin(),
+                              radii.size(),
+                              use_exclude ? exclude.begin() : nullptr,
+                              threads, counts.begin());
+  return counts;
+}
+
+//' Count pairs of points within several radii
+//'
+//' Count the pairs of data points within each of several radii, as needed
+//' for correlation sums. The search tree is traversed as a pair of trees:
+//' whenever the distance between the centers of two clusters and the radii of
+//' the clusters show that all their pairs of points are within (or beyond) a
+//' radius, the pairs are counted at once without computing their distances.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param radii A vector of non-negative radii in ascending order.
+//' @param theiler_window Pairs of points whose indices differ by at most
+//'   theiler_window are not counted, Default: 0
+//' @param sample Indices of data points to use, only pairs of these points
+//'   are counted. All points are used if sample is empty, Default: integer(0)
+//' @param threads Number of threads used for counting, Default: 1
+//' @return A list with the number of pairs within distance radii[j] in
+//'   element count and the total number of pairs considered (i.e. not
+//'   excluded by theiler_window or sample) in element pairs. Both are stored
+//'   as doubles, as they may exceed the range of integers.
+//' @rdname count_pairs
+//' @export
+//[[Rcpp::export]]
+List count_pairs(XPtr<Searcher> searcher, NumericVector radii,
+                 const long theiler_window = 0,
+                 IntegerVector sample = IntegerVector(),
+                 const int threads = 1) {
+  if (radii.size() == 0) {
+    throw Rcpp::exception("At least one radius must be given.");
+  }
+  if (radii[0] < 0) {
+    throw Rcpp::exception("Radius can not be negative.");
+  }
+  for (long b = 1; b < radii.size(); b++) {
+    if (radii[b] < radii[b - 1]) {
+      throw Rcpp::exception("Radii must be in ascending order.");
+    }
+  }
+  if (theiler_window < 0) {
+    throw Rcpp::exception("Theiler window can not be negative.");
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+  const long N = searcher->number_of_points();
+  std::vector<char> sampled;
+  if (sample.size() > 0) {
+    sampled.assign(N, 0);
+    for (long i = 0; i < sample.size(); i++) {
+      if ((sample[i] == NA_INTEGER) || (sample[i] < 1) || (sample[i] > N)) {
+        std::string exception_string =
+            "Sample indices must be between 1 and " + std::to_string(N);
+        throw Rcpp::exception(exception_string.c_str());
+      }
+      sampled[sample[i] - 1] = 1;
+    }
+  }
+  std::vector<uint64_t> counts(radii.size());
+  const uint64_t pairs = searcher->count_pairs(
+      radii.begin(), radii.size(), theiler_window,
+      sampled.empty() ? nullptr : sampled.data(), threads, counts.data());
+  return List::create(Named("count") = NumericVector(counts.begin(),
+                                                     counts.end()),
+                      Named("pairs") = (double)pairs);
+}
+
+//' Adaptive correlation sum estimate
+//'
+//' The engine behind corrsum. Starting at the largest distance, random
+//' batches of query points are counted at all distances up to the current
+//' one, until the statistics at the current distance is good enough or the
+//' maximum number of query points is reached, then the next smaller distance
+//' is processed.
+//' @param searcher An external pointer to an ATRIA searcher.
+//' @param data The data set of the searcher, one point per row.
+//' @param dist_breaks A vector of positive distances in ascending order.
+//' @param min_actual_pairs Minimum number of pairs within each distance,
+//'   Default: 2000
+//' @param min_nr_samples_at_scale Minimum number of query points used at
+//'   each distance, Default: 128
+//' @param max_nr_samples_at_scale Maximum number of query points used at
+//'   each distance, Default: 1024
+//' @param batch_size Number of query points counted at once, Default: 32
+//' @param threads Number of threads used to count the query points of a
+//'   batch in parallel, Default: 1
+//' @param verbose Print the pair counts of every batch, Default: FALSE
+//' @return A list as returned by corrsum.
+//' @rdname corrsum_engine
+//' @export
+//[[Rcpp::export]]
+List corrsum_engine(XPtr<Searcher> searcher, NumericMatrix data,
+                    NumericVector dist_breaks,
+                    const double min_actual_pairs = 2000,
+                    const long min_nr_samples_at_scale = 128,
+                    const long max_nr_samples_at_scale = 1024,
+                    const long batch_size = 32, const int threads = 1,
+                    const bool verbose = false) {
+  if (data.ncol() != searcher->dimension()) {
+    std::string exception_string =
+        "Wrong dimension of data, expected " +
+        std::to_string(searcher->dimension()) + " columns";
+    throw Rcpp::exception(exception_string.c_str());
+  }
+  for (long b = 0; b < dist_breaks.size(); b++) {
+    if ((dist_breaks[b] < 0) ||
+        ((b > 0) && (dist_breaks[b] < dist_breaks[b - 1]))) {
+      throw Rcpp::exception(
+          "Distances must be non-negative and in ascending order.");
+    }
+  }
+  if ((batch_size <= 0) || (batch_size > data.nrow())) {
+    std::string exception_string = "Batch size must be between 1 and " +
+                                   std::to_string(data.nrow());
+    throw Rcpp::exception(exception_string.c_str());
+  }
+  if (threads <= 0) {
+    throw Rcpp::exception("Number of threads must be positive.");
+  }
+
+  std::vector<double> dists(dist_breaks.size() + 1, 0);
+  std::copy(dist_breaks.begin(), dist_breaks.end(), dists.begin() + 1);
+  const corrsum_parameters param = {min_actual_pairs, min_nr_samples_at_scale,
+                                    max_nr_samples_at_scale, batch_size,
+                                    threads, verbose};
+  corrsum_result result;
+  estimate_corrsum(*searcher, data, dists, param, result);
+
+  NumericVector correlation_sum(dists.size());
+  double sum = 0;
+  for (size_t b = 0; b < dists.size(); b++) {
+    sum += result.actual_pairs[b] / result.potential_pairs[b];
+    correlation_sum[b] = sum;
+  }
+  return List::create(
+      Named("dists") = NumericVector(dists.begin(), dists.end()),
+      Named("correlation.sum") = correlation_sum,
+      Named("actual.pairs.count") = NumericVector(
+          result.actual_pairs.begin(), result.actual_pairs.end()),
+      Named("potential.pairs.count") = NumericVector(
+          result.potential_pairs.begin(), result.potential_pairs.end()),
+      Named("samples.used") = NumericVector(result.samples_used.begin(),
+                                            result.samples_used.end()));
+}
@@ -7,170 +7,1314 @@
 #include "NNSearcher/metric.h"
 #include "NNSearcher/nearneigh_search.h"
 #include "NNSearcher/point_set.h"
+#include "NNSearcher/parallel.h"
 #undef PARTIAL_SEARCH
 #undef VERBOSE
 
 #include <Rcpp.h>
+#include <chrono>
+#include <memory>
+
+// Search the k nearest neighbors for each row of the column-major matrix
+// query_points (nq rows of dimension dim) on up to 'threads' threads. Each
+// worker thread uses its own search context and a contiguous copy of the
+// current query row, the tree of the searcher is shared read-only. If exclude
+// is not null, it is a column-major nq by 2 matrix of one-based index ranges
+// that are excluded from the search of the corresponding query. Results are
+// written to the column-major nq by k matrices index (one-based) and dist.
+// If stats is not null, the statistics of each query (see query_statistics)
+// are written to its columns, a column-major nq by 4 matrix.
+// No R API function must be called in here as it runs on worker threads.
+template <class SEARCHER>
+void batch_k_neighbors(SEARCHER *searcher, const double *query_points,
+                       const long nq, const long dim, const long k,
+                       const int *exclude, const search_limits &limits,
+                       const int threads, int *index, double *dist,
+                       double *stats = nullptr) {
+  const int nthreads = (threads < 1) ? 1 : threads;
+  vector<search_context> contexts(nthreads);
+  vector<vector<double>> buffers(nthreads, vector<double>(dim));
+  vector<vector<neighbor>> results(nthreads);
+
+  parallel_for(nq, nthreads, [&](const int t, const long n) {
+    vector<double> &query_point = buffers[t];
+    for (long d = 0; d < dim; d++)
+      query_point[d] = query_points[n + d * nq];
+    long first = -1;
+    long last = -1;
+    if (exclude != nullptr) {
+      // Convert exclude from one-based to zero-based indexing.
+      // Include neighbor if index < first || index > last
+      first = exclude[n] - 1;
+      last = exclude[n + nq] - 1;
+    }
+    vector<neighbor> &v = results[t];
+    v.clear();
+    // Pass a plain pointer, so the vectorized distance kernels are used.
+    const double *const qp = query_point.data();
+    searcher->search_k_neighbors(contexts[t], v, k, qp, first, last, limits);
+    PROFILE_SCOPE(phase_convert_results);
+    for (long d = 0; d < k; d++) {
+      if (d < (long)v.size()) {
+        index[n + d * nq] = v[d].index() + 1; // Convert back to one-based indexing.
+        dist[n + d * nq] = v[d].dist();
+      } else { // Less than k points available.
+        index[n + d * nq] = NA_INTEGER;
+        dist[n + d * nq] = NA_REAL;
+      }
+    }
+    if (stats != nullptr) {
+      const query_statistics &q = contexts[t].last_query;
+      stats[n] = q.distances;
+      stats[n + nq] = q.terminal_nodes;
+      stats[n + 2 * nq] = q.queue_pushes;
+      stats[n + 3 * nq] = q.radius;
+    }
+  });
+
+  for (const auto &ctx : contexts)
+    searcher->merge_statistics(ctx);
+}
+
+// Brute force version of batch_k_neighbors with the same arguments. Each
+// task searches a block of ATRIA_BRUTE_FORCE_QUERIES query points at once,
+// see ATRIA::brute_force_k_neighbors, so the points of the data set are read
+// from memory once per block instead of once per query point.
+// No R API function must be called in here as it runs on worker threads.
+template <class SEARCHER>
+void batch_brute_force_k_neighbors(SEARCHER *searcher,
+                                   const double *query_points, const long nq,
+                                   const long dim, const long k,
+                                   const int *exclude, const int threads,
+                                   int *index, double *dist,
+                                   double *stats = nullptr) {
+  const int nthreads = (threads < 1) ? 1 : threads;
+  const long block = ATRIA_BRUTE_FORCE_QUERIES;
+  const long nblocks = (nq + block - 1) / block;
+  vector<search_context> contexts(nthreads);
+  vector<vector<double>> buffers(nthreads, vector<double>(block * dim));
+  vector<vector<vector<neighbor>>> results(nthreads,
+                                           vector<vector<neighbor>>(block));
+  vector<vector<query_statistics>> query_stats(
+      nthreads, vector<query_statistics>(block));
+
+  parallel_for(nblocks, nthreads, [&](const int t, const long b) {
+    const long n0 = b * block;
+    const long m = min(block, nq - n0);
+    const double *qp[ATRIA_BRUTE_FORCE_QUERIES];
+    long first[ATRIA_BRUTE_FORCE_QUERIES];
+    long last[ATRIA_BRUTE_FORCE_QUERIES];
+    for (long i = 0; i < m; i++) {
+      const long n = n0 + i;
+      double *const query_point = buffers[t].data() + i * dim;
+      for (long d = 0; d < dim; d++)
+        query_point[d] = query_points[n + d * nq];
+      qp[i] = query_point;
+      first[i] = (exclude != nullptr) ? exclude[n] - 1 : -1;
+      last[i] = (exclude != nullptr) ? exclude[n + nq] - 1 : -1;
+      results[t][i].clear();
+    }
+    searcher->brute_force_k_neighbors(contexts[t], results[t].data(), k, qp,
+                                      m, first, last, query_stats[t].data());
+    PROFILE_SCOPE(phase_convert_results);
+    for (long i = 0; i < m; i++) {
+      const long n = n0 + i;
+      const vector<neighbor> &v = results[t][i];
+      for (long d = 0; d < k; d++) {
+        if (d < (long)v.size()) {
+          index[n + d * nq] = v[d].index() + 1; // one-based indexing
+          dist[n + d * nq] = v[d].dist();
+        } else { // Less than k points available.
+          index[n + d * nq] = NA_INTEGER;
+          dist[n + d * nq] = NA_REAL;
+        }
+      }
+      if (stats != nullptr) {
+        const query_statistics &q = query_stats[t][i];
+        stats[n] = q.distances;
+        stats[n + nq] = q.terminal_nodes;
+        stats[n + 2 * nq] = q.queue_pushes;
+        stats[n + 3 * nq] = q.radius;
+      }
+    }
+  }, 1);
+
+  for (const auto &ctx : contexts)
+    searcher->merge_statistics(ctx);
+}
+
+// Count the points within each of the nr ascending radii around each row of
+// the column-major matrix query_points (nq rows of dimension dim) on up to
+// 'threads' threads. exclude is as for batch_k_neighbors. The cumulative
+// counts are written to the column-major nq by nr matrix counts.
+// No R API function must be called in here as it runs on worker threads.
+template <class SEARCHER>
+void batch_count_range_multi(SEARCHER *searcher, const double *query_points,
+                             const long nq, const long dim,
+                             const double *radii, const long nr,
+                             const int *exclude, const int threads,
+                             int *counts) {
+  const int nthreads = (threads < 1) ? 1 : threads;
+  const radius_bins bins(radii, nr);
+  vector<search_context> contexts(nthreads);
+  vector<vector<double>> buffers(nthreads, vector<double>(dim));
+  vector<vector<long>> results(nthreads, vector<long>(nr));
+  // Small batches, like the ones of corrsum, are spread over all threads.
+  const long chunk = max(1L, min(16L, nq / (4L * nthreads)));
+
+  parallel_for(nq, nthreads, [&](const int t, const long n) {
+    vector<double> &query_point = buffers[t];
+    for (long d = 0; d < dim; d++)
+      query_point[d] = query_points[n + d * nq];
+    long first = -1;
+    long last = -1;
+    if (exclude != nullptr) {
+      first = exclude[n] - 1;
+      last = exclude[n + nq] - 1;
+    }
+    const double *const qp = query_point.data();
+    searcher->count_range_multi(contexts[t], bins, qp, first, last,
+                                results[t].data());
+    for (long b = 0; b < nr; b++)
+      counts[n + b * nq] = results[t][b];
+  }, chunk);
+
+  for (const auto &ctx : contexts)
+    searcher->merge_statistics(ctx);
+}
+
+// C++ does not support virtual member templates, so the searchers for all
+// combinations of metric and point storage are accessed through an interface
+// that takes query points as plain arrays of doubles. The class Searcher
+// below picks the implementation when it is constructed.
+class searcher_interface {
+public:
+  virtual ~searcher_interface(){};
+
+  virtual long search_k_neighbors(vector<neighbor> &v, const long k,
+                                  const double *query_point, const long first,
+                                  const long last,
+                                  const search_limits &limits) = 0;
+  virtual void search_k_neighbors(const double *query_points, const long nq,
+                                  const long dim, const long k,
+                                  const int *exclude,
+                                  const search_limits &limits,
+                                  const int threads, int *index,
+                                  double *dist, double *stats) = 0;
+  virtual void all_k_neighbors(const long k, const long theiler_window,
+                               const int threads, int *index,
+                               double *dist) = 0;
+  virtual long count_range(const double radius, const double *query_point,
+                           const long first, const long last) = 0;
+  virtual void count_range_multi(const double *query_points, const long nq,
+                                 const long dim, const double *radii,
+                                 const long nr, const int *exclude,
+                                 const int threads, int *counts) = 0;
+  virtual uint64_t count_pairs(const double *radii, const long nr,
+                               const long theiler_window, const char *sampled,
+                               const int threads, uint64_t *counts) = 0;
+  virtual long search_range(vector<neighbor> &v, const double radius,
+                            const double *query_point, const long first,
+                            const long last) = 0;
+  virtual long brute_force_k_neighbors(vector<neighbor> &v, const long k,
+                                       const double *query_point,
+                                       const long first, const long last) = 0;
+  virtual void brute_force_k_neighbors(const double *query_points,
+                                       const long nq, const long dim,
+                                       const long k, const int *exclude,
+                                       const int threads, int *index,
+                                       double *dist, double *stats) = 0;
+  virtual long brute_force_range(vector<neighbor> &v, const double radius,
+                                 const double *query_point, const long first,
+                                 const long last) = 0;
+  virtual double sampled_efficiency(const long nq, const long k,
+                                    const double budget) = 0;
+  virtual long insert_points(const double *x, const long n, const int threads,
+                             const double rebuild_threshold) = 0;
+  virtual long delete_points(const long *indices, const long n,
+                             const int threads,
+                             const double rebuild_threshold) = 0;
+  virtual double tree_drift() const = 0;
+  virtual tree_shape statistics() const = 0;
+  virtual search_counters search_statistics() const = 0;
+  virtual void reset_statistics() = 0;
+  virtual double search_efficiency() const = 0;
+  virtual bool build_spill_tree(const double overlap, const long max_points,
+                                const int threads,
+                                const double max_duplication) = 0;
+  virtual bool has_spill_tree() const = 0;
+  virtual tree_shape spill_statistics() const = 0;
+  virtual double spill_duplication() const = 0;
+  virtual void copy_points(const long *indices, const long n,
+                           double *x) const = 0;
+  virtual long number_of_deleted_points() const = 0;
+  virtual double data_set_radius() const = 0;
+  virtual long total_tree_nodes() const = 0;
+  virtual long dimension() const = 0;
+  virtual long number_of_points() const = 0;
+  virtual bool save(const std::string &path,
+                    const std::string &metric) const = 0;
+  virtual int geterr() const = 0;
+};
+
+// Implementation of searcher_interface by an ATRIA searcher on a POINT_SET.
+template <class POINT_SET> class atria_searcher : public searcher_interface {
+private:
+  ATRIA<POINT_SET> atria;
+
+public:
+  atria_searcher(POINT_SET &&points, const long excl, const long minpts,
+                 const uint32 seed, const int threads, const bool reorder,
+                 const split_strategy split)
+      : atria(std::move(points), excl, minpts, seed, threads, reorder,
+              split){};
+  atria_searcher(POINT_SET &&points,
+                 const std::shared_ptr<const mapped_file> &file)
+      : atria(std::move(points), file){};
+
+  long search_k_neighbors(vector<neighbor> &v, const long k,
+                          const double *query_point, const long first,
+                          const long last, const search_limits &limits) {
+    atria.finish_rebuild(false);
+    return atria.search_k_neighbors(v, k, query_point, first, last, limits);
+  }
+  void search_k_neighbors(const double *query_points, const long nq,
+                          const long dim, const long k, const int *exclude,
+                          const search_limits &limits, const int threads,
+                          int *index, double *dist, double *stats) {
+    atria.finish_rebuild(false);
+    batch_k_neighbors(&atria, query_points, nq, dim, k, exclude, limits,
+                      threads, index, dist, stats);
+  }
+  void all_k_neighbors(const long k, const long theiler_window,
+                       const int threads, int *index, double *dist) {
+    atria.finish_rebuild(false);
+    const long N = atria.number_of_points();
+    // Deleted points have no neighbors.
+    for (long n = 0; n < N; n++) {
+      if (!atria.is_deleted(n))
+        continue;
+      for (long d = 0; d < k; d++) {
+        index[n + d * N] = NA_INTEGER;
+        dist[n + d * N] = NA_REAL;
+      }
+    }
+    atria.all_k_neighbors(
+        k, theiler_window, threads,
+        [&](const int, const long n, const vector<neighbor> &v) {
+          for (long d = 0; d < k; d++) {
+            if (d < (long)v.size()) {
+              index[n + d * N] = v[d].index() + 1; // one-based indexing
+              dist[n + d * N] = v[d].dist();
+            } else { // Less than k points available.
+              index[n + d * N] = NA_INTEGER;
+              dist[n + d * N] = NA_REAL;
+            }
+          }
+        });
+  }
+  long count_range(const double radius, const double *query_point,
+                   const long first, const long last) {
+    atria.finish_rebuild(false);
+    return atria.count_range(radius, query_point, first, last);
+  }
+  void count_range_multi(const double *query_points, const long nq,
+                         const long dim, const double *radii, const long nr,
+                         const int *exclude, const int threads, int *counts) {
+    atria.finish_rebuild(false);
+    batch_count_range_multi(&atria, query_points, nq, dim, radii, nr, exclude,
+                            threads, counts);
+  }
+  uint64_t count_pairs(const double *radii, const long nr,
+                       const long theiler_window, const char *sampled,
+                       const int threads, uint64_t *counts) {
+    atria.finish_rebuild(false);
+    return atria.count_pairs(radius_bins(radii, nr), theiler_window, sampled,
+                             threads, counts);
+  }
+  long search_range(vector<neighbor> &v, const double radius,
+                    const double *query_point, const long first,
+                    const long last) {
+    atria.finish_rebuild(false);
+    return atria.search_range(v, radius, query_point, first, last);
+  }
+  long brute_force_k_neighbors(vector<neighbor> &v, const long k,
+                               const double *query_point, const long first,
+                               const long last) {
+    atria.finish_rebuild(false);
+    search_context ctx;
+    atria.brute_force_k_neighbors(ctx, &v, k, &query_point, 1, &first, &last);
+    atria.merge_statistics(ctx);
+    return v.size();
+  }
+  void brute_force_k_neighbors(const double *query_points, const long nq,
+                               const long dim, const long k,
+                               const int *exclude, const int threads,
+                               int *index, double *dist, double *stats) {
+    atria.finish_rebuild(false);
+    batch_brute_force_k_neighbors(&atria, query_points, nq, dim, k, exclude,
+                                  threads, index, dist, stats);
+  }
+  long brute_force_range(vector<neighbor> &v, const double radius,
+                         const double *query_point, const long first,
+                         const long last) {
+    atria.finish_rebuild(false);
+    search_context ctx;
+    const long count =
+        atria.brute_force_range(ctx, v, radius, query_point, first, last);
+    atria.merge_statistics(ctx);
+    return count;
+  }
+  // Fraction of the data set points whose distances are computed by exact
+  // searches of the k nearest neighbors of nq data points spread evenly over
+  // the data set, each excluding itself. Each search stops after the
+  // distances of the fraction 'budget' of the points, so that sampling a tree
+  // that can not prune costs no more than that. The statistics of the
+  // searcher are not changed.
+  double sampled_efficiency(const long nq, const long k, const double budget) {
+    atria.finish_rebuild(false);
+    const long N = atria.number_of_points();
+    const long live = N - atria.number_of_deleted_points();
+    if (live < 2)
+      return 1;
+    const long dim = atria.get_point_set().dimension();
+    const long m = min(nq, N);
+    vector<long> indices;
+    for (long i = 0; i < m; i++) {
+      const long j = (long)((i + 0.5) * N / m);
+      if (!atria.is_deleted(j))
+        indices.push_back(j);
+    }
+    if (indices.empty())
+      return 1;
+    vector<double> x(indices.size() * dim);
+    atria.copy_points(indices.data(), indices.size(), x.data());
+    search_limits limits;
+    limits.max_distances = (unsigned long)(budget * live) + 1;
+    search_context ctx;
+    vector<double> query_point(dim);
+    vector<neighbor> v;
+    for (size_t i = 0; i < indices.size(); i++) {
+      for (long d = 0; d < dim; d++)
+        query_point[d] = x[i + d * indices.size()];
+      v.clear();
+      const double *const qp = query_point.data();
+      atria.search_k_neighbors(ctx, v, min(k, live - 1), qp, indices[i],
+                               indices[i], limits);
+    }
+    return (double)ctx.points_searched / ((double)indices.size() * live);
+  }
+  // A new tree is built in the background when the current one drifted by
+  // more than rebuild_threshold, see ATRIA::tree_drift().
+  long insert_points(const double *x, const long n, const int threads,
+                     const double rebuild_threshold) {
+    const long first = atria.insert_points(x, n);
+    if ((first >= 0) && (atria.tree_drift() > rebuild_threshold))
+      atria.start_rebuild(threads);
+    return first;
+  }
+  long delete_points(const long *indices, const long n, const int threads,
+                     const double rebuild_threshold) {
+    const long count = atria.delete_points(indices, n);
+    if ((count >= 0) && (atria.tree_drift() > rebuild_threshold))
+      atria.start_rebuild(threads);
+    return count;
+  }
+  double tree_drift() const { return atria.tree_drift(); }
+  tree_shape statistics() const { return atria.statistics(); }
+  search_counters search_statistics() const {
+    return atria.statistics_counters();
+  }
+  void reset_statistics() { atria.reset_statistics(); }
+  double search_efficiency() const { return atria.search_efficiency(); }
+  bool build_spill_tree(const double overlap, const long max_points,
+                        const int threads, const double max_duplication) {
+    return atria.build_spill_tree(overlap, max_points, threads,
+                                  max_duplication);
+  }
+  bool has_spill_tree() const { return atria.has_spill_tree(); }
+  tree_shape spill_statistics() const { return atria.spill_statistics(); }
+  double spill_duplication() const { return atria.spill_duplication(); }
+  void copy_points(const long *indices, const long n, double *x) const {
+    atria.copy_points(indices, n, x);
+  }
+  long number_of_deleted_points() const {
+    return atria.number_of_deleted_points();
+  }
+  double data_set_radius() const { return atria.data_set_radius(); }
+  long total_tree_nodes() const { return atria.total_tree_nodes(); }
+  long dimension() const { return atria.get_point_set().dimension(); }
+  long number_of_points() const { return atria.number_of_points(); }
+  bool save(const std::string &path, const std::string &metric) const {
+    return atria.save(path, metric);
+  }
+  int geterr() const { return atria.geterr(); }
+};
+
+// Create the searcher for the given METRIC and point storage:
+// "float"     : row-major copy of the points in single precision
+// "double"    : row-major copy of the points in double precision
+// "reference" : no copy, the points are read from the R matrix itself
+// "uint8"     : points quantized to 8 bit codes, re-ranked with the R matrix
+// "uint16"    : points quantized to 16 bit codes, re-ranked with the R matrix
+template <class METRIC>
+searcher_interface *make_searcher(const Rcpp::NumericMatrix &x,
+                                  const std::string &storage, const long excl,
+                                  const long minpts, const uint32 seed,
+                                  const int threads, const bool reorder,
+                                  const split_strategy split,
+                                  const METRIC &metric) {
+  if (storage == "double") {
+    return new atria_searcher<rm_point_set<METRIC, double>>(
+        rm_point_set<METRIC, double>(x, metric), excl, minpts, seed, threads,
+        reorder, split);
+  } else if (storage == "reference") {
+    return new atria_searcher<cm_point_set<METRIC>>(
+        cm_point_set<METRIC>(x, metric), excl, minpts, seed, threads, reorder,
+        split);
+  } else if (storage == "uint8") {
+    return new atria_searcher<quantized_point_set<METRIC, uint8_t>>(
+        quantized_point_set<METRIC, uint8_t>(x, metric), excl, minpts, seed,
+        threads, reorder, split);
+  } else if (storage == "uint16") {
+    return new atria_searcher<quantized_point_set<METRIC, uint16_t>>(
+        quantized_point_set<METRIC, uint16_t>(x, metric), excl, minpts, seed,
+        threads, reorder, split);
+  }
+  return new atria_searcher<rm_point_set<METRIC>>(
+      rm_point_set<METRIC>(x, metric), excl, minpts, seed, threads, reorder,
+      split);
+}
+
+// Create the searcher for the given METRIC on the delay vectors of a time
+// series, see embedding_point_set. Storage "float" and "double" copy the
+// series, "reference" reads it from the R vector itself.
+template <class METRIC>
+searcher_interface *
+make_embedding_searcher(const Rcpp::NumericVector &series, const long dim,
+                        const long delay, const std::string &storage,
+                        const long excl, const long minpts, const uint32 seed,
+                        const int threads, const split_strategy split,
+                        const METRIC &metric) {
+  if (storage == "float") {
+    return new atria_searcher<embedding_point_set<METRIC, float>>(
+        embedding_point_set<METRIC, float>(series, dim, delay, false, metric),
+        excl, minpts, seed, threads, false, split);
+  }
+  return new atria_searcher<embedding_point_set<METRIC>>(
+      embedding_point_set<METRIC>(series, dim, delay, storage == "reference",
+                                  metric),
+      excl, minpts, seed, threads, false, split);
+}
+
+// Open the searcher saved in an index file for the given METRIC. The points
+// are used in place, with the element type given by the file's storage.
+template <class METRIC>
+searcher_interface *
+make_searcher(const std::shared_ptr<const mapped_file> &file) {
+  const index_header &h = index_file_header(*file);
+  if (strncmp(h.storage, "double", sizeof(h.storage)) == 0) {
+    return new atria_searcher<rm_point_set<METRIC, double>>(
+        rm_point_set<METRIC, double>(
+            (const double *)(file->data() + h.points_offset), h.points,
+            h.dimension, file),
+        file);
+  }
+  return new atria_searcher<rm_point_set<METRIC>>(
+      rm_point_set<METRIC>((const float *)(file->data() + h.points_offset),
+                           h.points, h.dimension, file),
+      file);
+}
+
+// Parameters of the metrics that need them.
+struct metric_parameters {
+  double p;                    // order of the Minkowski metric
+  std::vector<double> weights; // weights of the weighted euclidian metric
+  metric_parameters() : p(2){};
+};
+
+// Create the distance function object of a METRIC for points of dimension
+// dim from the parameters, throws if they are not valid for the METRIC.
+template <class METRIC>
+inline METRIC make_metric(const metric_parameters &, const long) {
+  return METRIC();
+}
+template <>
+inline minkowski_distance
+make_metric<minkowski_distance>(const metric_parameters &param, const long) {
+  if (!(param.p >= 1) || !std::isfinite(param.p)) {
+    throw Rcpp::exception("The order p of the Minkowski metric must be >= 1 "
+                          "and finite, use the metric 'maximum' for p = Inf.");
+  }
+  return minkowski_distance(param.p);
+}
+template <>
+inline weighted_euclidian_distance
+make_metric<weighted_euclidian_distance>(const metric_parameters &param,
+                                         const long dim) {
+  if ((long)param.weights.size() != dim) {
+    std::string exception_string =
+        "Wrong number of weights, expected " + std::to_string(dim);
+    throw Rcpp::exception(exception_string.c_str());
+  }
+  for (const double w : param.weights) {
+    if (!(w >= 0)) {
+      throw Rcpp::exception("Weights must be non-negative.");
+    }
+  }
+  return weighted_euclidian_distance(param.weights);
+}
+
+// The metrics a Searcher can use, by name. Each entry creates the searchers
+// for one METRIC, so the metric is chosen once when a searcher is created.
+// To add a metric, write its distance function object (see metric.h), add
+// an entry to the table in find_metric and, if it has parameters, a
+// specialization of make_metric. Index files only store the name of the
+// metric, so searchers of metrics with parameters can not be saved.
+struct metric_entry {
+  const char *name;
+  searcher_interface *(*create)(const Rcpp::NumericMatrix &x,
+                                const std::string &storage, const long excl,
+                                const long minpts, const uint32 seed,
+                                const int threads, const bool reorder,
+                                const split_strategy split,
+                                const metric_parameters &param);
+  searcher_interface *(*create_embedding)(
+      const Rcpp::NumericVector &series, const long dim, const long delay,
+      const std::string &storage, const long excl, const long minpts,
+      const uint32 seed, const int threads, const split_strategy split,
+      const metric_parameters &param);
+  // nullptr if the searchers can not be saved
+  searcher_interface *(*open)(const std::shared_ptr<const mapped_file> &file);
+};
+
+template <class METRIC>
+searcher_interface *
+create_metric_searcher(const Rcpp::NumericMatrix &x, const std::string &storage,
+                       const long excl, const long minpts, const uint32 seed,
+                       const int threads, const bool reorder,
+                       const split_strategy split,
+                       const metric_parameters &param) {
+  return make_searcher<METRIC>(x, storage, excl, minpts, seed, threads,
+                               reorder, split,
+                               make_metric<METRIC>(param, x.ncol()));
+}
+
+template <class METRIC>
+searcher_interface *create_metric_embedding_searcher(
+    const Rcpp::NumericVector &series, const long dim, const long delay,
+    const std::string &storage, const long excl, const long minpts,
+    const uint32 seed, const int threads, const split_strategy split,
+    const metric_parameters &param) {
+  return make_embedding_searcher<METRIC>(series, dim, delay, storage, excl,
+                                         minpts, seed, threads, split,
+                                         make_metric<METRIC>(param, dim));
+}
+
+template <class METRIC> metric_entry metric_without_save(const char *name) {
+  const metric_entry e = {name, &create_metric_searcher<METRIC>,
+                          &create_metric_embedding_searcher<METRIC>, nullptr};
+  return e;
+}
+
+template <class METRIC> metric_entry metric_with_save(const char *name) {
+  metric_entry e = metric_without_save<METRIC>(name);
+  e.open = &make_searcher<METRIC>;
+  return e;
+}
+
+// Returns nullptr for unknown metrics.
+inline const metric_entry *find_metric(const std::string &name) {
+  static const metric_entry registry[] = {
+      metric_with_save<euclidian_distance>("euclidian"),
+      metric_with_save<manhattan_distance>("manhattan"),
+      metric_with_save<maximum_distance>("maximum"),
+      metric_with_save<hamming_distance>("hamming"),
+      metric_with_save<angular_distance>("angular"),
+      metric_with_save<angular_distance>("cosine"),
+      metric_without_save<minkowski_distance>("minkowski"),
+      metric_without_save<weighted_euclidian_distance>("weighted_euclidian")};
+  for (const metric_entry &e : registry) {
+    if (name == e.name)
+      return &e;
+  }
+  return nullptr;
+}
+
+// Choice of the search engine of a Searcher with engine "auto": before the
+// first exact search, exact searches of the SEARCHER_ENGINE_K nearest
+// neighbors of SEARCHER_ENGINE_SAMPLE data points are run on the tree, and
+// brute force searches are used if they compute the distances of more than
+// the fraction SEARCHER_BRUTE_FORCE_EFFICIENCY of the points. The tree then
+// prunes too little to make up for the scattered memory accesses of its
+// searches, compared to the tiled scans of brute force. The sample searches
+// stop after the fraction SEARCHER_ENGINE_BUDGET of the points, which is
+// enough to tell the two engines apart.
+#define SEARCHER_ENGINE_SAMPLE 32
+#define SEARCHER_ENGINE_K 10
+#define SEARCHER_BRUTE_FORCE_EFFICIENCY 0.5
+#define SEARCHER_ENGINE_BUDGET 0.55
 
-// Lots of boilderplate code below. C++ does not support virtual member
-// templates, so we have to flesh out the dispatch logic for every exported
-// function here for all metrics.
 class Searcher {
 private:
   std::string metric_;
-  ATRIA<rm_point_set<euclidian_distance>> *euclidian_;
-  ATRIA<rm_point_set<manhattan_distance>> *manhattan_;
-  ATRIA<rm_point_set<maximum_distance>> *maximum_;
-  ATRIA<rm_point_set<hamming_distance>> *hamming_;
+  std::string storage_;
+  searcher_interface *searcher_;
+  std::string engine_;        // "auto", "tree" or "brute_force"
+  bool brute_force_;          // true if brute force searches are used
+  bool engine_sampled_;       // false until "auto" has chosen the engine
+  double sampled_efficiency_; // see choose_engine, NaN if not sampled
+
+  // Sample the tree for engine "auto" if that was not done yet.
+  void sample_engine() {
+    if (engine_sampled_)
+      return;
+    sampled_efficiency_ = searcher_->sampled_efficiency(
+        SEARCHER_ENGINE_SAMPLE, SEARCHER_ENGINE_K, SEARCHER_ENGINE_BUDGET);
+    brute_force_ = sampled_efficiency_ > SEARCHER_BRUTE_FORCE_EFFICIENCY;
+    engine_sampled_ = true;
+  }
+
+  // Look up the metric in the registry.
+  const metric_entry *set_metric(const std::string &metric) {
+    const metric_entry *entry = find_metric(metric);
+    if (entry == nullptr) {
+      std::string exception_string = "Unknown metric " + metric + " specified.";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    metric_ = entry->name;
+    return entry;
+  }
+
+  // Sanitize input storage.
+  void set_storage(const std::string &storage) {
+    if (storage.compare("float") == 0) {
+      storage_ = "float";
+    } else if (storage.compare("double") == 0) {
+      storage_ = "double";
+    } else if (storage.compare("reference") == 0) {
+      storage_ = "reference";
+    } else if (storage.compare("uint8") == 0) {
+      storage_ = "uint8";
+    } else if (storage.compare("uint16") == 0) {
+      storage_ = "uint16";
+    } else {
+      std::string exception_string =
+          "Unknown storage " + storage + " specified.";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+  }
+
+  // Sanitize input split strategy, see split_strategy.
+  static split_strategy get_split(const std::string &split) {
+    if (split.compare("farthest") == 0) {
+      return split_farthest;
+    } else if (split.compare("sampled") == 0) {
+      return split_sampled;
+    } else if (split.compare("medoid") == 0) {
+      return split_medoid;
+    } else if (split.compare("balanced") == 0) {
+      return split_balanced;
+    }
+    std::string exception_string =
+        "Unknown split strategy " + split + " specified.";
+    throw Rcpp::exception(exception_string.c_str());
+  }
 
 public:
   Searcher() = delete;
   Searcher(const Searcher &) = delete;
 
   Searcher(const Rcpp::NumericMatrix x, const std::string metric,
-           const long excl = 0, const long minpts = 64, const uint32 seed = 9345356234)
-      : metric_("euclidian"), euclidian_(nullptr), manhattan_(nullptr),
-        maximum_(nullptr), hamming_(nullptr) {
-    // Sanitize input metric.
-    if (metric.compare("euclidian") == 0) {
-      metric_ = "euclidian";
-    } else if (metric.compare("manhattan") == 0) {
-      metric_ = "manhattan";
-    } else if (metric.compare("maximum") == 0) {
-      metric_ = "maximum";
-    } else if (metric.compare("hamming") == 0) {
-      metric_ = "hamming";
-    } else {
-      std::string exception_string = "Unknown metric " + metric + " specified.";
+           const long excl = 0, const long minpts = 64,
+           const uint32 seed = 9345356234, const int threads = 1,
+           const bool reorder = false, const std::string storage = "float",
+           const metric_parameters &param = metric_parameters(),
+           const std::string split = "farthest",
+           const std::string engine = "auto")
+      : metric_("euclidian"), storage_("float"), searcher_(nullptr),
+        engine_("auto"), brute_force_(false), engine_sampled_(true),
+        sampled_efficiency_(NAN) {
+    const metric_entry *entry = set_metric(metric);
+    set_storage(storage);
+    const split_strategy strategy = get_split(split);
+    if (reorder && (storage_ != "float") && (storage_ != "double")) {
+      std::string exception_string =
+          "Points can not be reordered with storage '" + storage_ + "'.";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    Rcpp::Rcout << "Using " << metric_ << " metric." << endl;
+    searcher_ = entry->create(x, storage_, excl, minpts, seed, threads,
+                              reorder, strategy, param);
+    choose_engine(engine);
+  }
+
+  // Create a searcher on the delay vectors of dimension dim of the time
+  // series 'series', point n being (series[n], series[n + delay], ...,
+  // series[n + (dim - 1) * delay]). Only the series is stored, see
+  // make_embedding_searcher for the storage.
+  Searcher(const Rcpp::NumericVector series, const long dim, const long delay,
+           const std::string metric, const long excl = 0,
+           const long minpts = 64, const uint32 seed = 9345356234,
+           const int threads = 1, const std::string storage = "double",
+           const metric_parameters &param = metric_parameters(),
+           const std::string split = "farthest",
+           const std::string engine = "auto")
+      : metric_("euclidian"), storage_("double"), searcher_(nullptr),
+        engine_("auto"), brute_force_(false), engine_sampled_(true),
+        sampled_efficiency_(NAN) {
+    const metric_entry *entry = set_metric(metric);
+    set_storage(storage);
+    const split_strategy strategy = get_split(split);
+    if ((storage_ == "uint8") || (storage_ == "uint16")) {
+      std::string exception_string =
+          "Storage '" + storage_ + "' is not supported for embeddings.";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    if ((dim < 1) || (delay < 1)) {
+      throw Rcpp::exception("Embedding dimension and delay must be positive.");
+    }
+    if (series.size() - (dim - 1) * delay < 1) {
+      throw Rcpp::exception("Time series is too short for this embedding.");
+    }
+    Rcpp::Rcout << "Using " << metric_ << " metric." << endl;
+    searcher_ = entry->create_embedding(series, dim, delay, storage_, excl,
+                                        minpts, seed, threads, strategy,
+                                        param);
+    choose_engine(engine);
+  }
+
+  // Open a searcher saved with save(). On POSIX systems, the file is memory
+  // mapped and used in place, nothing is rebuilt or copied.
+  explicit Searcher(const std::string &path,
+                    const std::string &engine = "auto")
+      : metric_("euclidian"), storage_("float"), searcher_(nullptr),
+        engine_("auto"), brute_force_(false), engine_sampled_(true),
+        sampled_efficiency_(NAN) {
+    std::shared_ptr<mapped_file> file(new mapped_file());
+    if (!file->open(path)) {
+      std::string exception_string = "Can not open index file " + path + ".";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    const char *error =
+        index_file_error(*file, sizeof(neighbor), sizeof(tree_node));
+    if (error != nullptr) {
+      throw Rcpp::exception(error);
+    }
+    const index_header &h = index_file_header(*file);
+    metric_ = h.metric;
+    storage_ = h.storage;
+    const metric_entry *entry = find_metric(metric_);
+    if ((entry == nullptr) || (entry->open == nullptr)) {
+      std::string exception_string =
+          "Unknown metric " + metric_ + " in index file.";
       throw Rcpp::exception(exception_string.c_str());
     }
     Rcpp::Rcout << "Using " << metric_ << " metric." << endl;
-    if (metric_ == "euclidian") {
-      rm_point_set<euclidian_distance> points(x);
-      euclidian_ = new ATRIA<rm_point_set<euclidian_distance>>(
-          std::move(points), excl, minpts, seed);
-    } else if (metric_ == "manhattan") {
-      rm_point_set<manhattan_distance> points(x);
-      manhattan_ = new ATRIA<rm_point_set<manhattan_distance>>(
-          std::move(points), excl, minpts, seed);
-    } else if (metric_ == "maximum") {
-      rm_point_set<maximum_distance> points(x);
-      maximum_ = new ATRIA<rm_point_set<maximum_distance>>(std::move(points),
-                                                           excl, minpts, seed);
-    } else if (metric_ == "hamming") {
-      rm_point_set<hamming_distance> points(x);
-      hamming_ = new ATRIA<rm_point_set<hamming_distance>>(std::move(points),
-                                                           excl, minpts, seed);
-    }
-  }
-  ~Searcher() {
-    delete euclidian_;
-    delete maximum_;
-    delete manhattan_;
-    delete hamming_;
+    searcher_ = entry->open(file);
+    if (searcher_->geterr()) {
+      delete searcher_;
+      throw Rcpp::exception("Corrupt index file.");
+    }
+    choose_engine(engine);
+  }
+  ~Searcher() { delete searcher_; }
+
+  // Save the points and the search tree to an index file. Points of storage
+  // "reference", "uint8" and "uint16" are saved in double precision, delay
+  // vectors as a full matrix of points.
+  void save(const std::string &path) const {
+    if (searcher_->number_of_deleted_points() > 0) {
+      throw Rcpp::exception("Searchers with deleted points can not be saved.");
+    }
+    if (find_metric(metric_)->open == nullptr) {
+      std::string exception_string =
+          "Searchers with metric " + metric_ + " can not be saved.";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    if (!searcher_->save(path, metric_)) {
+      std::string exception_string = "Can not write index file " + path + ".";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+  }
+
+  // Choose how exact k nearest neighbor searches and range searches are
+  // done: "tree" searches the tree, "brute_force" computes the distances to
+  // all points, see ATRIA::brute_force_k_neighbors, and "auto" uses brute
+  // force if the sampled efficiency of the tree is too low, see
+  // SEARCHER_BRUTE_FORCE_EFFICIENCY, sampled before the first exact search.
+  // Approximate k nearest neighbor searches and counts of points always use
+  // the tree.
+  void choose_engine(const std::string &engine) {
+    if ((engine != "auto") && (engine != "tree") &&
+        (engine != "brute_force")) {
+      std::string exception_string =
+          "Unknown search engine " + engine + " specified.";
+      throw Rcpp::exception(exception_string.c_str());
+    }
+    engine_ = engine;
+    sampled_efficiency_ = NAN;
+    brute_force_ = (engine_ == "brute_force");
+    engine_sampled_ = (engine_ != "auto");
   }
 
+  const std::string &engine() const { return engine_; };
+  // Whether exact searches use brute force, sampling the tree first for
+  // engine "auto".
+  bool brute_force() {
+    sample_engine();
+    return brute_force_;
+  };
+  double sampled_efficiency() const { return sampled_efficiency_; };
+
   // Search for k nearest neighbors of the point query_point, excluding
   // points with indices between first and last from the search. Returns a
-  // sorted vector of neighbors (by reference).
-  template <class ForwardIterator>
+  // sorted vector of neighbors (by reference). See search_limits for
+  // approximate searches.
   long search_k_neighbors(vector<neighbor> &v, const long k,
-                          ForwardIterator query_point, const long first = -1,
-                          const long last = -1, const double epsilon = 0) {
-
-    if (metric_ == "euclidian") {
-      return euclidian_->search_k_neighbors(v, k, query_point, first, last,
-                                            epsilon);
-    } else if (metric_ == "manhattan") {
-      return manhattan_->search_k_neighbors(v, k, query_point, first, last,
-                                            epsilon);
-    } else if (metric_ == "maximum") {
-      return maximum_->search_k_neighbors(v, k, query_point, first, last,
-                                          epsilon);
-    } else if (metric_ == "hamming") {
-      return hamming_->search_k_neighbors(v, k, query_point, first, last,
-                                          epsilon);
-    }
-    return 0;
+                          const double *query_point, const long first = -1,
+                          const long last = -1,
+                          const search_limits &limits = search_limits()) {
+    if (limits.exact() && brute_force()) {
+      return searcher_->brute_force_k_neighbors(v, k, query_point, first,
+                                                last);
+    }
+    return searcher_->search_k_neighbors(v, k, query_point, first, last,
+                                         limits);
+  };
+
+  // Batch search for k nearest neighbors on up to 'threads' threads, see
+  // batch_k_neighbors above for the layout of the arguments.
+  void search_k_neighbors(const double *query_points, const long nq,
+                          const long dim, const long k, const int *exclude,
+                          const search_limits &limits, const int threads,
+                          int *index, double *dist,
+                          double *stats = nullptr) {
+    if (limits.exact() && brute_force()) {
+      searcher_->brute_force_k_neighbors(query_points, nq, dim, k, exclude,
+                                         threads, index, dist, stats);
+      return;
+    }
+    searcher_->search_k_neighbors(query_points, nq, dim, k, exclude, limits,
+                                  threads, index, dist, stats);
+  };
+
+  // Search the k nearest neighbors of every point of the data set, excluding
+  // neighbors whose indices differ by at most theiler_window from the index of
+  // the point. Results are written to the column-major number_of_points() by
+  // k matrices index (one-based) and dist.
+  void all_k_neighbors(const long k, const long theiler_window,
+                       const int threads, int *index, double *dist) {
+    searcher_->all_k_neighbors(k, theiler_window, threads, index, dist);
   };
 
   // Count the number of points within distance 'radius' from the query point,
   // excluding points with indices between first and last from the search.
-  template <class ForwardIterator>
-  long count_range(const double radius, ForwardIterator query_point,
+  long count_range(const double radius, const double *query_point,
                    const long first = -1, const long last = -1) {
-    if (metric_ == "euclidian") {
-      return euclidian_->count_range(radius, query_point, first, last);
-    } else if (metric_ == "manhattan") {
-      return manhattan_->count_range(radius, query_point, first, last);
-    } else if (metric_ == "maximum") {
-      return maximum_->count_range(radius, query_point, first, last);
-    } else if (metric_ == "hamming") {
-      return hamming_->count_range(radius, query_point, first, last);
-    }
-    return 0;
+    return searcher_->count_range(radius, query_point, first, last);
+  };
+
+  // Count the points within each of the nr ascending radii around each query
+  // point in one traversal per query, see batch_count_range_multi above for
+  // the layout of the arguments.
+  void count_range_multi(const double *query_points, const long nq,
+                         const long dim, const double *radii, const long nr,
+                         const int *exclude, const int threads, int *counts) {
+    searcher_->count_range_multi(query_points, nq, dim, radii, nr, exclude,
+                                 threads, counts);
+  };
+
+  // Count the pairs of data set points within each of the nr ascending
+  // radii, ignoring pairs within the Theiler window. If sampled is not null,
+  // only pairs of points i, j with sampled[i] and sampled[j] != 0 are
+  // counted. Returns the number of pairs considered.
+  uint64_t count_pairs(const double *radii, const long nr,
+                       const long theiler_window, const char *sampled,
+                       const int threads, uint64_t *counts) {
+    return searcher_->count_pairs(radii, nr, theiler_window, sampled, threads,
+                                  counts);
   };
 
   // Search points within distance 'radius' from the query point,  excluding
   // points with indices between first and last  Returns an unsorted vector v of
   // neigbors by reference.
-  template <class ForwardIterator>
   long search_range(vector<neighbor> &v, const double radius,
-                    ForwardIterator query_point, const long first = -1,
+                    const double *query_point, const long first = -1,
                     const long last = -1) {
-    if (metric_ == "euclidian") {
-      return euclidian_->search_range(v, radius, query_point, first, last);
-    } else if (metric_ == "manhattan") {
-      return manhattan_->search_range(v, radius, query_point, first, last);
-    } else if (metric_ == "maximum") {
-      return maximum_->search_range(v, radius, query_point, first, last);
-    } else if (metric_ == "hamming") {
-      return hamming_->search_range(v, radius, query_point, first, last);
-    }
-    return 0;
+    if (brute_force()) {
+      return searcher_->brute_force_range(v, radius, query_point, first,
+                                          last);
+    }
+    return searcher_->search_range(v, radius, query_point, first, last);
   };
 
-  // Returns an approximation of the data set radius such that any pairwise
-  // distance in the data set is smaller than twice this radius. This bound is
-  // not necessarily tight.
-  double data_set_radius() const {
-    if (metric_ == "euclidian") {
-      return euclidian_->data_set_radius();
-    } else if (metric_ == "manhattan") {
-      return manhattan_->data_set_radius();
-    } else if (metric_ == "maximum") {
-      return maximum_->data_set_radius();
-    } else if (metric_ == "hamming") {
-      return hamming_->data_set_radius();
-    }
-    return 0.0;
+  // Add the rows of the column-major n by dimension() matrix x to the data
+  // set and the search tree. Returns the index of the first new point, the
+  // others follow. When the tree has drifted by more than rebuild_threshold
+  // from a freshly built one (see ATRIA::tree_drift), a new tree is built on
+  // a background thread with up to 'threads' threads, it replaces the
+  // current tree at one of the next calls.
+  long insert_points(const double *x, const long n, const int threads,
+                     const double rebuild_threshold) {
+    const long first =
+        searcher_->insert_points(x, n, threads, rebuild_threshold);
+    if (first < 0) {
+      throw Rcpp::exception("Points can not be added to this searcher.");
+    }
+    return first;
   };
 
-  long total_tree_nodes() const {
-    if (metric_ == "euclidian") {
-      return euclidian_->total_tree_nodes();
-    } else if (metric_ == "manhattan") {
-      return manhattan_->total_tree_nodes();
-    } else if (metric_ == "maximum") {
-      return maximum_->total_tree_nodes();
-    } else if (metric_ == "hamming") {
-      return hamming_->total_tree_nodes();
-    }
-    return 0;
+  // Delete the points with the given (zero-based) indices, the tree is
+  // rebuilt like for insert_points. Returns the number of points deleted.
+  long delete_points(const long *indices, const long n, const int threads,
+                     const double rebuild_threshold) {
+    const long count =
+        searcher_->delete_points(indices, n, threads, rebuild_threshold);
+    if (count < 0) {
+      throw Rcpp::exception("Points can not be deleted from this searcher.");
+    }
+    return count;
   };
 
-  long number_of_points() const {
-    if (metric_ == "euclidian") {
-      return euclidian_->number_of_points();
-    } else if (metric_ == "manhattan") {
-      return manhattan_->number_of_points();
-    } else if (metric_ == "maximum") {
-      return maximum_->number_of_points();
-    } else if (metric_ == "hamming") {
-      return hamming_->number_of_points();
-    }
-    return 0;
+  double tree_drift() const { return searcher_->tree_drift(); };
+
+  // Depth and radii of the search tree, see tree_shape.
+  tree_shape statistics() const { return searcher_->statistics(); };
+
+  // Cumulative statistics counters of all searches since the searcher was
+  // created or the statistics were reset, see search_counters.
+  search_counters search_statistics() const {
+    return searcher_->search_statistics();
   };
+  void reset_statistics() { searcher_->reset_statistics(); };
+
+  // Average fraction of the data set points whose distance to a query point
+  // was computed.
+  double search_efficiency() const { return searcher_->search_efficiency(); };
+
+  // Build the spill tree used by defeatist searches, see
+  // ATRIA::build_spill_tree.
+  void build_spill_tree(const double overlap, const long max_points,
+                        const int threads, const double max_duplication) {
+    if (!searcher_->build_spill_tree(overlap, max_points, threads,
+                                     max_duplication)) {
+      throw Rcpp::exception("Spill tree could not be built.");
+    }
+  };
+
+  bool has_spill_tree() const { return searcher_->has_spill_tree(); };
+
+  tree_shape spill_statistics() const {
+    return searcher_->spill_statistics();
+  };
+
+  double spill_duplication() const { return searcher_->spill_duplication(); };
+
+  // Copy the coordinates of the data points with the given (zero-based)
+  // indices to the column-major n by dimension() matrix x.
+  void copy_points(const long *indices, const long n, double *x) const {
+    searcher_->copy_points(indices, n, x);
+  };
+
+  // Returns an approximation of the data set radius such that any pairwise
+  // distance in the data set is smaller than twice this radius. This bound is
+  // not necessarily tight.
+  double data_set_radius() const { return searcher_->data_set_radius(); };
+
+  long total_tree_nodes() const { return searcher_->total_tree_nodes(); };
+
+  long dimension() const { return searcher_->dimension(); };
+
+  long number_of_points() const { return searcher_->number_of_points(); };
+};
+
+// Parameters of the adaptive correlation sum estimate, see estimate_corrsum.
+struct corrsum_parameters {
+  double min_actual_pairs;
+  long min_samples_at_scale;
+  long max_samples_at_scale;
+  long batch_size;
+  int threads;
+  bool verbose;
+};
+
+// Pair counts of the correlation sum estimate, one element per distance.
+struct corrsum_result {
+  vector<double> actual_pairs;
+  vector<double> potential_pairs;
+  vector<double> samples_used;
+};
+
+// Estimate the correlation sum of the N points in the rows of data at the
+// ascending distances dists (dists[0] == 0). The distance scales are visited
+// from the largest to the smallest. At each scale, batches of batch_size
+// randomly chosen query points are counted at all distances up to the
+// current one, until at least min_actual_pairs pairs and
+// min_samples_at_scale query points were seen at this scale, or
+// max_samples_at_scale query points were used. Each pair is counted only
+// once by ignoring data points with an index up to the query's index. The
+// queries of a batch are counted on up to 'threads' threads. Random numbers
+// are drawn from R's generator in the calling thread only.
+inline void estimate_corrsum(Searcher &searcher,
+                             const Rcpp::NumericMatrix &data,
+                             const vector<double> &dists,
+                             const corrsum_parameters &param,
+                             corrsum_result &result) {
+  const long N = data.nrow();
+  const long dim = data.ncol();
+  const long nd = dists.size();
+  const long nq = param.batch_size;
+
+  result.actual_pairs.assign(nd, 0);
+  result.potential_pairs.assign(nd, 0);
+  result.samples_used.assign(nd, 0);
+
+  // The batches are drawn by a partial Fisher-Yates shuffle of indices.
+  vector<int> indices(N);
+  for (long i = 0; i < N; i++)
+    indices[i] = i;
+  vector<double> query_points(nq * dim);
+  vector<int> exclude(nq * 2, 0);
+  vector<int> counts(nq * nd);
+
+  for (long pos = nd - 1; pos >= 0; pos--) {
+    const double radius = dists[pos];
+    if (radius == 0)
+      break;
+    while ((result.actual_pairs[pos] < param.min_actual_pairs) ||
+           (result.samples_used[pos] < param.min_samples_at_scale)) {
+      if (result.samples_used[pos] >= param.max_samples_at_scale)
+        break;
+      Rcpp::checkUserInterrupt();
+
+      double potential = 0;
+      for (long n = 0; n < nq; n++) {
+        const long j = n + (long)(R::unif_rand() * (N - n));
+        std::swap(indices[n], indices[j]);
+        const long i = indices[n];
+        for (long d = 0; d < dim; d++)
+          query_points[n + d * nq] = data(i, d);
+        // Ignore points with indices up to the query point's index, so every
+        // pairwise distance is counted only once.
+        exclude[n + nq] = i + 1;
+        potential += N - 1 - i;
+      }
+      searcher.count_range_multi(query_points.data(), nq, dim, dists.data(),
+                                 pos + 1, exclude.data(), param.threads,
+                                 counts.data());
+
+      for (long b = 0; b < nd; b++) {
+        if (dists[b] <= radius)
+          result.potential_pairs[b] += potential;
+      }
+      // The counts are cumulative, their differences are the counts per bin.
+      double previous = 0;
+      for (long b = 0; b <= pos; b++) {
+        double total = 0;
+        for (long n = 0; n < nq; n++)
+          total += counts[n + b * nq];
+        result.actual_pairs[b] += total - previous;
+        previous = total;
+      }
+      result.samples_used[pos] += nq;
+      if (param.verbose) {
+        Rcpp::Rcout << "Radius: " << radius << " count: " << previous << " "
+                    << previous << endl;
+      }
+    }
+  }
+}
+
+// Automatic tuning of the leaf size and the seed of a searcher, see
+// tune_searcher. The leaf sizes are tried on a random subsample of at most
+// TUNE_SAMPLE points, the TUNE_SEEDS seeds on all points, each with
+// TUNE_QUERIES data points as query points.
+#define TUNE_SAMPLE 20000
+#define TUNE_QUERIES 200
+#define TUNE_SEEDS 3
+
+// The queries of a candidate are repeated until they took at least
+// TUNE_MIN_SECONDS in total (at most TUNE_MAX_RUNS times), the fastest run
+// counts.
+#define TUNE_MIN_SECONDS 0.05
+#define TUNE_MAX_RUNS 20
+
+// Parameters of the searchers built by tune_searcher and the workload the
+// candidates are timed with: k nearest neighbor searches of k neighbors or,
+// if radius > 0, range searches with that radius.
+struct tuning_parameters {
+  std::string metric;
+  std::string storage;
+  std::string split;
+  std::string engine;
+  metric_parameters param;
+  long excl;
+  uint32 seed;
+  int threads;
+  bool reorder;
+  long k;
+  double radius;
+};
+
+// A searcher built by tune_searcher. stage is 0 for the leaf sizes tried on
+// the subsample, 1 for the seeds tried on all points. distances is the
+// average number of distances computed per query point.
+struct tuning_candidate {
+  int stage;
+  long minpts;
+  uint32 seed;
+  double build_seconds;
+  double query_seconds;
+  double distances;
+  bool chosen;
 };
 
+// Time the workload of param on the searcher, for the nq query points in the
+// rows of the column-major matrix query_points, each excluding the data
+// point with the (zero-based) index in self. The fastest of several runs is
+// taken, see TUNE_MIN_SECONDS, so timer noise and cold caches count less.
+inline void time_workload(Searcher &searcher,
+                          const vector<double> &query_points,
+                          const vector<long> &self,
+                          const tuning_parameters &param,
+                          tuning_candidate &candidate) {
+  const long nq = self.size();
+  const long dim = searcher.dimension();
+  const long k = min(param.k, searcher.number_of_points() - 1);
+  vector<int> exclude(2 * nq);
+  for (long n = 0; n < nq; n++) {
+    exclude[n] = self[n] + 1;
+    exclude[n + nq] = self[n] + 1;
+  }
+  vector<int> index(nq * max(k, 1L));
+  vector<double> dist(nq * max(k, 1L));
+  vector<double> query_point(dim);
+  vector<neighbor> v;
+  candidate.query_seconds = DBL_MAX;
+  double total = 0;
+  for (int run = 0;
+       (run < 2) || ((total < TUNE_MIN_SECONDS) && (run < TUNE_MAX_RUNS));
+       run++) {
+    searcher.reset_statistics();
+    const auto start = std::chrono::steady_clock::now();
+    if (param.radius > 0) {
+      for (long n = 0; n < nq; n++) {
+        for (long d = 0; d < dim; d++)
+          query_point[d] = query_points[n + d * nq];
+        v.clear();
+        searcher.search_range(v, param.radius, query_point.data(), self[n],
+                              self[n]);
+      }
+    } else if (k > 0) {
+      searcher.search_k_neighbors(query_points.data(), nq, dim, k,
+                                  exclude.data(), search_limits(),
+                                  param.threads, index.data(), dist.data());
+    }
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    candidate.query_seconds = min(candidate.query_seconds, seconds);
+    total += seconds;
+  }
+  candidate.distances =
+      (double)searcher.search_statistics().points_searched / nq;
+  searcher.reset_statistics();
+}
+
+// Build a searcher on the rows of x with the leaf size and the seed that
+// answer the workload of param fastest. First, searchers with leaf sizes of
+// 8 to 256 points and the seed param.seed are built on a random subsample of
+// the points, then searchers with the best leaf size and TUNE_SEEDS seeds
+// (param.seed first) on all points, as the choice of the random root center
+// depends on the points. The fastest of those is returned, it is not built
+// again. All candidates are appended to candidates. Random numbers are drawn
+// from R's generator.
+inline Searcher *tune_searcher(const Rcpp::NumericMatrix &x,
+                               const tuning_parameters &param,
+                               vector<tuning_candidate> &candidates) {
+  static const long leaf_sizes[] = {8, 16, 32, 64, 128, 256};
+  const long N = x.nrow() - param.excl;
+  const long dim = x.ncol();
+  if (N < 2) {
+    throw Rcpp::exception("Too few points to tune the searcher.");
+  }
+
+  // The subsample is drawn by a partial Fisher-Yates shuffle of the indices
+  // of the searched points, its first points are the query points.
+  const long ns = min(N, (long)TUNE_SAMPLE);
+  const long nq = min(ns, (long)TUNE_QUERIES);
+  vector<long> indices(N);
+  for (long i = 0; i < N; i++)
+    indices[i] = i;
+  for (long n = 0; n < ns; n++) {
+    const long j = n + (long)(R::unif_rand() * (N - n));
+    std::swap(indices[n], indices[j]);
+  }
+  Rcpp::NumericMatrix sample(ns, dim);
+  for (long n = 0; n < ns; n++) {
+    for (long d = 0; d < dim; d++)
+      sample(n, d) = x(indices[n], d);
+  }
+  vector<double> query_points(nq * dim);
+  vector<long> sample_self(nq);
+  vector<long> self(nq);
+  for (long n = 0; n < nq; n++) {
+    for (long d = 0; d < dim; d++)
+      query_points[n + d * nq] = sample(n, d);
+    sample_self[n] = n;
+    self[n] = indices[n];
+  }
+
+  auto build = [&](const Rcpp::NumericMatrix &points, const long excl,
+                   const long minpts, const uint32 seed,
+                   tuning_candidate &candidate) {
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<Searcher> s(new Searcher(
+        points, param.metric, excl, minpts, seed, param.threads,
+        param.reorder, param.storage, param.param, param.split, "tree"));
+    candidate.build_seconds = std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+    candidate.minpts = minpts;
+    candidate.seed = seed;
+    candidate.chosen = false;
+    return s;
+  };
+
+  size_t best = candidates.size();
+  for (const long minpts : leaf_sizes) {
+    Rcpp::checkUserInterrupt();
+    tuning_candidate c;
+    c.stage = 0;
+    std::unique_ptr<Searcher> s = build(sample, 0, minpts, param.seed, c);
+    time_workload(*s, query_points, sample_self, param, c);
+    candidates.push_back(c);
+    if (c.query_seconds < candidates[best].query_seconds)
+      best = candidates.size() - 1;
+  }
+  candidates[best].chosen = true;
+  const long minpts = candidates[best].minpts;
+
+  std::unique_ptr<Searcher> winner;
+  best = candidates.size();
+  for (long t = 0; t < TUNE_SEEDS; t++) {
+    Rcpp::checkUserInterrupt();
+    tuning_candidate c;
+    c.stage = 1;
+    const uint32 seed = (param.seed + t * 2654435769UL) & 0xffffffffUL;
+    std::unique_ptr<Searcher> s = build(x, param.excl, minpts, seed, c);
+    time_workload(*s, query_points, self, param, c);
+    candidates.push_back(c);
+    if ((winner == nullptr) ||
+        (c.query_seconds < candidates[best].query_seconds)) {
+      best = candidates.size() - 1;
+      winner = std::move(s);
+    }
+  }
+  candidates[best].chosen = true;
+  winner->choose_engine(param.engine);
+  return winner.release();
+}
+
 #endif
@@ -0,0 +1,193 @@
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "NNSearcher/distance_kernels.h"
+
+// Runtime dispatch is available for x86 with GCC or clang, other platforms
+// use the plain C++ kernels.
+#if (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+#define ATRIA_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define ATRIA_X86_KERNELS 0
+#endif
+
+namespace scalar {
+typedef double vec;
+static const long LANES = 1;
+#define KERNEL_TARGET
+static inline vec vzero() { return 0.0; }
+static inline vec vload(const float *p) { return *p; }
+static inline vec vload(const double *p) { return *p; }
+static inline vec vsub(const vec a, const vec b) { return a - b; }
+static inline vec vadd(const vec a, const vec b) { return a + b; }
+static inline vec vfmadd(const vec a, const vec b, const vec c) {
+  return a * b + c;
+}
+static inline vec vabs(const vec a) { return fabs(a); }
+static inline vec vmax(const vec a, const vec b) { return (a > b) ? a : b; }
+static inline double vhsum(const vec a) { return a; }
+static inline double vhmax(const vec a) { return a; }
+#include "NNSearcher/distance_kernels_impl.h"
+#undef KERNEL_TARGET
+} // namespace scalar
+
+#if ATRIA_X86_KERNELS
+namespace sse2 {
+typedef __m128d vec;
+static const long LANES = 2;
+#define KERNEL_TARGET __attribute__((target("sse2")))
+KERNEL_TARGET static inline vec vzero() { return _mm_setzero_pd(); }
+KERNEL_TARGET static inline vec vload(const float *p) {
+  return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)p)));
+}
+KERNEL_TARGET static inline vec vload(const double *p) {
+  return _mm_loadu_pd(p);
+}
+KERNEL_TARGET static inline vec vsub(const vec a, const vec b) {
+  return _mm_sub_pd(a, b);
+}
+KERNEL_TARGET static inline vec vadd(const vec a, const vec b) {
+  return _mm_add_pd(a, b);
+}
+KERNEL_TARGET static inline vec vfmadd(const vec a, const vec b, const vec c) {
+  return _mm_add_pd(_mm_mul_pd(a, b), c);
+}
+KERNEL_TARGET static inline vec vabs(const vec a) {
+  return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+}
+KERNEL_TARGET static inline vec vmax(const vec a, const vec b) {
+  return _mm_max_pd(a, b);
+}
+KERNEL_TARGET static inline double vhsum(const vec a) {
+  return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a)));
+}
+KERNEL_TARGET static inline double vhmax(const vec a) {
+  return _mm_cvtsd_f64(_mm_max_sd(a, _mm_unpackhi_pd(a, a)));
+}
+#include "NNSearcher/distance_kernels_impl.h"
+#undef KERNEL_TARGET
+} // namespace sse2
+
+namespace avx2 {
+typedef __m256d vec;
+static const long LANES = 4;
+#define KERNEL_TARGET __attribute__((target("avx2,fma")))
+KERNEL_TARGET static inline vec vzero() { return _mm256_setzero_pd(); }
+KERNEL_TARGET static inline vec vload(const float *p) {
+  return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+KERNEL_TARGET static inline vec vload(const double *p) {
+  return _mm256_loadu_pd(p);
+}
+KERNEL_TARGET static inline vec vsub(const vec a, const vec b) {
+  return _mm256_sub_pd(a, b);
+}
+KERNEL_TARGET static inline vec vadd(const vec a, const vec b) {
+  return _mm256_add_pd(a, b);
+}
+KERNEL_TARGET static inline vec vfmadd(const vec a, const vec b, const vec c) {
+  return _mm256_fmadd_pd(a, b, c);
+}
+KERNEL_TARGET static inline vec vabs(const vec a) {
+  return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+}
+KERNEL_TARGET static inline vec vmax(const vec a, const vec b) {
+  return _mm256_max_pd(a, b);
+}
+KERNEL_TARGET static inline double vhsum(const vec a) {
+  const __m128d s =
+      _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+KERNEL_TARGET static inline double vhmax(const vec a) {
+  const __m128d m =
+      _mm_max_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+  return _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+}
+#include "NNSearcher/distance_kernels_impl.h"
+#undef KERNEL_TARGET
+} // namespace avx2
+
+// Some AVX-512 intrinsics of gcc 12 trigger false -Wuninitialized warnings
+// inside the compiler's own headers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+namespace avx512 {
+typedef __m512d vec;
+static const long LANES = 8;
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+KERNEL_TARGET static inline vec vzero() { return _mm512_setzero_pd(); }
+KERNEL_TARGET static inline vec vload(const float *p) {
+  return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+}
+KERNEL_TARGET static inline vec vload(const double *p) {
+  return _mm512_loadu_pd(p);
+}
+KERNEL_TARGET static inline vec vsub(const vec a, const vec b) {
+  return _mm512_sub_pd(a, b);
+}
+KERNEL_TARGET static inline vec vadd(const vec a, const vec b) {
+  return _mm512_add_pd(a, b);
+}
+KERNEL_TARGET static inline vec vfmadd(const vec a, const vec b, const vec c) {
+  return _mm512_fmadd_pd(a, b, c);
+}
+KERNEL_TARGET static inline vec vabs(const vec a) { return _mm512_abs_pd(a); }
+KERNEL_TARGET static inline vec vmax(const vec a, const vec b) {
+  return _mm512_max_pd(a, b);
+}
+KERNEL_TARGET static inline double vhsum(const vec a) {
+  return _mm512_reduce_add_pd(a);
+}
+KERNEL_TARGET static inline double vhmax(const vec a) {
+  return _mm512_reduce_max_pd(a);
+}
+#include "NNSearcher/distance_kernels_impl.h"
+#undef KERNEL_TARGET
+} // namespace avx512
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+namespace distance_kernels {
+
+// Pick the kernels for the best instruction set supported by this CPU, but
+// not better than requested by the environment variable ATRIAR_SIMD.
+static kernel_table select_kernels() {
+  int limit = 3;
+  const char *requested = getenv("ATRIAR_SIMD");
+  if (requested != nullptr) {
+    if (strcmp(requested, "scalar") == 0)
+      limit = 0;
+    else if (strcmp(requested, "sse2") == 0)
+      limit = 1;
+    else if (strcmp(requested, "avx2") == 0)
+      limit = 2;
+  }
+#if ATRIA_X86_KERNELS
+  __builtin_cpu_init();
+  if ((limit >= 3) && __builtin_cpu_supports("avx512f"))
+    return avx512::make_table("avx512");
+  if ((limit >= 2) && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma"))
+    return avx2::make_table("avx2");
+  if ((limit >= 1) && __builtin_cpu_supports("sse2"))
+    return sse2::make_table("sse2");
+#endif
+  return scalar::make_table("scalar");
+}
+
+const kernel_table &active_kernels() {
+  static const kernel_table table = select_kernels();
+  return table;
+}
+
+} // namespace distance_kernels
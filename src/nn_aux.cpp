@@ -3,29 +3,30 @@
 using namespace std;
 
 long SortedNeighborTable::finish_search(vector<neighbor> &v) {
-  v.reserve(pq.size());
+  if (NNR > SORTED_MAX_NNR)
+    sort_heap(items.begin(), items.begin() + n, neighborCompare());
 
-  while (!pq.empty()) {
-    v.push_back(pq.top());
-    pq.pop();
-  }
-
-  reverse(v.begin(), v.end());
+  v.insert(v.end(), items.begin(), items.begin() + n);
+  n = 0;
   return v.size();
 }
 
-void SortedNeighborTable::insert(const neighbor &x) {
-  pq.push(x);
-
-  while (pq.size() > NNR) {
-    pq.pop();
-  }
-
-  if (pq.size() < NNR) {
-    hd = DBL_MAX;
-  } else {
-    hd = pq.top().dist();
+// Replace the farthest neighbor, which is at the top of the heap, by x and
+// restore the heap property.
+void SortedNeighborTable::replace_top(const neighbor &x) {
+  long i = 0;
+  while (true) {
+    long child = 2 * i + 1;
+    if (child >= n)
+      break;
+    if ((child + 1 < n) && (items[child + 1].dist() > items[child].dist()))
+      child++;
+    if (items[child].dist() <= x.dist())
+      break;
+    items[i] = items[child];
+    i = child;
   }
+  items[i] = x;
 }
 
 #ifdef USE_OWN_CLUSTER_MEMORY_HANDLER